@@ -10,13 +10,13 @@
  * http://pubs.opengroup.org/onlinepubs/9699919799/utilities/vi.html
  * http://linux.die.net/man/1/less
 
-USE_BOXES(NEWTOY(boxes, "w#h#m(mode):a(stickchars)1", TOYFLAG_USR|TOYFLAG_BIN))
+USE_BOXES(NEWTOY(boxes, "e(execute)*f(file):i(ignore-case)t(threads)#F(follow)b(buffers)#s(sync)w#h#m(mode):a(stickchars)1", TOYFLAG_USR|TOYFLAG_BIN))
 
 config BOXES
   bool "boxes"
   default n
   help
-    usage: boxes [-m|--mode mode] [-a|--stickchars] [-w width] [-h height]
+    usage: boxes [-m|--mode mode] [-a|--stickchars] [-s|--sync] [-b|--buffers kilobytes] [-F|--follow] [-t|--threads count] [-i|--ignore-case] [-w width] [-h height] [-e command]... [-f script] [file]
 
     Generic text editor and pager.
 
@@ -30,14 +30,66 @@ config BOXES
       vi is a vi type editor.
 
     Stick chars means to use ASCII for the boxes instead of "graphics" characters.
+
+    Sync means to fsync() files when saving them, so they are on the disk before carrying on.
+
+    If there's no file, or it's "-", and stdin is not a terminal, then stdin is read as it arrives.
+
+    Buffers is how many kilobytes of the file to keep in memory, the rest is read from the file again
+    when it's needed.  For stdin, the rest goes in a temporary file.
+
+    Where the lines are in big files is remembered in $XDG_CACHE_HOME/boxes, so they open quickly next time.
+    Unsaved changes are written to a journal there as well.  If boxes gets killed, the recover command gets them
+    back next time.
+    The first time, threads count the lines of a big file, one per CPU unless told otherwise.  One thread
+    means to just load it all in the background.  Searches of the parts of big files that are not in
+    memory use that many threads as well, ^C stops them in less, more, and vi.
+
+    Follow means to keep showing the end of the file as it grows, like tail -f, even if it gets rotated.
+    In less mode F does the same, and stops following again.
+
+    Cut and copied text goes to a kill ring of the last eight, or to named buffers a to z, given after
+    the command (capitals add to them).  The clipboard command sends it to the terminal's clipboard.
+
+    Searches look for the text as is, except in vi, which uses basic regular expressions, and less and more,
+    which use extended ones.  Emacs has re-search-forward as well.  Ignore case means upper and lower case
+    letters match each other, so does having \c in what's searched for.
+    In emacs ^S and ^R, and in less / and ?, search as it's typed.  Enter stops there, giving up goes back
+    to where it started.  In emacs ^S and ^R again go to the next one.
+    What the last search matches is highlighted everywhere it shows, less ESC u turns that off and on,
+    and vi has :nohlsearch.
+    In less & only shows the lines that match what it asks for, or that don't if that starts with !.
+    & again shows them all.
+    Vi has :s/this/that/g, and :%s for all the lines.  The replace command replaces all of something,
+    mcedit has it on F4, nano on ^\ and ESC r.
+    ex commands can start with line addresses, numbers, . $ 'a /re/ and ?re?, with + and -, and :mark a
+    sets 'a.  :g/re/command does a command on the lines that match, :v on those that don't.
+
+    Execute and file run commands on the file without a terminal, like sed, the commands from file one per line.
+    They are ex commands unless mode says otherwise.  A line after a command that asks for something is the answer.
+    The file is saved after, or if it came from stdin, it goes to stdout.  The source command does the commands
+    in a file as well, only drawing once they are all done.
+    Keyboard macros remember commands and typing, emacs records with ^X( to ^X), and plays with ^Xe.  Vi records
+    into a buffer a to z with qa to q, and plays with @a, @@ plays the last one again.  They are undone as a whole.
+    A count typed before a command in vi, less, and more, or after ^U in emacs, does it that many times, like
+    10000j, up to a million.  Moving, deleting, and cutting lines do it all in one go.  g and G go to that line in
+    less and more, G in vi.
 */
 
 #include "toys.h"
 #include "lib/handlekeys.h"
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 GLOBALS(
   char *mode;
-  long h, w;
+  long h, w, b, t;
+  char *f;
+  struct arg_list *e;
 )
 
 #define TT this.boxes
@@ -46,6 +98,13 @@ GLOBALS(
 #define FLAG_m  4
 #define FLAG_h  8
 #define FLAG_w  16
+#define FLAG_s  32
+#define FLAG_b  64
+#define FLAG_F  128
+#define FLAG_t  256
+#define FLAG_i  512
+#define FLAG_f  1024
+#define FLAG_e  2048
 
 
 /* This is trying to be a generic text editing, text viewing, and terminal
@@ -181,6 +240,7 @@ GLOBALS(
  *    \x1B[m		reset attributes and colours
  *    \x1B[1m		turn on bold
  *    \x1B[%d;%dH	move cursor
+ *    \x1B[%d;%dr	set scrolling region, \x1B[r to reset it
  * Plus some experimentation with turning on mouse reporting that's not
  * currently used.
  *
@@ -190,8 +250,6 @@ GLOBALS(
  * TODO - should split this up into editing, UI, and boxes parts,
  * so the developer can leave out bits they are not using.
  *
- * TODO - Show status line instead of command line when it's not being edited.
- *
  * TODO - should review it all for UTF8 readiness.  Think I can pull that off
  * by keeping everything on the output side as "screen position", and using
  * the formatter to sort out the input to output mapping.
@@ -363,7 +421,7 @@ struct mode
   struct keyCommand *keys;	// An array of key to command mappings.
   struct item *items;		// An array of top level menu items.
   struct item *functionKeys;	// An array of single level "menus".  Used to show key commands.
-  uint8_t flags;		// commandMode.
+  uint8_t flags;		// 1 is commandMode, 2 means digits typed before a command are a count for it.
 };
 
 /*
@@ -390,8 +448,15 @@ struct context			// Defines a context for content.  Text viewer, editor, file br
     // This can be used as the sub struct for various context types.  Like viewer, editor, file browser, top, etc.
     // Could even be an object hierarchy, like generic editor, which Basic vi inherits from.
     //   Or not, since the commands might be different / more of them.
+  uint8_t syntax;		// What searches are, SEARCH_LITERAL, SEARCH_BRE, or SEARCH_ERE.
+  struct search *searches;	// The last few things searched for, compiled, the last one used first.
 };
 
+#define SEARCH_LITERAL	0
+#define SEARCH_BRE	1	// POSIX basic regular expressions, as in vi and grep.
+#define SEARCH_ERE	2	// POSIX extended regular expressions, as in less and grep -E.
+#define SEARCH_CACHE	8	// How many searches a context remembers.
+
 // TODO - might be better off just having a general purpose "widget" which includes details of where it gets attached.
 // Status lines can have them to.
 struct border
@@ -405,9 +470,27 @@ struct line
 {
   struct line *next, *prev;
   uint32_t length;	// Careful, this is the length of the allocated memory for real lines, but the number of lines in the header node.
+    // Zero for lines that still point into the block they where loaded from.
+  uint32_t block;	// Which block of the file this line is in, 0 if none.
   char *line;		// Should be blank for the header.
 };
 
+// Files are loaded a block of lines at a time, each block remembers where it came from in the file.
+// A block gets marked dirty when any of it's lines are changed, so saving can leave the rest alone.
+struct block
+{
+  off_t offset, size;	// Where the block is in the file, and how many bytes, including the line endings.
+  char *data;		// The text, with the line endings replaced by '\0'.  Lines point into this until they are changed.
+  struct line *first;	// The first line in this block, or NULL if they have all been deleted.
+  uint32_t older, newer;	// The least recently used list of blocks that are in memory.
+  uint32_t lines;	// How many lines it had in the file.
+  uint8_t flags;	// dirty, mapped.
+};
+
+#define BLOCK_DIRTY   1
+#define BLOCK_MAPPED  2	// The data is mmap()ed from a spill file, rather than malloc()ed.
+#define BLOCK_PINNED  4	// Lines that still point into the data where cut out of it, so it has to stay.
+
 struct damage
 {
   struct damage *next;	// A list for faster draws?
@@ -417,6 +500,31 @@ struct damage
     // Note - likely a pointer into the middle of the line list in a content.
 };
 
+// Undo is a journal of what was changed, in an arena of variable sized records.  Each is a struct undoOp, followed by
+// the text that was inserted or deleted, newlines and all, so a whole paste is just one record.
+#define UNDO_INSERT  1
+#define UNDO_DELETE  2
+#define UNDO_GROUP   4	// The first record of what one command did, undo and redo go a group at a time.
+#define UNDO_TYPED   8	// Typed characters, these get added to the last record if they follow on from it.
+
+#define UNDO_MAX  (16 * 1024 * 1024)	// The oldest groups get thrown away when the journal gets bigger than this.
+
+struct undoOp
+{
+  uint32_t size, prev;	// Of this record, and the one before it, so we can step either way.
+  uint32_t y, x;	// Where it happened, a line number, and a byte in that line.
+  uint32_t length;	// Of the text that follows, which has a '\0' after it.
+  uint8_t flags;
+};
+
+struct undo
+{
+  char *arena;
+  size_t size, length, at;	// How big the arena is, how much is used, and how much of that is done.  The rest can be redone.
+  size_t last;			// Where the last record starts.
+  int group;			// The next record starts a new group.
+};
+
 struct content		// For various instances of context types.  
     // Editor / text viewer might have several files open, so one of these per file.
     // MC might have several directories open, one of these per directory.  No idea why you might want to do this.  lol
@@ -424,9 +532,33 @@ struct content		// For various instances of context types.
   struct context *context;
   char *name, *file, *path;
   struct line lines;
+  struct block *blocks;	// An array of blockCount + 1 blocks, 0 is not used.
+  uint32_t blockCount;
+  struct stat st;	// What the file looked like when we last loaded or saved it.
+  int fd;		// Where more of the text is still coming from, a pipe for instance, or -1.
+  off_t loaded;		// How much has been read from there so far.
+  char *partial;	// The partial line at the end of the last read, waiting for the rest of it.
+  off_t partialLen;
+  off_t room;		// How much more a pipe's last block has room for, so a slow pipe doesn't make lots of tiny ones.
+  int spill;		// A temporary file to put blocks read from a pipe into when there's too many, or -1.
+  off_t resident, spilled;	// How much of the pipe is in memory, and how much in the spill file.
+  uint32_t spillBlock;	// The last block that was spilled, or skipped because it can't be.
+  int notify;		// inotify for following the file as it grows, or -1.
+  int page;		// The file, for reading evicted blocks back in from, or -1.
+  off_t budget;		// How much of the text to keep in memory, 0 for all of it.
+  uint32_t oldest, newest;	// Ends of the least recently used list of blocks.
+  struct line *tail;	// While following, the partial line is shown here until the rest of it turns up.
+  struct indexing *indexing;	// Threads counting the lines of the rest of the file, or NULL.
+  struct undo undo;
+  struct journal *journal;	// Where unsaved changes get written, in case we die, or NULL.
+  char *recovery;	// The good part of the journal from last time, this time's gets written over it.
+  off_t recoverySize;
+  uint32_t marks[26];	// Lines marked a to z for ex addresses, their line number plus one, 0 if not set.
 //  file type
 //  double linked list of bookmarks, pointer to line, character position, length (or ending position?), type, blob for types to keep context.
   uint16_t minW, minH, maxW, maxH;
+  uint32_t logged;	// For histories, the number of entries in the file, duplicates and all.
+  uint32_t generation;	// Goes up whenever the text might change, so anything remembered about it can be checked.
   uint8_t flags;	// readOnly, modified.
     // This can be used as the sub struct for various content types.
 };
@@ -443,7 +575,8 @@ struct _view
   void *data;			// The context controls this blob, it's specific to each box.
   uint32_t offsetX, offsetY;	// Offset within the content, coz box handles scrolling, usually.
   uint16_t X, Y, W, H;		// Position and size of the content area within the box.  Calculated, but cached coz that might be needed for speed.
-  uint16_t cX, cY;		// Cursor position within the content.
+  uint16_t cX;			// Cursor position within the content.
+  uint32_t cY;			// Files can have a lot more lines than lines have characters.
   uint16_t iX, oW;		// Cursor position inside the lines input text, in case the formatter makes it different, and output length.
   char *output;			// The current line formatted for output.
   uint8_t flags;		// redrawStatus, redrawBorder;
@@ -451,13 +584,48 @@ struct _view
   // Assumption is that each box has it's own editLine (likely the line being edited), or that there's a box that is just the editLine (emacs minibuffer, and command lines for other proggies).
   struct line *line;		// Pointer to the current line, might be the only line.
   char *prompt;			// Optional prompt for the editLine.
+  uint32_t mY, mX;		// The mark, in bytes of the input text, for cutting and copying from there to the cursor.
+  uint8_t marked;		// If the mark has been set.
+  struct highlight *highlights;	// Where the last search matches in lines that have been drawn, or NULL.
+  uint32_t highlighted;		// Which search generation they are for.
+  struct filter *filter;	// Only some of the lines are shown, or NULL for all of them.
 
 // Display mode / format hook.
 // view specific bookmarks, including highlighted block and it's type.
-// Linked list of selected lines for a filtered view, or processing only those lines.
+// Linked list of selected lines for processing only those lines.
 // Linked list of pointers to struct keyCommand, for emacs keymaps hierarchy, and anything similar in other editors.  Plus some way of dealing with emacs minor mode keymaps.
 };
 
+// Where the last search matches in a line that was drawn, so scrolling doesn't have to look again.
+struct highlight
+{
+  char *text;		// The line's text, NULL if this one is not used yet.
+  uint32_t generation;	// Of the content when it was looked at.
+  uint32_t count;	// How many matches.
+  uint32_t *matches;	// The start and end byte of each.
+};
+
+#define HIGHLIGHT_BITS  8	// Each view remembers 1 << this many lines, more than fit on any screen.
+
+// A view can show only the lines that match a search, or only those that don't.  Which lines they are is found a bit
+// at a time in the background, and again as more lines turn up.  The view's cY and offsetY are rows of these then,
+// not line numbers.
+struct filter
+{
+  struct search *search;	// It's own copy.
+  int invert;			// Show the lines that don't match instead.
+  uint32_t *rows;		// The line numbers of the lines shown, in order.
+  uint32_t count, size;
+  uint32_t at;			// The line number of the view's current line.
+  uint32_t y;			// How many lines have been looked at so far.
+  // Where to carry on looking from, the first line of block, or line, or if neither, line number y.  Clean blocks
+  // can be evicted, so it only stops part way through the dirty ones.
+  uint32_t block;
+  struct line *line;
+  int walking;			// Still looking, in the background.
+  size_t undoLength, undoAt;	// If these change, the text did, so it starts again.
+};
+
 struct _box
 {
   box *sub1, *sub2, *parent;
@@ -470,20 +638,150 @@ struct _box
 };
 
 
+// Other things besides the keyboard that the main loop keeps an eye on.
+// Those with an fd of -1 get called when there's nothing else to do, until they delete themselves.
+struct watcher
+{
+  struct watcher *next;
+  int fd;
+  void (*handler)(struct watcher *watcher);
+  void *data;
+};
+
 // Sometimes you just can't avoid circular definitions.
 void drawBox(box *box);
+void drawHold(void);
+void drawRelease(void);
+void addWatcher(int fd, void (*handler)(struct watcher *watcher), void *data);
+void delWatcher(int fd, void *data);
+void loadMore(struct watcher *watcher);
+void indexProgress(struct watcher *watcher);
+int searchStop(view *view);
+void isearchFound(view *view, int found);
+void isearchEnd(int keep);
+struct highlight *highlightLine(view *view, char *text);
+char *commandRange(view *view, char *command);
+void undoCursor(view *view, uint32_t y, uint32_t x);
+void statusContent(box *box, struct content *content, char *status);
 
 
 #define BOX_HSPLIT  1	// Marks if it's a horizontally or vertically split.
 #define BOX_BORDER  2	// Mark if it has a border, often full screen boxes wont.
+#define BOX_HELD  4	// Wanted drawing while the drawing was held, so gets drawn when it's let go.
+
+#define CONTENT_HISTORY  1	// A command line history, the file is an append only log.
+#define CONTENT_FOLLOW   2	// Keep reading the end of it as it grows, like tail -f.
+#define CONTENT_LOADING  4	// The rest of the file is still being loaded in the background.
+#define CONTENT_JOURNAL  8	// There's unsaved changes from last time in recovery, that could be recovered.
+#define CONTENT_SPLICED  16	// Lots of lines where spliced in, so which block they are in isn't known until it's saved.
 
 static int overWriteMode;
 static box *rootBox;	// Parent of the rest of the boxes, or the only box.  Always a full screen.
 static box *currentBox;
 static view *commandLine;
 static int commandMode;
+static char *commandArgument;	// What came after the command name, for those commands that take one.
+static uint32_t commandFrom, commandTo;	// The range of lines an ex command was given, if commandRanged.
+static int commandRanged;
+static eventHandler promptHandler;	// What gets the command line as it's argument, when a command asked for one.
+static int promptEmpty;	// The prompt handler wants to know about empty answers to.
+static char *promptSaved;	// The command line prompt from before it asked.
+static int headless;	// Running a script without a terminal, so nothing gets drawn.
+static int drawHeld;	// How many things, like scripts, want the drawing held until they are done.
+static int lineHeld;	// updateLine() was wanted while the drawing was held.
+static int macroDepth;	// How many keyboard macros are playing.
+static int undoHeld;	// Keyboard macros and repeated commands are undone as a whole.
+static long typedCount;	// The count typed before a command, vi's 10j, emacs' ^U 10 ^N.
+static int typedCounting;	// 1 after emacs' ^U, digits replace the count, 2 once digits where typed.
+static long commandCount;	// The count the command being done was given, 0 once it's used.
+static int commandFailed;	// The command being done couldn't do what it was asked, it's status line says why.
+
+#define COUNT_MAX  1000000	// Bigger counts are likely mistakes, and typing a key that many times takes memory.
 
 #define MEM_SIZE  128	// Chunk size for line memory allocation.
+#define BLOCK_SIZE  (256 * 1024)	// How much of a file to read at once.
+
+// The lines in a block run up to the first line of the next block that still has some.
+struct line *blockEnd(struct content *content, uint32_t b)
+{
+  while (++b <= content->blockCount)
+    if (content->blocks[b].first)
+      return content->blocks[b].first;
+
+  return &(content->lines);
+}
+
+// Mark the block a line is in as dirty, and the text as changed.
+void dirtyLine(struct content *content, struct line *line)
+{
+  if (content)
+    content->generation++;
+  if (content && line->block && (line->block <= content->blockCount))
+    content->blocks[line->block].flags |= BLOCK_DIRTY;
+}
+
+// Text that lines have their own copy of has a count of how many lines share it just before it, so copies of lines
+// can share the text until one of them changes it.
+#define TEXT_HEAD  8
+
+char *textAlloc(uint32_t size)
+{
+  uint32_t *head = xzalloc(size + TEXT_HEAD);
+
+  *head = 1;
+  return ((char *) head) + TEXT_HEAD;
+}
+
+char *textRealloc(char *text, uint32_t size)
+{
+  return ((char *) xrealloc(text - TEXT_HEAD, size + TEXT_HEAD)) + TEXT_HEAD;
+}
+
+// Let go of the text of a line, freeing it if no other line shares it.
+void freeText(struct line *line)
+{
+  uint32_t *head;
+
+  if (line->length && line->line && !--*(head = (uint32_t *) (line->line - TEXT_HEAD)))
+    free(head);
+}
+
+// Add a copy of a line to the end of content, sharing it's text.
+struct line *shareLine(struct content *content, struct line *from)
+{
+  struct line *result = xzalloc(sizeof(struct line));
+
+  if ((result->length = from->length))
+    (*(uint32_t *) (from->line - TEXT_HEAD))++;
+  result->line = from->line;
+  result->block = from->block;
+  result->prev = content->lines.prev;
+  result->next = &(content->lines);
+  content->lines.prev->next = result;
+  content->lines.prev = result;
+  content->lines.length++;
+
+  return result;
+}
+
+// Lines from a file point into their block, and copied lines share their text, so give them their own copy before
+// changing them.
+void ownLine(struct line *line)
+{
+  uint32_t *head = line->length ? (uint32_t *) (line->line - TEXT_HEAD) : NULL;
+
+  if ((!head) || (1 < *head))
+  {
+    char *text = line->line;
+    uint32_t len = strlen(text);
+
+    if (head)
+      (*head)--;
+    line->length = (((len + 1) / MEM_SIZE) + 1) * MEM_SIZE;
+    line->line = textAlloc(line->length);
+    memcpy(line->line, text, len + 1);
+  }
+}
 
 // Inserts the line after the given line, or at the end of content if no line.
 struct line *addLine(struct content *content, struct line *line, char *text, uint32_t length)
@@ -496,7 +794,7 @@ struct line *addLine(struct content *content, struct line *line, char *text, uin
   // Round length up.
   len = (((length + 1) / MEM_SIZE) + 1) * MEM_SIZE;
   result = xzalloc(sizeof(struct line));
-  result->line = xzalloc(len);
+  result->line = textAlloc(len);
   result->length = len;
   strncpy(result->line, text, length);
 
@@ -505,6 +803,20 @@ struct line *addLine(struct content *content, struct line *line, char *text, uin
     if (!line)
       line = content->lines.prev;
 
+    // It goes into the same block as the line before it, or the one after it if it's the new first line.
+    // If there's neither, any block will do, so use the last one.
+    if (&(content->lines) != line)
+      result->block = line->block;
+    else if (&(content->lines) != line->next)
+      result->block = line->next->block;
+    else
+      result->block = content->blockCount;
+    // Spliced in lines might say they are in a block that's not where they are, so don't start blocks from them.
+    if (result->block && (result->block <= content->blockCount) && ((content->blocks[result->block].first == line->next)
+      || ((!content->blocks[result->block].first) && !(content->flags & CONTENT_SPLICED))))
+      content->blocks[result->block].first = result;
+    dirtyLine(content, result);
+
     result->next = line->next;
     result->prev = line;
 
@@ -527,1085 +839,8147 @@ void freeLine(struct content *content, struct line *line)
   line->next->prev = line->prev;
   line->prev->next = line->next;
   if (content)
+  {
     content->lines.length--;
-  free(line->line);
+    dirtyLine(content, line);
+    if (line->block && (line->block <= content->blockCount) && (content->blocks[line->block].first == line))
+    {
+      struct line *next = line->next;
+
+      content->blocks[line->block].first = (blockEnd(content, line->block) != next) ? next : NULL;
+    }
+  }
+  freeText(line);
   free(line);
 }
 
-void loadFile(struct content *content)
+// Blocks in memory are kept in least recently used order, so the oldest can be evicted first.
+void lruRemove(struct content *content, uint32_t b)
 {
-  int fd = open(content->path, O_RDONLY);
+  struct block *block = &(content->blocks[b]);
+
+  if (block->older)
+    content->blocks[block->older].newer = block->newer;
+  else if (content->oldest == b)
+    content->oldest = block->newer;
+  if (block->newer)
+    content->blocks[block->newer].older = block->older;
+  else if (content->newest == b)
+    content->newest = block->older;
+  block->older = block->newer = 0;
+}
 
-  if (-1 != fd)
+void lruTouch(struct content *content, uint32_t b)
+{
+  if ((!b) || (b > content->blockCount) || (content->newest == b))
+    return;
+  lruRemove(content, b);
+  content->blocks[b].older = content->newest;
+  if (content->newest)
+    content->blocks[content->newest].newer = b;
+  else
+    content->oldest = b;
+  content->newest = b;
+}
+
+// Make lines out of block b's data from c on, and put them after the line after.  There should be count of them, 0
+// means however many there are.  Returns the last one.
+struct line *moreLines(struct content *content, uint32_t b, char *c, struct line *after, uint32_t count)
+{
+  struct block *block = &(content->blocks[b]);
+  char *end = block->data + block->size, *nl;
+  uint32_t i = 0;
+
+  *end = '\0';
+  while (count ? (i++ < count) : (c < end))
   {
-    char *temp = NULL;
-    long len;
+    struct line *line = xzalloc(sizeof(struct line));
 
-    do
+    // If the file changed out from under us, there might not be enough of them, so make up the rest.
+    line->line = end;
+    if (c < end)
     {
-      // TODO - get_rawline() is slow, and wont help much with DOS and Mac line endings.
-      temp = get_rawline(fd, &len, '\n');
-      if (temp)
-      {
-        if (temp[len - 1] == '\n')
-            temp[--len] = '\0';
-        addLine(content, NULL, temp, len);
-      }
-    } while (temp);
-    close(fd);
+      if (!(nl = memchr(c, '\n', end - c)))
+        nl = end;
+      *nl = '\0';
+      line->line = c;
+      c = nl + 1;
+    }
+    line->block = b;
+    line->prev = after;
+    line->next = after->next;
+    after->next->prev = line;
+    after->next = line;
+    after = line;
+    content->lines.length++;
+    if (!block->first)
+      block->first = line;
   }
+
+  return after;
 }
 
-// TODO - load and save should be able to deal with pipes, and with loading only parts of files, to load more parts later.
+// Make lines out of all of block b's data.
+struct line *blockLines(struct content *content, uint32_t b, struct line *after, uint32_t count)
+{
+  content->blocks[b].first = NULL;
+  return moreLines(content, b, content->blocks[b].data, after, count);
+}
 
-void saveFile(struct content *content)
+// Add a block of whole lines from offset in the file to the end of the content.
+// The data should have room for a '\0' after size bytes, and now belongs to the block.
+struct block *addBlock(struct content *content, off_t offset, char *data, off_t size)
 {
-// TODO - Should do "Save as" as well.  Which is just a matter of changing content->path before calling this.
-  int fd;
+  struct block *block;
+  uint32_t before = content->lines.length;
+
+  if (!(content->blockCount % 256))
+    content->blocks = xrealloc(content->blocks, (content->blockCount + 257) * sizeof(struct block));
+  block = &(content->blocks[++content->blockCount]);
+  memset(block, 0, sizeof(struct block));
+  block->offset = offset;
+  block->size = size;
+  block->data = data;
+  blockLines(content, content->blockCount, content->lines.prev, 0);
+  block->lines = content->lines.length - before;
+  lruTouch(content, content->blockCount);
+
+  return block;
+}
 
-  fd = open(content->path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+void freeBlocks(struct content *content)
+{
+  uint32_t b;
 
-  if (-1 != fd)
+  content->generation++;
+  for (b = 1; b <= content->blockCount; b++)
   {
-    struct line *line = content->lines.next;
-
-    while (&(content->lines) != line)  // We are at the end if we have wrapped to the beginning.
-    {
-      write(fd, line->line, strlen(line->line));
-      write(fd, "\n", 1);
-      line = line->next;
-    }
-    close(fd);
+    if (content->blocks[b].flags & BLOCK_MAPPED)
+      munmap(content->blocks[b].data, content->blocks[b].size + 1);
+    else
+      free(content->blocks[b].data);
   }
+  free(content->blocks);
+  content->blocks = NULL;
+  content->blockCount = 0;
+  content->room = 0;
+}
+
+// Read what's available from content->fd, and add the whole lines as a new block.  A pipe's last block keeps the
+// rest of it's buffer, and what's read goes on the end of it while it fits, the lines never move.
+// Returns how much was read, 0 at the end, when any partial last line gets added as well.
+ssize_t readBlock(struct content *content)
+{
+  struct block *block = &(content->blocks[content->blockCount]);
+  off_t len = content->partialLen, size, room = content->room;
+  int grow = content->blockCount && (room > len) && !(block->flags & BLOCK_DIRTY)
+    && !(content->flags & CONTENT_SPLICED);
+  char *data;
+  ssize_t got;
+
+  if (grow)
+    data = block->data + block->size;
   else
+    data = xmalloc((room = len + BLOCK_SIZE) + 1);
+
+  // Whatever was left over from the last read is a partial line, so it starts off this one.
+  if (len)
+    memcpy(data, content->partial, len);
+  free(content->partial);
+  content->partial = NULL;
+  content->partialLen = 0;
+
+  do
+    got = read(content->fd, &(data[len]), room - len);
+  while ((0 > got) && (EINTR == errno));
+  if (0 < got)
+    len += got;
+
+  // Only whole lines go in a block, except at the end of the file, unless we are following it.
+  for (size = len; size && ('\n' != data[size - 1]) && ((0 < got) || (-1 != content->notify)); size--)
+    ;
+  if (size < len)
+  {
+    content->partialLen = len - size;
+    content->partial = xmalloc(content->partialLen);
+    memcpy(content->partial, &(data[size]), content->partialLen);
+  }
+  if (size && grow)
+  {
+    uint32_t before = content->lines.length;
+
+    block->size += size;
+    moreLines(content, content->blockCount, data, content->lines.prev, 0);
+    block->lines += content->lines.length - before;
+  }
+  else if (size)
+  {
+    // Shrink it before the lines start pointing into it, unless it's a pipe that might have more to add to it soon.
+    if (content->path)
+      data = xrealloc(data, size + 1);
+    addBlock(content, content->loaded, data, size);
+  }
+  else if (!grow)
+    free(data);
+  if (size)
+    content->room = content->path ? 0 : (room - size);
+  if (size)
   {
-    fprintf(stderr, "Can't open file %s\n", content->path);
-    exit(1);
+    content->loaded += size;
+    content->resident += size;
   }
+
+  return got;
 }
 
-struct content *addContent(char *name, struct context *context, char *filePath)
+// Check if the file is still the one we loaded or saved, so it's blocks are where we think they are.
+int sameFile(struct content *content, struct stat *st)
 {
-  struct content *result  = xzalloc(sizeof(struct content));
+  return (content->st.st_dev == st->st_dev) && (content->st.st_ino == st->st_ino) && (content->st.st_size == st->st_size)
+    && (content->st.st_mtim.tv_sec == st->st_mtim.tv_sec) && (content->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec);
+}
 
-  result->lines.next  = &(result->lines);
-  result->lines.prev  = &(result->lines);
-  result->name    = strdup(name);
-  result->context    = context;
+// Large files don't have to fit in memory.  Once there's more than the budget of them loaded, the least recently used
+// blocks that have not been changed are evicted.  All that's left of them is a stub line, with no text, and length
+// set to how many lines it stands for, so line numbers still work.  They get read back in from the file when needed.
 
-  if (filePath)
+int isStub(struct content *content, struct line *line)
+{
+  return (!line->line) && (&(content->lines) != line);
+}
+
+// Open the file to read evicted blocks back in from, if it's still the one we loaded.
+int pageFile(struct content *content)
+{
+  struct stat st;
+
+  if ((-1 == content->page) && content->path
+    && (-1 != (content->page = open(content->path, O_RDONLY | O_CLOEXEC)))
+    && (fstat(content->page, &st) || !sameFile(content, &st)))
   {
-    result->path = strdup(filePath);
-    loadFile(result);
+    close(content->page);
+    content->page = -1;
   }
 
-  return result;
+  return -1 != content->page;
 }
 
-// General purpose line moosher.  Used for appends, inserts, overwrites, and deletes.
-// TODO - should have the same semantics as mooshStrings, only it deals with whole lines in double linked lists.
-// We need content so we can adjust it's number of lines if needed.
-void mooshLines(struct content *content, struct line *result, struct line *moosh, uint16_t index, uint16_t length, int insert)
+// Swap a clean block's lines for a stub line.
+void pageOut(struct content *content, uint32_t b)
 {
+  struct block *block = &(content->blocks[b]);
+  struct line *line = block->first, *end = blockEnd(content, b), *stub, *next;
+
+  if (!line)
+    return;
+  // The text is going away, something else might end up where it was.
+  content->generation++;
+  stub = xzalloc(sizeof(struct line));
+  stub->block = b;
+  stub->prev = line->prev;
+  for (; end != line; line = next)
+  {
+    next = line->next;
+    stub->length++;
+    freeText(line);
+    free(line);
+  }
+  stub->next = end;
+  stub->prev->next = stub;
+  end->prev = stub;
+  block->first = stub;
+  free(block->data);
+  block->data = NULL;
+  content->resident -= block->size;
+  lruRemove(content, b);
 }
 
-// General purpose string moosher.  Used for appends, inserts, overwrites, and deletes.
-void mooshStrings(struct line *result, char *moosh, uint16_t index, uint16_t length, int insert)
+// Read an evicted block back in, in place of it's stub line.  Returns the first of it's lines.
+struct line *pageIn(struct content *content, struct line *stub)
 {
-  char *c, *pos;
-  int limit = strlen(result->line);
-  int mooshLen = 0, resultLen;
-
-  if (moosh)
-    mooshLen = strlen(moosh);
+  struct block *block = &(content->blocks[stub->block]);
+  struct line *prev = stub->prev;
+  ssize_t got = 0;
+
+  block->data = xmalloc(block->size + 1);
+  if (pageFile(content) && (0 > (got = pread(content->page, block->data, block->size, block->offset))))
+    got = 0;
+  memset(&(block->data[got]), 0, block->size - got);
+
+  prev->next = stub->next;
+  stub->next->prev = prev;
+  content->lines.length -= stub->length;
+  blockLines(content, stub->block, prev, stub->length);
+  content->resident += block->size;
+  lruTouch(content, stub->block);
+  free(stub);
+
+  return prev->next;
+}
 
-  /*
-   * moosh  == NULL  a deletion
-   * length == 0    simple insertion
-   * length <  mooshlen  delete some, insert moosh
-   * length == mooshlen  exact overwrite.
-   * length >  mooshlen  delete a lot, insert moosh
-   */
+// The line after this one, reading it in if it was evicted.
+struct line *nextLine(struct content *content, struct line *line)
+{
+  line = line->next;
+  if (isStub(content, line))
+    return pageIn(content, line);
+  lruTouch(content, line->block);
+  return line;
+}
 
-  mooshLen -= length;
-  resultLen = limit + mooshLen;
+// The line before this one, reading it in if it was evicted.
+struct line *prevLine(struct content *content, struct line *line)
+{
+  struct line *next = line;
 
-  // If we need more space, allocate more.
-  if (resultLen > result->length)
+  line = line->prev;
+  if (isStub(content, line))
   {
-    result->length = resultLen + MEM_SIZE;
-    result->line = xrealloc(result->line, result->length);
+    pageIn(content, line);
+    return next->prev;
   }
+  lruTouch(content, line->block);
+  return line;
+}
 
-  if (limit <= index)  // At end, just add to end.
-  {
-    // TODO - Possibly add spaces to pad out to where index is?
-    //          Would be needed for "go beyond end of line" and "column blocks".
-    //          Both of those are advanced editing.
-    index = limit;
-    insert = 1;
-  }
+// Which block a line is in, if that block has not changed, so it still has the lines it had in the file.  0 if not.
+uint32_t cleanBlock(struct content *content, struct line *line)
+{
+  uint32_t b = line->block;
 
-  pos = &(result->line[index]);
+  if (b && (b <= content->blockCount) && !(content->blocks[b].flags & BLOCK_DIRTY)
+    && !(content->flags & CONTENT_SPLICED))
+    return b;
+  return 0;
+}
 
-  if (insert)  // Insert / delete before current character, so move it and the rest up / down mooshLen bytes.
+// Move count lines on from line, or back if count is negative.  Evicted blocks that are skipped over stay evicted,
+// and blocks that have not changed get skipped over all at once.
+struct line *stepLines(struct content *content, struct line *line, long count)
+{
+  struct line *next, *last;
+  uint32_t b;
+
+  while (0 < count)
   {
-    if (0 < mooshLen)  // Gotta move things up.
+    if (&(content->lines) == (next = line->next))
+      break;
+    if (isStub(content, next) && (next->length < count))
     {
-      c = &(result->line[limit]);
-      while (c >= pos)
-      {
-        *(c + mooshLen) = *c;
-        c--;
-      }
+      line = next;
+      count -= next->length;
     }
-    else if (0 > mooshLen)  // Gotta move things down.
+    else if ((b = cleanBlock(content, next)) && (content->blocks[b].first == next)
+      && (content->blocks[b].lines <= count) && ((last = blockEnd(content, b)->prev)->block == b))
     {
-      c = pos;
-      while (*c)
-      {
-        *c = *(c - mooshLen);  // A double negative.
-        c++;
-      }
+      line = last;
+      count -= content->blocks[b].lines;
+    }
+    else
+    {
+      line = nextLine(content, line);
+      count--;
     }
   }
-
-  if (moosh)
+  while (0 > count)
   {
-    c = moosh;
-    do
+    if (&(content->lines) == (next = line->prev))
+      break;
+    if (isStub(content, next) && (next->length < -count))
     {
-      *pos++ = *c++;
+      line = next;
+      count += next->length;
+    }
+    else if ((b = cleanBlock(content, next)) && (blockEnd(content, b) == line) && (content->blocks[b].lines <= -count))
+    {
+      line = content->blocks[b].first;
+      count += content->blocks[b].lines;
+    }
+    else
+    {
+      line = prevLine(content, line);
+      count++;
     }
-    while (*c);
   }
+
+  // Ran off the end, while skipping a stub.
+  if (isStub(content, line))
+  {
+    next = line->next;
+    line = pageIn(content, line);
+    if (0 < count)
+      line = next->prev;
+  }
+
+  return line;
 }
 
-// TODO - Should draw the current border in green, the text as default (or highlight / bright).
-//          Then allow one other box to be red bordered (MC / dired destination box).
-//          All other boxes with dark gray border, and dim text.
-void drawLine(int y, int start, int end, char *left, char *internal, char *contents, char *right, int current)
+void trimBlocks(struct content *content);
+void replaceViewLine(box *box, struct line *old, struct line *new);
+void journalReset(struct content *content);
+off_t journalRead(struct content *content, char **data);
+
+// Counting the lines of a huge file takes a while, so once it's been done, the result is kept in a cache file.  It
+// has the size and number of lines of each block, so reopening the file only has to make a stub for each block.  If
+// the file has only grown since, the rest of it gets loaded as usual, and the cache extended.
+
+#define INDEX_MIN  (64 * BLOCK_SIZE)	// Smaller files are quick enough to count again.
+#define INDEX_TAIL  4096		// How much of the end of what was indexed to check for changes.
+
+// The cache file starts with one of these, followed by count indexBlocks.
+struct indexHead
 {
-  int size = strlen(internal);
-  int len = (end - start) * size, x = 0;
-  char line[len + 1];
+  char magic[8];		// "boxesIX1"
+  uint64_t dev, ino, size;	// Which file, and how big it was.
+  int64_t sec, nsec;		// When it was last modified.
+  uint64_t count, tail;		// How many blocks, and a hash of the last INDEX_TAIL bytes.
+};
 
-  if ('\0' != left[0])  // Assumes that if one side has a border, then so does the other.
-    len -= 2 * size;
+struct indexBlock
+{
+  uint64_t size;
+  uint32_t lines, newline;	// If it ends with a newline.  Only the last one might not.
+};
 
-  if (contents)
-  {
-    // strncpy wont add a null at the end if the source is longer, but will pad with nulls if source is shorter.
-    // So it's best to put a safety null in first.
-    line[len] = '\0';
-    strncpy(line, contents, len);
-    // Make sure the following while loop pads out line with the internal character.
-    x = strlen(line);
-  }
-  while (x < len)
+uint64_t hashBytes(char *data, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;  // FNV-1a
+
+  while (len--)
+    h = (h ^ (unsigned char) *data++) * 1099511628211ULL;
+
+  return h;
+}
+
+// Where the cache for this file goes, or NULL.
+char *indexPath(struct content *content)
+{
+  char *path = realpath(content->path, NULL), *result = NULL;
+
+  if (path)
   {
-    strcpy(&line[x], internal);
-    x += size;
+    if (getenv("XDG_CACHE_HOME"))
+      result = xmprintf("%s/boxes/%016llx", getenv("XDG_CACHE_HOME"), (unsigned long long) hashBytes(path, strlen(path)));
+    else if (getenv("HOME"))
+      result = xmprintf("%s/.cache/boxes/%016llx", getenv("HOME"), (unsigned long long) hashBytes(path, strlen(path)));
+    free(path);
   }
-  line[x++] = '\0';
-  if ('\0' == left[0])  // Assumes that if one side has a border, then so does the other.
+
+  return result;
+}
+
+// The cache directory might not exist yet, make it for the cache file at path.
+void cacheDir(char *path)
+{
+  char *slash, *parent;
+
+  if ((slash = strrchr(path, '/')))
   {
-    if (current)
-      printf("\x1B[1m\x1B[%d;%dH%s\x1B[m", y + 1, start + 1, line);
-    else
-      printf("\x1B[m\x1B[%d;%dH%s", y + 1, start + 1, line);
+    *slash = '\0';
+    if (mkdir(path, 0700) && (ENOENT == errno) && (parent = strrchr(path, '/')))
+    {
+      *parent = '\0';
+      mkdir(path, 0700);
+      *parent = '/';
+      mkdir(path, 0700);
+    }
+    *slash = '/';
   }
-  else
+}
+
+// Hash the end of what's in the first size bytes of the file.
+uint64_t indexTail(int fd, off_t size)
+{
+  off_t len = (INDEX_TAIL < size) ? INDEX_TAIL : size;
+
+  if (pread(fd, toybuf, len, size - len) != len)
+    return 0;
+  return hashBytes(toybuf, len);
+}
+
+// Add an evicted block, one that's only a stub.
+void addStub(struct content *content, off_t offset, off_t size, uint32_t lines)
+{
+  struct block *block;
+  struct line *stub;
+
+  if (!(content->blockCount % 256))
+    content->blocks = xrealloc(content->blocks, (content->blockCount + 257) * sizeof(struct block));
+  block = &(content->blocks[++content->blockCount]);
+  memset(block, 0, sizeof(struct block));
+  block->offset = offset;
+  block->size = size;
+  block->lines = lines;
+  if (lines)
   {
-    if (current)
-      printf("\x1B[1m\x1B[%d;%dH%s%s%s\x1B[m", y + 1, start + 1, left, line, right);
-    else
-      printf("\x1B[m\x1B[%d;%dH%s%s%s", y + 1, start + 1, left, line, right);
+    block->first = stub = xzalloc(sizeof(struct line));
+    stub->block = content->blockCount;
+    stub->length = lines;
+    stub->next = &(content->lines);
+    stub->prev = content->lines.prev;
+    content->lines.prev->next = stub;
+    content->lines.prev = stub;
+    content->lines.length += lines;
   }
 }
 
-void formatCheckCursor(view *view, long *cX, long *cY, char *input)
+// Use the cache if it's for this file, or what it used to be before it grew.  Returns how much of it's covered.
+off_t readIndex(struct content *content)
 {
-  int i = 0, o = 0, direction = (*cX) - view->cX;
+  struct indexHead head;
+  struct indexBlock *blocks = NULL;
+  char *path;
+  off_t offset = 0;
+  uint64_t b, count;
+  int fd;
 
-  // Adjust the cursor if needed, depending on the contents of the line, and the direction of travel.
-  while (input[i])
+  if ((INDEX_MIN > content->st.st_size) || !(path = indexPath(content)))
+    return 0;
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+  if (-1 == fd)
+    return 0;
+
+  if ((readall(fd, &head, sizeof(head)) == sizeof(head)) && !memcmp(head.magic, "boxesIX1", 8)
+    && (head.dev == content->st.st_dev) && (head.ino == content->st.st_ino) && (head.size <= content->st.st_size)
+    && ((head.size < content->st.st_size)
+      || ((head.sec == content->st.st_mtim.tv_sec) && (head.nsec == content->st.st_mtim.tv_nsec)))
+    && (head.count < (head.size / 2) + 2) && (head.tail == indexTail(content->fd, head.size)))
   {
-    // When o is equal to the cX position, update the iX position to be where i is.
-    if ('\t' == input[i])
+    blocks = xmalloc(head.count * sizeof(struct indexBlock));
+    if (readall(fd, blocks, head.count * sizeof(struct indexBlock)) != (head.count * sizeof(struct indexBlock)))
+      head.count = 0;
+    // If it grew, and the last line was not finished, it might be longer now.
+    count = head.count;
+    if (count && (head.size < content->st.st_size) && !blocks[count - 1].newline)
+      count--;
+    for (b = 0; b < count; b++)
     {
-      int j = 8 - (i % 8);
-
-      // Check if the cursor is in the middle of the tab.
-      if (((*cX) > o) && ((*cX) < (o + j)))
-      {
-        if (0 <= direction)
-        {
-          *cX = (o + j);
-          view->iX = i + 1;
-        }
-        else
-        {
-          *cX = o;
-          view->iX = i;
-        }
-      }
-      o += j;
+      addStub(content, offset, blocks[b].size, blocks[b].lines);
+      offset += blocks[b].size;
     }
+    free(blocks);
+  }
+  close(fd);
+
+  return offset;
+}
+
+// Write the cache, once we know where all the lines are.
+void writeIndex(struct content *content)
+{
+  struct indexHead head;
+  struct indexBlock *blocks;
+  char *path, *temp;
+  uint32_t b;
+  int fd;
+
+  if ((INDEX_MIN > content->st.st_size) || (content->flags & (CONTENT_LOADING | CONTENT_HISTORY)) || !pageFile(content)
+    || !(path = indexPath(content)))
+    return;
+  for (b = 1; b <= content->blockCount; b++)
+    if (content->blocks[b].flags & BLOCK_DIRTY)
+      break;
+  if (b <= content->blockCount)
+  {
+    free(path);
+    return;
+  }
+
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, "boxesIX1", 8);
+  head.dev = content->st.st_dev;
+  head.ino = content->st.st_ino;
+  head.size = content->st.st_size;
+  head.sec = content->st.st_mtim.tv_sec;
+  head.nsec = content->st.st_mtim.tv_nsec;
+  head.count = content->blockCount;
+  head.tail = indexTail(content->page, head.size);
+  blocks = xzalloc((head.count + 1) * sizeof(struct indexBlock));
+  for (b = 1; b <= content->blockCount; b++)
+  {
+    blocks[b - 1].size = content->blocks[b].size;
+    blocks[b - 1].lines = content->blocks[b].lines;
+    blocks[b - 1].newline = 1;
+  }
+  // Only the last line might not end in a newline, the rest of the file will tell us if it has it when it grows.
+  if (b > 1)
+  {
+    struct block *block = &(content->blocks[b - 1]);
+
+    blocks[b - 2].newline = (1 == pread(content->page, toybuf, 1, block->offset + block->size - 1)) && ('\n' == toybuf[0]);
+  }
+
+  cacheDir(path);
+  temp = xmprintf("%s.XXXXXX", path);
+  if (-1 != (fd = mkstemp(temp)))
+  {
+    if ((writeall(fd, &head, sizeof(head)) == sizeof(head))
+      && (writeall(fd, blocks, head.count * sizeof(struct indexBlock)) == (head.count * sizeof(struct indexBlock)))
+      && !close(fd))
+      rename(temp, path);
     else
     {
-      if ((*cX) == o)
-        view->iX = i;
-      o++;
+      close(fd);
+      unlink(temp);
     }
-    i++;
   }
-  // One more check in case the cursor is at the end of the line.
-  if ((*cX) == o)
-    view->iX = i;
+  free(temp);
+  free(blocks);
+  free(path);
 }
 
-// TODO - Should convert control characters to reverse video, and deal with UTF8.
+// The first time a huge file is opened, counting it's lines is mostly waiting for the disk, and memchr() through
+// what it gives us.  So several threads each count their own part of the file, noting only where the blocks are
+// and how many lines each has, same as the cache does.  The blocks become stubs, their lines get read in when
+// they are looked at, like evicted blocks.  The main loop carries on while the threads work.
 
-/* FIXME - We get passed a NULL input, apparently when the file length is close to the screen length. -
-> On Thu, 6 Sep 2012 11:56:17 +0800 Roy Tam <roytam@gmail.com> wrote:
->   
-> > 2012/9/6 David Seikel <onefang@gmail.com>:  
-> > >> Program received signal SIGSEGV, Segmentation fault.
-> > >> formatLine (view=0x8069168, input=0x0, output=0x806919c)
-> > >>     at toys/other/boxes.c:843
-> > >> 843        int len = strlen(input), i = 0, o = 0;
-> > >> (gdb) bt
-> > >> #0  formatLine (view=0x8069168, input=0x0, output=0x806919c)
-> > >>     at toys/other/boxes.c:843
-> > >> #1  0x0804f1dd in moveCursorAbsolute (view=0x8069168, cX=0,
-> > >> cY=10, sX=0, sY=0) at toys/other/boxes.c:951
-> > >> #2  0x0804f367 in moveCursorRelative (view=0x8069168, cX=0,
-> > >> cY=10, sX=0, sY=0) at toys/other/boxes.c:1011
-> > >> #3  0x0804f479 in upLine (view=0x8069168, event=0x0) at
-> > >> toys/other/boxes.c:1442 #4  0x0804fb63 in handleKey
-> > >> (view=0x8069168, i=2, keyName=<optimized out>, buffer=0xbffffad8
-> > >> "\033[A") at toys/other/boxes.c:1593 #5  0x0805008d in editLine
-> > >> (view=0x8069168, X=-1, Y=-1, W=-1, H=-1) at
-> > >> toys/other/boxes.c:1785 #6  0x08050288 in boxes_main () at
-> > >> toys/other/boxes.c:2482 #7  0x0804b262 in toy_exec
-> > >> (argv=0xbffffd58) at main.c:104 #8  0x0804b29d in toybox_main ()
-> > >> at main.c:118 #9  0x0804b262 in toy_exec (argv=0xbffffd54) at
-> > >> main.c:104 #10 0x0804b29d in toybox_main () at main.c:118
-> > >> #11 0x0804affa in main (argc=5, argv=0xbffffd54) at main.c:159  
-> > >
-> > > No segfault here when I try that, nor with different files.  As I
-> > > said, it has bugs.  I have seen other cases before when NULL lines
-> > > are passed around near that code.  Guess I've not got them all.
-> > > Might help to mention what terminal proggy you are using, it's
-> > > size in characters, toybox version, OS, etc.  Something is
-> > > different between you and me.  
-> > 
-> > Terminal Program: PuTTY
-> > Windows size: 80 * 25 chars
-> > Toybox version: hg head
-> > OS: Linux 3.2 (Debian wheezy)
-> > File: Toybox LICENSE file  
-> 
-> I'll install PuTTY, try toybox hg head, and play with them later, see
-> if I can reproduce that segfault.  I use the last released tarball of
-> toybox, an old Ubuntu, and a bunch of other terminal proggies.  I did
-> not know that PuTTY had been ported to Unix.
-> 
-> But as I mentioned, not interested in a bug hunt right now.  That will
-> be more appropriate when it's less of a "sandbox for testing the
-> ideas" and more of a "good enough to bother using".  Always good to
-> have other terminals for testing though.  
+#define INDEX_CHUNK  (16 * BLOCK_SIZE)	// Not worth a thread for less than this.
+#define INDEX_THREADS  64
+#define INDEX_POKE  64			// How many blocks each thread counts between telling the main loop.
 
-Seems to be sensitive to the number of lines.  On my usual huge
-roxterm, using either toybox 0.4 or hg head, doing this -
+struct indexer
+{
+  pthread_t thread;
+  int fd, wake;			// The file, and the pipe to poke the main loop with.
+  off_t start, end, done;	// The part of the file this one counts, and how much of it is done.
+  struct indexBlock *blocks;	// What it found.
+  uint64_t count;
+  int started, failed, finished;
+};
 
-./toybox boxes -m less LICENSE -h 25
+struct indexing
+{
+  int wake[2];			// The threads write to this now and then, so the main loop wakes up.
+  off_t start;			// Where they started from.
+  int count;
+  struct indexer *threads;
+};
 
-and just hitting down arrow until you get to the bottom of the page
-segfaults as well.  -h means "pretend the terminal is that many lines
-high", there's a similar -w as well.  80x25 in any other terminal did
-the same.  For that particular file (17 lines long), any value of -h
-between 19 and 34 will segfault after some moving around.  -h 35 makes
-it segfault straight away.  Less than 19 or over 35 is fine.  Longer
-files don't have that problem, though I suspect it will happen on
-shortish files where the number of lines is about the length of the
-screen.
+// Where the first line that starts at or after offset is, or end if there's none before then.
+off_t indexLineStart(int fd, off_t offset, off_t end)
+{
+  char buf[4096], *nl;
+  ssize_t got;
 
-I guess that somewhere I'm doing maths wrong and getting an out of
-bounds line number when the file length is close to the screen length.
-I'll make note of that, and fix it when I next get time to beat on
-boxes.
+  // A line starts at offset if the one before ended just before it.
+  for (offset--; offset < end; offset += got)
+  {
+    do
+      got = pread(fd, buf, sizeof(buf), offset);
+    while ((0 > got) && (EINTR == errno));
+    if (0 >= got)
+      break;
+    if ((nl = memchr(buf, '\n', got)))
+      return ((offset + (nl - buf) + 1) < end) ? offset + (nl - buf) + 1 : end;
+  }
 
-Thanks for reporting it Roy.
-*/
+  return end;
+}
 
-int formatLine(view *view, char *input, char **output)
+void *indexThread(void *data)
 {
-  int len = strlen(input), i = 0, o = 0;
-
-  *output = xrealloc(*output, len + 1);
+  struct indexer *ix = data;
+  char *buf = xmalloc(BLOCK_SIZE), *c, *end;
+  off_t offset, size, last;
+  ssize_t got;
+  uint32_t lines;
 
-  while (input[i])
+  for (offset = ix->start; offset < ix->end; offset += size)
   {
-    if ('\t' == input[i])
+    // Whole lines only, up to the last newline in a blocks worth, or further for a really long line.
+    for (lines = 0, size = 0, last = 0; (!last) && ((offset + size) < ix->end); size += got)
     {
-      int j = 8 - (i % 8);
-
-      *output = xrealloc(*output, len + j + 1);
-      for (; j; j--)
+      do
+        got = pread(ix->fd, buf, (BLOCK_SIZE < (ix->end - offset - size)) ? BLOCK_SIZE : ix->end - offset - size,
+          offset + size);
+      while ((0 > got) && (EINTR == errno));
+      // If the file shrank, or something else went wrong, the main loop will load it the slow way.
+      if (0 >= got)
       {
-        (*output)[o++] = ' ';
-        len++;
+        ix->failed = 1;
+        goto done;
+      }
+      for (c = buf, end = buf + got; (c = memchr(c, '\n', end - c)); c++)
+      {
+        lines++;
+        last = size + (c - buf) + 1;
       }
-      len--;  // Not counting the actual tab character itself.
     }
+    // The end of the file might not have a newline.
+    if (last)
+      size = last;
     else
-      (*output)[o++] = input[i];
-    i++;
+      lines++;
+
+    if (!(ix->count % 256))
+      ix->blocks = xrealloc(ix->blocks, (ix->count + 256) * sizeof(struct indexBlock));
+    ix->blocks[ix->count].size = size;
+    ix->blocks[ix->count].lines = lines;
+    ix->blocks[ix->count++].newline = !!last;
+    __atomic_store_n(&(ix->done), offset + size - ix->start, __ATOMIC_RELAXED);
+    if (!(ix->count % INDEX_POKE))
+      writeall(ix->wake, "", 1);
   }
-  (*output)[o++] = '\0';
 
-  return len;
+done:
+  free(buf);
+  __atomic_store_n(&(ix->finished), 1, __ATOMIC_RELEASE);
+  writeall(ix->wake, "", 1);
+  return NULL;
 }
 
-void drawContentLine(view *view, int y, int start, int end, char *left, char *internal, char *contents, char *right, int current)
+// Start threads counting the lines in the rest of the file, if it's big enough to be worth it.
+int indexStart(struct content *content)
 {
-  char *temp = NULL;
-  int offset = view->offsetX, len;
+  struct indexing *indexing;
+  struct indexer *ix;
+  long threads = (toys.optflags & FLAG_t) ? TT.t : sysconf(_SC_NPROCESSORS_ONLN);
+  off_t left = content->st.st_size - content->loaded;
+  int i;
+
+  if (threads > (left / INDEX_CHUNK))
+    threads = left / INDEX_CHUNK;
+  if (threads > INDEX_THREADS)
+    threads = INDEX_THREADS;
+  if ((2 > threads) || (content->flags & CONTENT_HISTORY))
+    return 0;
+  indexing = xzalloc(sizeof(struct indexing));
+  if (pipe2(indexing->wake, O_CLOEXEC | O_NONBLOCK))
+  {
+    free(indexing);
+    return 0;
+  }
 
-  if (contents == view->line->line)
+  // The partial line at the end of what's loaded gets counted again.
+  free(content->partial);
+  content->partial = NULL;
+  content->partialLen = 0;
+  indexing->start = content->loaded;
+  indexing->count = threads;
+  indexing->threads = xzalloc(threads * sizeof(struct indexer));
+  for (i = 0; i < threads; i++)
   {
-    view->oW = formatLine(view, contents, &(view->output));
-    temp = view->output;
-    len = view->oW;
+    ix = &(indexing->threads[i]);
+    ix->fd = content->fd;
+    ix->wake = indexing->wake[1];
+    ix->start = i ? indexing->threads[i - 1].end : content->loaded;
+    ix->end = ((i + 1) < threads) ? indexLineStart(content->fd, content->loaded + (left / threads) * (i + 1),
+      content->st.st_size) : content->st.st_size;
+    if (!(ix->started = !pthread_create(&(ix->thread), NULL, indexThread, ix)))
+      ix->failed = ix->finished = 1;
   }
-  else  // Only time we are not drawing the current line, and only used for drawing the entire page.
-    len = formatLine(NULL, contents, &(temp));
+  content->indexing = indexing;
 
-  if (offset > len)
-    offset = len;
-  drawLine(y, start, end, left, internal, &(temp[offset]), right, current);
+  return 1;
 }
 
-void updateLine(view *view)
+// Wait for the threads to finish, then add stubs for all the blocks they found.
+void indexFinish(struct content *content)
 {
-  int y, len;
+  struct indexing *indexing = content->indexing;
+  struct indexer *ix;
+  off_t offset = indexing->start;
+  uint64_t b;
+  int i, failed = 0;
 
-  // Coz things might change out from under us, find the current view.  Again.
-  if (commandMode)	view = commandLine;
-  else		view = currentBox->view;
+  for (i = 0; i < indexing->count; i++)
+  {
+    ix = &(indexing->threads[i]);
+    if (ix->started)
+      pthread_join(ix->thread, NULL);
+    failed |= ix->failed;
+  }
+  for (i = 0; i < indexing->count; i++)
+  {
+    ix = &(indexing->threads[i]);
+    for (b = 0; (!failed) && (b < ix->count); b++)
+    {
+      addStub(content, offset, ix->blocks[b].size, ix->blocks[b].lines);
+      offset += ix->blocks[b].size;
+    }
+    free(ix->blocks);
+  }
+  delWatcher(indexing->wake[0], content);
+  close(indexing->wake[0]);
+  close(indexing->wake[1]);
+  free(indexing->threads);
+  free(indexing);
+  content->indexing = NULL;
+
+  // Otherwise it gets loaded the slow way.
+  if (!failed)
+  {
+    content->loaded = offset;
+    close(content->fd);
+    content->fd = -1;
+    content->flags &= ~CONTENT_LOADING;
+    writeIndex(content);
+  }
+  else
+    lseek(content->fd, content->loaded, SEEK_SET);
+  // Either way, this finishes off the loading.
+  addWatcher(-1, loadMore, content);
+}
 
-  // TODO - When doing scripts and such, might want to turn off the line update until finished.
-  // Draw the prompt and the current line.
-  y = view->Y + (view->cY - view->offsetY);
-  len = strlen(view->prompt);
-  drawLine(y, view->X, view->X + view->W, "", " ", view->prompt, "", 0);
-  drawContentLine(view, y, view->X + len, view->X + view->W, "", " ", view->line->line, "", 1);
-  // Move the cursor.
-  printf("\x1B[%d;%dH", y + 1, view->X + len + (view->cX - view->offsetX) + 1);
-  fflush(stdout);
+#define LOAD_FIRST  1024	// How many lines to load before showing anything, the rest loads in the background.
+
+// Load until there's more than want lines.  Returns 0 once it's all loaded.
+int loadLines(struct content *content, uint32_t want)
+{
+  while (content->flags & CONTENT_LOADING)
+  {
+    if (content->lines.length > want)
+      return 1;
+    if (content->indexing)
+      indexFinish(content);
+    else if (0 >= readBlock(content))
+    {
+      close(content->fd);
+      content->fd = -1;
+      content->flags &= ~CONTENT_LOADING;
+      writeIndex(content);
+    }
+    trimBlocks(content);
+  }
+  return 0;
 }
 
-void doCommand(view *view, char *command)
+// Open the file, and load the first screen full of it.
+int loadStart(struct content *content)
 {
-  if (command)
+  if (-1 == (content->fd = open(content->path, O_RDONLY | O_CLOEXEC)))
+    return 0;
+  fstat(content->fd, &(content->st));
+  // If the cache covers the lot, there's nothing left to load.
+  if ((content->loaded = readIndex(content)) == content->st.st_size)
   {
-    struct function *functions = view->content->context->commands;
-    int i;
+    close(content->fd);
+    content->fd = -1;
+    return 0;
+  }
+  lseek(content->fd, content->loaded, SEEK_SET);
+  content->flags |= CONTENT_LOADING;
+  return loadLines(content, LOAD_FIRST);
+}
 
-// TODO - Some editors have a shortcut command concept.  The smallest unique first part of each command will match, as well as anything longer.
-//          A further complication is if we are not implementing some commands that might change what is "shortest unique prefix".
+void loadFile(struct content *content)
+{
+  if (loadStart(content))
+    loadLines(content, UINT32_MAX);
+}
 
-    for (i = 0; functions[i].name; i++)
+
+#define SAVE_IOVS  1024	// How many iovecs to hand to each writev(), two per line.
+#define SAVE_TAIL  (4 * 1024 * 1024)	// Saving in place will rewrite up to this much of the end of a file.
+
+// Write the lines from first, up to but not including end, gathered into writev() batches.
+int writeLines(int fd, struct line *first, struct line *end)
+{
+  struct iovec iov[SAVE_IOVS], *v;
+  struct line *line = first;
+  ssize_t len;
+  size_t total;
+  int count;
+
+  while (end != line)
+  {
+    for (count = 0, total = 0; (end != line) && (count < SAVE_IOVS); line = line->next)
+    {
+      iov[count].iov_base = line->line;
+      total += iov[count++].iov_len = strlen(line->line);
+      iov[count].iov_base = "\n";
+      total += iov[count++].iov_len = 1;
+    }
+
+    // writev() can stop short, so keep going until the lot is written.
+    for (v = iov; total; total -= len)
     {
-      if (strcmp(functions[i].name, command) == 0)
+      if (0 > (len = writev(fd, v, count)))
       {
-        if (functions[i].handler)
-        {
-          functions[i].handler(view);
-          updateLine(view);
-        }
-        break;
+        if (EINTR == errno)
+          len = 0;
+        else
+          return -1;
+      }
+      while (count && (len >= v->iov_len))
+      {
+        len -= v->iov_len;
+        total -= v->iov_len;
+        v++;
+        count--;
+      }
+      if (count)
+      {
+        v->iov_base = ((char *) v->iov_base) + len;
+        v->iov_len -= len;
       }
     }
   }
+
+  return 0;
 }
 
-int moveCursorAbsolute(view *view, long cX, long cY, long sX, long sY)
+// How many bytes the lines from first, up to but not including end, take up in a file.
+off_t linesSize(struct line *first, struct line *end)
 {
-  struct line *newLine = view->line;
-  long oX = view->offsetX, oY = view->offsetY;
-  long lX = view->oW, lY = view->content->lines.length - 1;
-  long nY = view->cY;
-  uint16_t w = view->W - 1, h = view->H - 1;
-  int moved = 0, updatedY = 0, endOfLine = 0;
+  off_t result = 0;
 
-  // Check if it's still within the contents.
-  if (0 > cY)    // Trying to move before the beginning of the content.
-    cY = 0;
-  else if (lY < cY)  // Trying to move beyond end of the content.
-    cY = lY;
-  if (0 > cX)    // Trying to move before the beginning of the line.
-  {
-    // See if we can move to the end of the previous line.
-    if (view->line->prev != &(view->content->lines))
-    {
-      cY--;
-      endOfLine = 1;
-    }
-    else
-      cX = 0;
-  }
-  else if (lX < cX)  // Trying to move beyond end of line.
+  for (; end != first; first = first->next)
+    result += strlen(first->line) + 1;
+
+  return result;
+}
+
+// Copy the lines from first, up to but not including end, into buf as they would be in a file.
+char *linesText(char *buf, struct line *first, struct line *end)
+{
+  for (; end != first; first = first->next)
   {
-    // See if we can move to the begining of the next line.
-    if (view->line->next != &(view->content->lines))
-    {
-      cY++;
-      cX = 0;
-    }
-    else
-      cX = lX;
+    int len = strlen(first->line);
+
+    memcpy(buf, first->line, len);
+    buf += len;
+    *buf++ = '\n';
   }
 
-  // Find the new line.
-  while (nY != cY)
+  return buf;
+}
+
+// Copy part of one file onto the end of another, inside the kernel if it can do that.
+int copyRange(int from, off_t offset, int to, off_t size)
+{
+  ssize_t len;
+  int kernel = 1;
+
+  while (0 < size)
   {
-    updatedY = 1;
-    if (nY < cY)
+    if (kernel)
     {
-      newLine = newLine->next;
-      nY++;
-      if (view->content->lines.prev == newLine)  // We are at the end if we have wrapped to the beginning.
-        break;
+      if (0 > (len = copy_file_range(from, &offset, to, NULL, size, 0)))
+      {
+        if ((ENOSYS != errno) && (EXDEV != errno) && (EINVAL != errno) && (EOPNOTSUPP != errno))
+          return -1;
+        kernel = 0;
+        continue;
+      }
     }
-    else
+    else if (0 < (len = pread(from, toybuf, (size < sizeof(toybuf)) ? size : sizeof(toybuf), offset)))
     {
-      newLine = newLine->prev;
-      nY--;
-      if (view->content->lines.next == newLine)  // We are at the end if we have wrapped to the beginning.
-        break;
+      if (writeall(to, toybuf, len) != len)
+        return -1;
+      offset += len;
     }
+    if (0 == len)  // The file got shorter on us.
+      errno = EIO;
+    if (0 >= len)
+      return -1;
+    size -= len;
   }
-  cY = nY;
 
-  // Check if we have moved past the end of the new line.
-  if (updatedY)
-  {
-    // Format it.
-    view->oW = formatLine(view, newLine->line, &(view->output));
-    if (view->oW < cX)
-      endOfLine = 1;
-    if (endOfLine)
-      cX = view->oW;
-  }
-
-  // Let the formatter decide if it wants to adjust things.
-  // It's up to the formatter to deal with things if it changes cY.
-  // On the other hand, changing cX is it's job.
-  formatCheckCursor(view, &cX, &cY, newLine->line);
+  return 0;
+}
 
-  // Check the scrolling.
-  lY -= view->H - 1;
-  oX += sX;
-  oY += sY;
+// Write only the dirty blocks, when they are still the same size, over the top of the old ones.
+// If some blocks changed size, but only near the end of the file, rewrite just that bit.
+// This isn't atomic like a full save, but saving a one character fix shouldn't mean rewriting gigabytes.
+// Returns 1 if the changes don't fit, otherwise 0 if it worked, or -1 with errno set.
+int saveInPlace(struct content *content, char *path, off_t *sizes)
+{
+  char *old = NULL, *new = NULL, *end = NULL;
+  off_t start = content->st.st_size, oldTail = 0, newTail = 0;
+  uint32_t b, k;
+  int fd, result = 0;
 
-  if (oY > cY)      // Trying to move above the box.
-    oY += cY - oY;
-  else if ((oY + h) < cY)    // Trying to move below the box
-    oY += cY - (oY + h);
-  if (oX > cX)      // Trying to move to the left of the box.
-    oX += cX - oX;
-  else if ((oX + w) <= cX)  // Trying to move to the right of the box.
-    oX += cX - (oX + w);
+  for (k = 1; k <= content->blockCount; k++)
+    if (sizes[k] != content->blocks[k].size)
+      break;
+  if (k <= content->blockCount)
+  {
+    start = content->blocks[k].offset;
+    oldTail = content->st.st_size - start;
+    for (b = k; b <= content->blockCount; b++)
+      newTail += sizes[b];
+    if ((SAVE_TAIL < oldTail) || (SAVE_TAIL < newTail))
+      return 1;
+  }
+  if (-1 == (fd = open(path, O_RDWR)))
+    return -1;
 
-  if (oY < 0)
-    oY = 0;
-  if (oY >= lY)
-    oY = lY;
-  if (oX < 0)
-    oX = 0;
-  // TODO - Should limit oX to less than the longest line, minus box width.
-  //          Gonna be a pain figuring out what the longest line is.
-  //          On the other hand, don't think that will be an actual issue unless "move past end of line" is enabled, and that's an advanced editor thing.
-  //          Though still might want to do that for the longest line on the new page to be.
+  // Read in the old tail before we start stomping on it.
+  if (oldTail)
+  {
+    old = xmalloc(oldTail);
+    if (pread(fd, old, oldTail, start) != oldTail)
+      result = -1;
+  }
+  if (newTail)
+    end = new = xmalloc(newTail);
 
-  if ((view->cX != cX) || (view->cY != cY))
-    moved = 1;
+  for (b = 1; (!result) && (b <= content->blockCount); b++)
+  {
+    struct block *block = &(content->blocks[b]);
 
-  // Actually update stuff, though some have been done already.
-  view->cX = cX;
-  view->cY = cY;
-  view->line = newLine;
+    if (b >= k)
+    {
+      if (block->flags & BLOCK_DIRTY)
+      {
+        if (block->first)
+          end = linesText(end, block->first, blockEnd(content, b));
+      }
+      else
+      {
+        memcpy(end, &(old[block->offset - start]), block->size);
+        end += block->size;
+      }
+    }
+    else if (block->flags & BLOCK_DIRTY)
+    {
+      char *text = xmalloc(sizes[b] + 1);
 
-  // Handle scrolling.
-  if ((view->offsetX != oX) || (view->offsetY != oY))
+      linesText(text, block->first, blockEnd(content, b));
+      if (pwrite(fd, text, sizes[b], block->offset) != sizes[b])
+        result = -1;
+      free(text);
+    }
+  }
+  if ((!result) && (k <= content->blockCount))
   {
-    view->offsetX = oX;
-    view->offsetY = oY;
-
-    if (view->box)
-      drawBox(view->box);
+    if ((newTail && (pwrite(fd, new, newTail, start) != newTail)) || ftruncate(fd, start + newTail))
+      result = -1;
   }
+  if ((!result) && (toys.optflags & FLAG_s) && fsync(fd))
+    result = -1;
+  if (!result)
+    fstat(fd, &(content->st));
+  free(old);
+  free(new);
+  if (close(fd))
+    result = -1;
 
-  return moved;
+  return result;
 }
 
-int moveCursorRelative(view *view, long cX, long cY, long sX, long sY)
+// Write the whole content, copying the clean blocks from the old file if we are given it.
+int writeContent(int fd, struct content *content, int from)
 {
-  return moveCursorAbsolute(view, view->cX + cX, view->cY + cY, sX, sY);
-}
+  uint32_t b;
 
-void sizeViewToBox(box *box, int X, int Y, int W, int H)
-{
-  uint16_t one = 1, two = 2;
+  if (!content->blockCount)
+    return writeLines(fd, content->lines.next, &(content->lines));
 
-  if (!(box->flags & BOX_BORDER))
+  for (b = 1; b <= content->blockCount; b++)
   {
-      one = 0;
-      two = 0;
+    struct block *block = &(content->blocks[b]);
+
+    if ((-1 != from) && !(block->flags & BLOCK_DIRTY))
+    {
+      if (copyRange(from, block->offset, fd, block->size))
+        return -1;
+    }
+    else if (block->first && writeLines(fd, block->first, blockEnd(content, b)))
+      return -1;
   }
-  box->view->X = X;
-  box->view->Y = Y;
-  box->view->W = W;
-  box->view->H = H;
-  if (0 > X)  box->view->X = box->X + one;
-  if (0 > Y)  box->view->Y = box->Y + one;
-  if (0 > W)  box->view->W = box->W - two;
-  if (0 > H)  box->view->H = box->H - two;
+
+  return 0;
 }
 
-view *addView(char *name, struct context *context, char *filePath, uint16_t X, uint16_t Y, uint16_t W, uint16_t H)
+// Saves to a temporary file in the same directory, then renames that over the original, so a crash or a full disk
+// half way through leaves the original alone.  The original's mode and ownership are kept.  The parts that have not
+// changed are copied straight from the original, and small enough changes are just written in place instead.
+// With -s the file and it's directory are fsync()ed as well.  Returns 0 if it worked, or -1 with errno set.
+int saveFile(struct content *content)
 {
-  view *result = xzalloc(sizeof(struct _view));
+// TODO - Should do "Save as" as well.  Which is just a matter of changing content->path before calling this.
+  struct stat st;
+  off_t *sizes = NULL;
+  char *path, *temp, *slash;
+  int fd, from, result = 1, error = 0;
+  uint32_t b;
 
-  result->X = X;
-  result->Y = Y;
-  result->W = W;
-  result->H = H;
+  if (!content->path)
+  {
+    errno = ENOENT;
+    return -1;
+  }
+  // Can't save what we don't have yet.
+  loadLines(content, UINT32_MAX);
 
-  result->content = addContent(name, context, filePath);
-  result->prompt = xzalloc(1);
-  // If there was content, format it's first line as usual, otherwise create an empty first line.
-  if (result->content->lines.next != &(result->content->lines))
+  // Rename over what a symlink points to, not the symlink.  If it doesn't exist yet, we are creating it.
+  if (!(path = realpath(content->path, NULL)))
+    path = strdup(content->path);
+
+  // Only use the old file if it's the one we loaded.
+  if ((-1 != (from = open(path, O_RDONLY))) && (fstat(from, &st) || !sameFile(content, &st)))
   {
-    result->line = result->content->lines.next;
-    result->oW = formatLine(result, result->line->line, &(result->output));
+    close(from);
+    from = -1;
+  }
+
+  if (content->blockCount)
+  {
+    sizes = xmalloc((content->blockCount + 1) * sizeof(off_t));
+    for (b = 1; b <= content->blockCount; b++)
+    {
+      // Spliced in lines could be in any block that's not evicted, so write them all.
+      if ((content->flags & CONTENT_SPLICED) && !(content->blocks[b].first && isStub(content, content->blocks[b].first)))
+        content->blocks[b].flags |= BLOCK_DIRTY;
+      if (content->blocks[b].flags & BLOCK_DIRTY)
+        sizes[b] = content->blocks[b].first ? linesSize(content->blocks[b].first, blockEnd(content, b)) : 0;
+      else
+        sizes[b] = content->blocks[b].size;
+    }
+    if (-1 != from)
+      result = saveInPlace(content, path, sizes);
+  }
+
+  if (1 == result)
+  {
+    // Evicted blocks have to come from the file they where loaded from, even if something else is there now.
+    if ((-1 == from) && (-1 != content->page))
+      from = dup(content->page);
+    result = -1;
+    temp = xmprintf("%s.XXXXXX", path);
+    if (-1 != (fd = mkstemp(temp)))
+    {
+      if (stat(path, &st))
+      {
+        mode_t mask = umask(0);
+
+        umask(mask);
+        st.st_mode = (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH) & ~mask;
+      }
+      else
+        fchown(fd, st.st_uid, st.st_gid);  // Only root can give files away, so it's fine if this fails.
+
+      if ((!fchmod(fd, st.st_mode & 07777)) && (!writeContent(fd, content, from))
+        && ((!(toys.optflags & FLAG_s)) || (!fsync(fd))) && (!fstat(fd, &st)))
+        result = 0;
+      error = errno;
+      if (close(fd) && !result)
+      {
+        error = errno;
+        result = -1;
+      }
+      if (!result && (result = rename(temp, path)))
+        error = errno;
+      if (result)
+        unlink(temp);
+      else
+      {
+        content->st = st;
+        if (toys.optflags & FLAG_s)
+        {
+          // Make sure the rename itself is on the disk.
+          if ((slash = strrchr(path, '/')))
+            *(slash + 1) = '\0';
+          if (-1 != (fd = open(slash ? path : ".", O_RDONLY)))
+          {
+            fsync(fd);
+            close(fd);
+          }
+        }
+      }
+    }
+    else
+      error = errno;
+    free(temp);
   }
   else
+    error = errno;
+
+  // Now the blocks are where we just put them.
+  if (!result)
   {
-    result->line = addLine(result->content, NULL, "\0", 0);
-    result->output = xzalloc(1);
+    off_t offset = 0;
+
+    for (b = 1; b <= content->blockCount; b++)
+    {
+      struct block *block = &(content->blocks[b]);
+      struct line *line, *end = blockEnd(content, b);
+
+      block->offset = offset;
+      offset += block->size = sizes[b];
+      if (block->flags & BLOCK_DIRTY)
+        for (block->lines = 0, line = block->first; line && (end != line); line = line->next)
+        {
+          line->block = b;
+          block->lines++;
+        }
+      block->flags &= ~BLOCK_DIRTY;
+    }
+    content->flags &= ~CONTENT_SPLICED;
+    // Evicted blocks get read back in from the new file.
+    if (-1 != content->page)
+      close(content->page);
+    content->page = -1;
+    writeIndex(content);
+    journalReset(content);
   }
+  if (-1 != from)
+    close(from);
+  free(sizes);
+  free(path);
+  errno = error;
 
   return result;
 }
 
-box *addBox(char *name, struct context *context, char *filePath, uint16_t X, uint16_t Y, uint16_t W, uint16_t H)
+struct content *addContent(char *name, struct context *context, char *filePath)
 {
-  box *result = xzalloc(sizeof(struct _box));
+  struct content *result  = xzalloc(sizeof(struct content));
 
-  result->X = X;
-  result->Y = Y;
-  result->W = W;
-  result->H = H;
-  result->view = addView(name, context, filePath, X, Y, W, H);
-  result->view->box = result;
-  sizeViewToBox(result, X, Y, W, H);
+  result->lines.next  = &(result->lines);
+  result->lines.prev  = &(result->lines);
+  result->name    = strdup(name);
+  result->context    = context;
+  result->fd = -1;
+  result->spill = -1;
+  result->notify = -1;
+  result->page = -1;
+
+  if (filePath)
+  {
+    result->path = strdup(filePath);
+    if (loadStart(result))
+    {
+      if (indexStart(result))
+        addWatcher(result->indexing->wake[0], indexProgress, result);
+      else
+        addWatcher(-1, loadMore, result);
+    }
+    // Unsaved changes from last time can be recovered.  Keep them, the first edit starts this time's journal.
+    if ((result->recoverySize = journalRead(result, &(result->recovery))))
+      result->flags |= CONTENT_JOURNAL;
+  }
 
   return result;
 }
 
-void freeBox(box *box)
+// Command line history.
+// The history file is an append only log, so hitting Enter costs one write() no matter how big the history gets.
+// Several boxes sessions can share the same history file.  Each entry is appended with a single write() to an
+// O_APPEND file, so entries from different sessions don't get mixed up with each other.  Once the log gets
+// big enough, it's compacted, duplicates removed, and the result atomically renamed over the old log.
+
+// Remove all but the last copy of each line, and blank lines, except for keep.  Returns how many went.
+int dedupLines(struct content *content, struct line *keep)
 {
-  if (box)
+  struct line **table, *line, *prev;
+  uint32_t size = 64, mask, h;
+  int result = 0;
+  char *c;
+
+  while (size < content->lines.length * 2)
+    size *= 2;
+  mask = size - 1;
+  table = xzalloc(size * sizeof(struct line *));
+
+  // Going backwards, so the first one we see is the one we keep.
+  for (line = content->lines.prev; &(content->lines) != line; line = prev)
   {
-    freeBox(box->sub1);
-    freeBox(box->sub2);
-    if (box->view)
+    prev = line->prev;
+    if (line == keep)
+      continue;
+    if ('\0' != line->line[0])
     {
-      // In theory the line should not be part of the content if there is no content, so we should free it.
-      if (!box->view->content)
-        freeLine(NULL, box->view->line);
-      free(box->view->prompt);
-      free(box->view->output);
-      free(box->view);
+      for (h = 2166136261u, c = line->line; *c; c++)  // FNV-1a
+        h = (h ^ (unsigned char) *c) * 16777619;
+      while (table[h & mask] && strcmp(table[h & mask]->line, line->line))
+        h++;
+      if (!table[h & mask])
+      {
+        table[h & mask] = line;
+        continue;
+      }
     }
-    free(box);
+    freeLine(content, line);
+    result++;
   }
+  free(table);
+
+  return result;
 }
 
-void drawBox(box *box)
+// Open and lock the history file.
+// Compaction might rename a new file over the one we opened while we where waiting for the lock, so check for that.
+static int lockHistory(char *path, int flags, int lock)
 {
-  // This could be heavily optimized, but let's keep things simple for now.
-  // Optimized for sending less characters I mean, on slow serial links for instance.
-
-  char **bchars = (toys.optflags & FLAG_a) ? borderChars[0] : borderChars[1];
-  char *left = "\0", *right = "\0";
-  struct line *lines = NULL;
-  int y = box->Y, current = (box == currentBox);
-  uint16_t h = box->Y + box->H;
-
-  if (current)
-    bchars = (toys.optflags & FLAG_a) ? borderCharsCurrent[0] : borderCharsCurrent[1];
+  struct stat opened, named;
+  int fd;
 
-  // Slow and laborious way to figure out where in the linked list of lines we start from.
-  // Wont scale well, but is simple.
-  if (box->view && box->view->content)
+  while (-1 != (fd = open(path, flags | O_CREAT, S_IRUSR | S_IWUSR)))
   {
-    int i = box->view->offsetY;
-
-    lines = &(box->view->content->lines);
-    while (i--)
-    {
-      lines = lines->next;
-      if (&(box->view->content->lines) == lines)  // We are at the end if we have wrapped to the beginning.
-        break;
-    }
+    if (flock(fd, lock) || fstat(fd, &opened) || stat(path, &named))
+      break;
+    if ((opened.st_dev == named.st_dev) && (opened.st_ino == named.st_ino))
+      return fd;
+    close(fd);
   }
+  if (-1 != fd)
+    close(fd);
 
-  if (box->flags & BOX_BORDER)
+  return -1;
+}
+
+// Rewrite the history file without the duplicates, including what other sessions have added since we loaded it.
+void compactHistory(struct content *content)
+{
+  struct content log;
+  int fd = lockHistory(content->path, O_RDWR, LOCK_EX);
+
+  if (-1 != fd)
   {
-    h--;
-    left = right = bchars[1];
-    drawLine(y++, box->X, box->X + box->W, bchars[2], bchars[0], NULL, bchars[3], current);
+    memset(&log, 0, sizeof(log));
+    log.lines.next = &(log.lines);
+    log.lines.prev = &(log.lines);
+    log.fd = -1;
+    log.spill = -1;
+    log.notify = -1;
+    log.page = -1;
+    log.path = content->path;
+    loadFile(&log);
+    dedupLines(&log, NULL);
+
+    // Anyone waiting on our lock will notice the rename, and open the new one.
+    if (!saveFile(&log))
+      content->logged = log.lines.length;
+    while (&(log.lines) != log.lines.next)
+      freeLine(&log, log.lines.next);
+    freeBlocks(&log);
+    close(fd);  // This also drops the lock.
   }
+}
 
-  while (y < h)
+// Add an entry to the end of the history file.
+void appendHistory(struct content *content, char *text)
+{
+  int len = strlen(text), fd = lockHistory(content->path, O_WRONLY | O_APPEND, LOCK_SH);
+
+  if (-1 != fd)
   {
-    char *line = "";
+    char *entry = xmalloc(len + 1);
 
-    if (lines)
-    {
-      lines = lines->next;
-      if (&(box->view->content->lines) == lines)  // We are at the end if we have wrapped to the beginning.
-        lines = NULL;
-      else
-        line = lines->line;
-      // Figure out which line is our current line while we are here.
-      if (box->view->Y + (box->view->cY - box->view->offsetY) == y)
-        box->view->line = lines;
-    }
-    drawContentLine(box->view, y++, box->X, box->X + box->W, left, " ", line, right, current);
+    memcpy(entry, text, len);
+    entry[len] = '\n';
+    writeall(fd, entry, len + 1);
+    free(entry);
+    close(fd);
+
+    // Let the log grow to about twice the size of the history before compacting it.
+    if (++(content->logged) > (content->lines.length * 2 + 128))
+      compactHistory(content);
   }
-  if (box->flags & BOX_BORDER)
-    drawLine(y++, box->X, box->X + box->W, bchars[4], bchars[0], NULL, bchars[5], current);
-  fflush(stdout);
 }
 
-void drawBoxes(box *box)
+// Load the history file into a command line view, leaving it's blank line at the end, like readline does.
+void loadHistory(view *view, char *path)
 {
-  if (box->sub1)  // If there's one sub box, there's always two.
-  {
-    drawBoxes(box->sub1);
-    drawBoxes(box->sub2);
-  }
-  else
-    drawBox(box);
+  struct content *content = view->content;
+  struct line *blank = view->line;
+
+  content->path = strdup(path);
+  content->flags |= CONTENT_HISTORY;
+  loadFile(content);
+  content->logged = content->lines.length - 1;
+  dedupLines(content, blank);
+
+  // Move the blank line addView() gave us to the end.
+  blank->next->prev = blank->prev;
+  blank->prev->next = blank->next;
+  blank->next = &(content->lines);
+  blank->prev = content->lines.prev;
+  content->lines.prev->next = blank;
+  content->lines.prev = blank;
+  view->cY = content->lines.length - 1;
 }
 
-void calcBoxes(box *box)
+// Fewer spliced in lines than this get told which block they are in now, more leave the content spliced until saved.
+#define SPLICE_TAG  1024
+
+// General purpose line moosher, like mooshStrings(), only it deals with whole lines in double linked lists.  Cuts the
+// count lines from the one after after to last out of content, onto the end of cut, or frees them if cut is NULL.
+// Then splices the lines of moosh in after after, leaving moosh empty.  cut and moosh are just lists, no blocks.
+// The lines themselves are not touched, so it's the same few pointers no matter how many there are, and only the
+// blocks they span get fixed up.  Views on the lines being cut are up to the caller.
+void mooshLines(struct content *content, struct line *after, struct line *last, uint32_t count, struct content *cut,
+  struct content *moosh)
 {
-  if (box->sub1)  // If there's one sub box, there's always two.
+  struct block *blocks = content->blocks;
+  struct line *first = after->next, *line, *next, *end;
+  uint32_t a, b, z = 0;
+
+  content->generation++;
+  if (count)
   {
-    box->sub1->X = box->X;
-    box->sub1->Y = box->Y;
-    box->sub1->W = box->W;
-    box->sub1->H = box->H;
-    box->sub2->X = box->X;
-    box->sub2->Y = box->Y;
-    box->sub2->W = box->W;
-    box->sub2->H = box->H;
-    if (box->flags & BOX_HSPLIT)
+    if (content->blockCount && first->block && last->block && !(content->flags & CONTENT_SPLICED))
     {
-      box->sub1->H *= box->split;
-      box->sub2->H -= box->sub1->H;
-      box->sub2->Y += box->sub1->H;
+      // Each line knows which block it's in, and blocks are in order, so only the blocks from first to last change.
+      a = first->block;
+      z = last->block;
+      end = blockEnd(content, z);
+      for (b = a; b <= z; b++)
+      {
+        // Stubs can't leave their content, but can just be freed.
+        if (cut && blocks[b].first && isStub(content, blocks[b].first))
+          pageIn(content, blocks[b].first);
+        if ((b != a) || (blocks[b].first == first))
+          blocks[b].first = NULL;
+        blocks[b].flags |= BLOCK_DIRTY | (cut ? BLOCK_PINNED : 0);
+      }
+      if (!blocks[z].first && (end != last->next))
+        blocks[z].first = last->next;
     }
-    else
+    else if (content->blockCount)
     {
-      box->sub1->W *= box->split;
-      box->sub2->W -= box->sub1->W;
-      box->sub2->X += box->sub1->W;
-    }
-    sizeViewToBox(box->sub1, -1, -1, -1, -1);
-    calcBoxes(box->sub1);
+      // Which block a line is in can't be trusted, so look for any blocks that start in here the slow way.
+      for (line = first; ; line = next)
+      {
+        if (cut && isStub(content, line))
+          line = pageIn(content, line);
+        next = line->next;
+        if ((b = line->block) && (b <= content->blockCount))
+        {
+          if (blocks[b].first == line)
+          {
+            if (z)
+              blocks[z].first = NULL;
+            z = b;
+          }
+          if (cut && !line->length)
+            blocks[b].flags |= BLOCK_PINNED;
+        }
+        if (line == last)
+          break;
+      }
+      if (z)
+        blocks[z].first = (blockEnd(content, z) != last->next) ? last->next : NULL;
+    }
+
+    after->next = last->next;
+    last->next->prev = after;
+    content->lines.length -= count;
+    if (cut)
+    {
+      first->prev = cut->lines.prev;
+      last->next = &(cut->lines);
+      cut->lines.prev->next = first;
+      cut->lines.prev = last;
+      cut->lines.length += count;
+    }
+    else
+    {
+      for (line = first; line; line = next)
+      {
+        next = (last == line) ? NULL : line->next;
+        freeText(line);
+        free(line);
+      }
+    }
+  }
+
+  if (moosh && moosh->lines.length)
+  {
+    first = moosh->lines.next;
+    last = moosh->lines.prev;
+    count = moosh->lines.length;
+    if (content->blockCount)
+    {
+      // They go in the block after is in, or start the first block.
+      if (&(content->lines) == after)
+      {
+        for (b = 1; (b < content->blockCount) && !blocks[b].first; b++)
+          ;
+        blocks[b].first = first;
+      }
+      else
+        b = after->block;
+      if ((content->flags & CONTENT_SPLICED) || (SPLICE_TAG <= count))
+        content->flags |= CONTENT_SPLICED;
+      else
+        for (line = first; &(moosh->lines) != line; line = line->next)
+          line->block = b;
+      // The first line of a block always knows which block it's in.
+      first->block = b;
+      if (b && (b <= content->blockCount))
+        blocks[b].flags |= BLOCK_DIRTY;
+    }
+
+    first->prev = after;
+    last->next = after->next;
+    after->next->prev = last;
+    after->next = first;
+    content->lines.length += count;
+    moosh->lines.next = &(moosh->lines);
+    moosh->lines.prev = &(moosh->lines);
+    moosh->lines.length = 0;
+  }
+}
+
+// General purpose string moosher.  Used for appends, inserts, overwrites, and deletes.
+void mooshStrings(struct line *result, char *moosh, uint16_t index, uint16_t length, int insert)
+{
+  char *c, *pos;
+  int limit, mooshLen = 0, resultLen;
+
+  ownLine(result);
+  limit = strlen(result->line);
+  if (moosh)
+    mooshLen = strlen(moosh);
+
+  /*
+   * moosh  == NULL  a deletion
+   * length == 0    simple insertion
+   * length <  mooshlen  delete some, insert moosh
+   * length == mooshlen  exact overwrite.
+   * length >  mooshlen  delete a lot, insert moosh
+   */
+
+  mooshLen -= length;
+  resultLen = limit + mooshLen;
+
+  // If we need more space, allocate more.
+  if (resultLen > result->length)
+  {
+    result->length = resultLen + MEM_SIZE;
+    result->line = textRealloc(result->line, result->length);
+  }
+
+  if (limit <= index)  // At end, just add to end.
+  {
+    // TODO - Possibly add spaces to pad out to where index is?
+    //          Would be needed for "go beyond end of line" and "column blocks".
+    //          Both of those are advanced editing.
+    index = limit;
+    insert = 1;
+  }
+
+  pos = &(result->line[index]);
+
+  if (insert)  // Insert / delete before current character, so move it and the rest up / down mooshLen bytes.
+  {
+    if (0 < mooshLen)  // Gotta move things up.
+    {
+      c = &(result->line[limit]);
+      while (c >= pos)
+      {
+        *(c + mooshLen) = *c;
+        c--;
+      }
+    }
+    else if (0 > mooshLen)  // Gotta move things down.
+    {
+      c = pos;
+      while (*c)
+      {
+        *c = *(c - mooshLen);  // A double negative.
+        c++;
+      }
+    }
+  }
+
+  if (moosh)
+  {
+    c = moosh;
+    do
+    {
+      *pos++ = *c++;
+    }
+    while (*c);
+  }
+}
+
+// Make sure a line has room for length bytes, and a '\0'.
+void lineRoom(struct line *line, uint32_t length)
+{
+  ownLine(line);
+  if (length >= line->length)
+  {
+    line->length = (((length + 1) / MEM_SIZE) + 1) * MEM_SIZE;
+    line->line = textRealloc(line->line, line->length);
+  }
+}
+
+// Insert len bytes of text into the line at byte x, there's no newlines in it.
+void insertBytes(struct line *line, uint32_t x, char *text, uint32_t len)
+{
+  uint32_t l = strlen(line->line);
+
+  lineRoom(line, l + len);
+  memmove(&(line->line[x + len]), &(line->line[x]), l - x + 1);
+  memcpy(&(line->line[x]), text, len);
+}
+
+// Insert len bytes of text into line at byte x, newlines in it split the line.  Returns the line it ends on.
+struct line *insertText(struct content *content, struct line *line, uint32_t x, char *text, uint32_t len)
+{
+  struct content run = {0};
+  struct line *last = line;
+  uint32_t n, m;
+  char *nl, *start = text;
+
+  if (x > strlen(line->line))
+    x = strlen(line->line);
+  if ((nl = memchr(text, '\n', len)))
+  {
+    // The new lines are put together on their own, then spliced in after line all at once.
+    run.lines.next = &(run.lines);
+    run.lines.prev = &(run.lines);
+    n = nl - text;
+    for (text += n + 1, len -= n + 1; (nl = memchr(text, '\n', len)); text += m + 1, len -= m + 1)
+    {
+      m = nl - text;
+      addLine(&run, NULL, m ? text : "", m);
+    }
+    // What was after x ends up after the last of it.
+    last = addLine(&run, NULL, &(line->line[x]), 0);
+    insertBytes(last, 0, text, len);
+    ownLine(line);
+    line->line[x] = '\0';
+    insertBytes(line, x, start, n);
+    mooshLines(content, line, NULL, 0, NULL, &run);
+  }
+  else
+    insertBytes(line, x, text, len);
+  dirtyLine(content, line);
+
+  return last;
+}
+
+// Add len bytes of text to the end of a buffer, starting it's first line if it's empty.
+void bufferAppend(struct content *buffer, char *text, uint32_t len)
+{
+  if (&(buffer->lines) == buffer->lines.prev)
+    addLine(buffer, NULL, "", 0);
+  if (len)
+    insertBytes(buffer->lines.prev, strlen(buffer->lines.prev->line), text, len);
+}
+
+// Insert the text of a buffer into line at byte x, like insertText(), only the lines in the middle are copies that
+// share their text with the buffers lines, and they all get spliced in at once.  Returns the line it ends on.
+struct line *pasteLines(struct content *content, struct line *line, uint32_t x, struct content *buffer)
+{
+  struct content run = {0};
+  struct line *first = buffer->lines.next, *from, *last = line;
+
+  if (&(buffer->lines) == first)
+    return line;
+  if (x > strlen(line->line))
+    x = strlen(line->line);
+  if (buffer->lines.prev != first)
+  {
+    run.lines.next = &(run.lines);
+    run.lines.prev = &(run.lines);
+    for (from = first->next; buffer->lines.prev != from; from = from->next)
+      shareLine(&run, from);
+    // What was after x ends up after the last of it.
+    last = addLine(&run, NULL, buffer->lines.prev->line, 0);
+    insertBytes(last, strlen(last->line), &(line->line[x]), strlen(&(line->line[x])));
+    ownLine(line);
+    line->line[x] = '\0';
+    mooshLines(content, line, NULL, 0, NULL, &run);
+  }
+  insertBytes(line, x, first->line, strlen(first->line));
+  dirtyLine(content, line);
+
+  return last;
+}
+
+// Copy len bytes from line at byte x onto the end of a buffer, the same as deleteText() would cut them, only whole
+// lines are copies that share their text.  Returns how much was copied, there might not have been len.
+uint32_t copyText(struct content *content, struct line *line, uint32_t x, uint32_t len, struct content *buffer)
+{
+  uint32_t l = strlen(line->line), n, done;
+
+  if (x > l)
+    x = l;
+  done = ((len < (l - x)) ? len : l - x);
+  bufferAppend(buffer, &(line->line[x]), done);
+  while ((done < len) && (&(content->lines) != (line = nextLine(content, line))))
+  {
+    done++;
+    l = strlen(line->line);
+    if (l < (len - done))
+    {
+      shareLine(buffer, line);
+      // Lines from a file point into their block, so it has to stay.
+      if ((!line->length) && line->block && (line->block <= content->blockCount))
+        content->blocks[line->block].flags |= BLOCK_PINNED;
+      done += l;
+    }
+    else
+    {
+      n = len - done;
+      addLine(buffer, NULL, "", 0);
+      bufferAppend(buffer, line->line, n);
+      done += n;
+    }
+  }
+
+  return done;
+}
+
+// Delete len bytes from line at byte x, newlines join the next line on.  Puts what was deleted in deleted, if it's
+// not NULL, which needs room for len + 1 bytes.  Returns how much was deleted, there might not have been len.
+// If cut is not NULL, what's deleted goes on the end of it instead of vanishing, whole lines get moved there as is.
+uint32_t deleteText(struct content *content, struct line *line, uint32_t x, uint32_t len, char *deleted,
+  struct content *cut)
+{
+  struct line *next, *last, *join = NULL;
+  uint32_t l, n, count, done = 0;
+
+  ownLine(line);
+  l = strlen(line->line);
+  if (x > l)
+    x = l;
+  while (done < len)
+  {
+    if (x < l)
+    {
+      n = ((len - done) < (l - x)) ? len - done : l - x;
+      if (deleted)
+        memcpy(&(deleted[done]), &(line->line[x]), n);
+      if (cut)
+        bufferAppend(cut, &(line->line[x]), n);
+      memmove(&(line->line[x]), &(line->line[x + n]), l - x - n + 1);
+      l -= n;
+      done += n;
+    }
+    else
+    {
+      // Whole lines that are going are cut out all at once, then the one that gets joined on.
+      for (last = line, count = 0; (done < len) && (&(content->lines) != (next = nextLine(content, last))); )
+      {
+        if (deleted)
+          deleted[done] = '\n';
+        done++;
+        if (rootBox)
+          replaceViewLine(rootBox, next, line);
+        n = strlen(next->line);
+        // If all of the next line is going as well, don't bother joining it on first.
+        if (n < (len - done))
+        {
+          if (deleted)
+            memcpy(&(deleted[done]), next->line, n);
+          done += n;
+          last = next;
+          count++;
+        }
+        else
+        {
+          lineRoom(line, l + n);
+          memcpy(&(line->line[l]), next->line, n + 1);
+          l += n;
+          join = next;
+          break;
+        }
+      }
+      if (count)
+        mooshLines(content, line, last, count, cut, NULL);
+      if (join)
+      {
+        mooshLines(content, line, join, 1, NULL, NULL);
+        if (cut)
+          addLine(cut, NULL, "", 0);
+        join = NULL;
+      }
+      else if (!count)
+        break;
+    }
+  }
+  dirtyLine(content, line);
+  if (deleted)
+    deleted[done] = '\0';
+
+  return done;
+}
+
+// Remember an edit, so it can be undone.
+void undoRecord(struct content *content, uint8_t flags, uint32_t y, uint32_t x, char *text, uint32_t length)
+{
+  struct undo *undo = &(content->undo);
+  struct undoOp *op = NULL;
+  size_t size, cut, off;
+
+  if ((content->flags & CONTENT_HISTORY) || !length)
+    return;
+
+  // Whatever was undone can't be redone once something else changes.
+  if (undo->at < undo->length)
+  {
+    undo->last = undo->at ? undo->at - ((struct undoOp *) &(undo->arena[undo->at]))->prev : 0;
+    undo->length = undo->at;
+  }
+  if (undo->length)
+    op = (struct undoOp *) &(undo->arena[undo->last]);
+
+  // Typing carries on from the last record if it can.
+  if (op && !undo->group && ((UNDO_INSERT | UNDO_TYPED) == flags) && ((UNDO_INSERT | UNDO_TYPED) == (op->flags & ~UNDO_GROUP))
+    && (op->y == y) && ((op->x + op->length) == x))
+  {
+    size = (sizeof(struct undoOp) + op->length + length + 8) & ~7;
+    if ((undo->last + size) > undo->size)
+    {
+      undo->size = undo->last + size + 4096;
+      undo->arena = xrealloc(undo->arena, undo->size);
+      op = (struct undoOp *) &(undo->arena[undo->last]);
+    }
+    memcpy(((char *) (op + 1)) + op->length, text, length);
+    op->length += length;
+    ((char *) (op + 1))[op->length] = '\0';
+    op->size = size;
+    undo->length = undo->at = undo->last + size;
+    return;
+  }
+
+  // Typing after something else is a new group, even without a command in between.  Not in a keyboard macro though.
+  if ((!op) || ((!undoHeld) && ((flags & UNDO_TYPED) != (op->flags & UNDO_TYPED))))
+    undo->group = 1;
+  size = (sizeof(struct undoOp) + length + 8) & ~7;
+  if ((undo->length + size) > undo->size)
+  {
+    undo->size = (undo->length + size) * 2;
+    undo->arena = xrealloc(undo->arena, undo->size);
+  }
+  op = (struct undoOp *) &(undo->arena[undo->length]);
+  op->size = size;
+  op->prev = undo->length ? undo->length - undo->last : 0;
+  op->y = y;
+  op->x = x;
+  op->length = length;
+  op->flags = flags | (undo->group ? UNDO_GROUP : 0);
+  memcpy(op + 1, text, length);
+  ((char *) (op + 1))[length] = '\0';
+  undo->last = undo->length;
+  undo->length = undo->at = undo->length + size;
+  undo->group = 0;
+
+  // Throw away the oldest groups, down to half the limit, but always keep the latest group.  Only worth looking when a
+  // group starts, the records of one big group would have to look through all of it each time.
+  if ((op->flags & UNDO_GROUP) && (undo->length > UNDO_MAX))
+  {
+    for (cut = 0, off = 0; off < undo->length; off += op->size)
+    {
+      op = (struct undoOp *) &(undo->arena[off]);
+      if (off && (op->flags & UNDO_GROUP))
+      {
+        cut = off;
+        if ((undo->length - off) <= (UNDO_MAX / 2))
+          break;
+      }
+    }
+    if (cut)
+    {
+      memmove(undo->arena, &(undo->arena[cut]), undo->length - cut);
+      undo->length -= cut;
+      undo->at -= cut;
+      undo->last -= cut;
+      ((struct undoOp *) undo->arena)->prev = 0;
+      undo->size = undo->length + 4096;
+      undo->arena = xrealloc(undo->arena, undo->size);
+    }
+  }
+}
+
+// Unsaved changes also go in a journal file, so they can be recovered if we get killed, or the ssh session drops.
+// It's log structured, recording the same edits undo does, and a thread does the writing and fdatasync(), so they're not
+// on the keystroke path.  Each batch written ends in a checkpoint record with a hash of the batch, so a batch that
+// was only partly written when we died gets ignored.  Saving starts the journal again, quitting properly removes it.
+
+#define JOURNAL_MARK  16	// A checkpoint, at the end of each batch.
+#define JOURNAL_DELAY  200	// Milliseconds to let edits pile up between batches.
+
+struct journalHead
+{
+  char magic[8];		// "boxesJN1"
+  uint64_t dev, ino, size;	// Which file, and how big it was, since the changes are to that.
+  int64_t sec, nsec;		// When it was last modified.
+};
+
+struct journalOp
+{
+  uint32_t y, x;		// Where, like undo records.  Checkpoints have the hash of their batch in y.
+  uint32_t length;		// Of the text, which only inserts have after them.  Checkpoints have the size of their batch.
+  uint32_t flags;
+};
+
+struct journal
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int fd;
+  char *buf;			// Records waiting to be written.
+  size_t len, size;
+  struct journalHead head;	// The file gets started again with this when reset is set.
+  int reset, stop;
+};
+
+char *journalPath(struct content *content)
+{
+  char *path, *result = NULL;
+
+  if ((!(content->flags & CONTENT_HISTORY)) && content->path && (path = indexPath(content)))
+  {
+    result = xmprintf("%s.journal", path);
+    free(path);
+  }
+
+  return result;
+}
+
+void journalHead(struct content *content, struct journalHead *head)
+{
+  memset(head, 0, sizeof(struct journalHead));
+  memcpy(head->magic, "boxesJN1", 8);
+  head->dev = content->st.st_dev;
+  head->ino = content->st.st_ino;
+  head->size = content->st.st_size;
+  head->sec = content->st.st_mtim.tv_sec;
+  head->nsec = content->st.st_mtim.tv_nsec;
+}
+
+void *journalThread(void *data)
+{
+  struct journal *j = data;
+  struct timespec delay = {0, JOURNAL_DELAY * 1000000L};
+  struct journalHead head;
+  struct journalOp mark;
+  char *buf = NULL, *swap;
+  size_t len, size = 0, swapSize;
+  off_t offset = sizeof(head);
+  int reset;
+
+  pthread_mutex_lock(&(j->lock));
+  while (j->len || j->reset || !j->stop)
+  {
+    if (!(j->len || j->reset))
+    {
+      pthread_cond_wait(&(j->wake), &(j->lock));
+      continue;
+    }
+    // Swap buffers, so more edits can go in while these are written.
+    swap = j->buf;
+    j->buf = buf;
+    buf = swap;
+    swapSize = j->size;
+    j->size = size;
+    size = swapSize;
+    len = j->len;
+    j->len = 0;
+    reset = j->reset;
+    j->reset = 0;
+    head = j->head;
+    pthread_mutex_unlock(&(j->lock));
+
+    if (reset)
+    {
+      ftruncate(j->fd, 0);
+      pwrite(j->fd, &head, sizeof(head), 0);
+      offset = sizeof(head);
+    }
+    // There's always room for the checkpoint.  A short write gets written over by the next batch.
+    if (len)
+    {
+      memset(&mark, 0, sizeof(mark));
+      mark.y = hashBytes(buf, len);
+      mark.length = len;
+      mark.flags = JOURNAL_MARK;
+      memcpy(&(buf[len]), &mark, sizeof(mark));
+      len += sizeof(mark);
+      if (pwrite(j->fd, buf, len, offset) == len)
+        offset += len;
+    }
+    fdatasync(j->fd);
+    if (!__atomic_load_n(&(j->stop), __ATOMIC_RELAXED))
+      nanosleep(&delay, NULL);
+    pthread_mutex_lock(&(j->lock));
+  }
+  pthread_mutex_unlock(&(j->lock));
+  free(buf);
+
+  return NULL;
+}
+
+struct journal *journalStart(struct content *content)
+{
+  struct journal *j;
+  char *path;
+  int fd;
+
+  if (!(path = journalPath(content)))
+    return NULL;
+  cacheDir(path);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  free(path);
+  if (-1 == fd)
+    return NULL;
+  j = xzalloc(sizeof(struct journal));
+  j->fd = fd;
+  journalHead(content, &(j->head));
+  j->reset = 1;
+  pthread_mutex_init(&(j->lock), NULL);
+  pthread_cond_init(&(j->wake), NULL);
+  if (pthread_create(&(j->thread), NULL, journalThread, j))
+  {
+    close(fd);
+    free(j);
+    return NULL;
+  }
+
+  return content->journal = j;
+}
+
+// Add an edit to the journal, starting one if this is the first.
+void journalRecord(struct content *content, uint8_t flags, uint32_t y, uint32_t x, char *text, uint32_t length)
+{
+  struct journal *j = content->journal;
+  struct journalOp op;
+  size_t need;
+
+  if ((!length) || ((!j) && !(j = journalStart(content))))
+    return;
+  memset(&op, 0, sizeof(op));
+  op.y = y;
+  op.x = x;
+  op.length = length;
+  op.flags = flags & (UNDO_INSERT | UNDO_DELETE);
+  need = sizeof(op) + ((flags & UNDO_INSERT) ? length : 0);
+
+  pthread_mutex_lock(&(j->lock));
+  // Leave room for the thread to add the checkpoint.
+  if ((j->len + need + sizeof(op)) > j->size)
+  {
+    j->size = j->len + need + sizeof(op) + 4096;
+    j->buf = xrealloc(j->buf, j->size);
+  }
+  memcpy(&(j->buf[j->len]), &op, sizeof(op));
+  if (flags & UNDO_INSERT)
+    memcpy(&(j->buf[j->len + sizeof(op)]), text, length);
+  j->len += need;
+  pthread_cond_signal(&(j->wake));
+  pthread_mutex_unlock(&(j->lock));
+}
+
+// It's just been saved, so there's no unsaved changes now.
+void journalReset(struct content *content)
+{
+  struct journal *j = content->journal;
+
+  if (j)
+  {
+    pthread_mutex_lock(&(j->lock));
+    j->len = 0;
+    journalHead(content, &(j->head));
+    j->reset = 1;
+    pthread_cond_signal(&(j->wake));
+    pthread_mutex_unlock(&(j->lock));
+  }
+}
+
+// Wait for the thread to finish writing, and maybe remove the journal.
+void journalStop(struct content *content, int remove)
+{
+  struct journal *j = content->journal;
+  char *path;
+
+  if (!j)
+    return;
+  pthread_mutex_lock(&(j->lock));
+  j->stop = 1;
+  pthread_cond_signal(&(j->wake));
+  pthread_mutex_unlock(&(j->lock));
+  pthread_join(j->thread, NULL);
+  close(j->fd);
+  pthread_mutex_destroy(&(j->lock));
+  pthread_cond_destroy(&(j->wake));
+  free(j->buf);
+  free(j);
+  content->journal = NULL;
+  if (remove && (path = journalPath(content)))
+  {
+    unlink(path);
+    free(path);
+  }
+}
+
+// Read the journal from last time, if it's for the file as it is now.  Returns how much of it can be replayed,
+// up to the last good checkpoint, or 0.
+off_t journalRead(struct content *content, char **data)
+{
+  struct journalHead head, want;
+  struct journalOp op;
+  struct stat st;
+  char *path = journalPath(content);
+  off_t pos, batch, good = 0;
+  int fd;
+
+  *data = NULL;
+  if ((!path) || (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC))))
+  {
+    free(path);
+    return 0;
+  }
+  free(path);
+  journalHead(content, &want);
+  if ((!fstat(fd, &st)) && (st.st_size > sizeof(head)) && (readall(fd, &head, sizeof(head)) == sizeof(head))
+    && !memcmp(&head, &want, sizeof(head)))
+  {
+    *data = xmalloc(st.st_size);
+    if (readall(fd, *data, st.st_size - sizeof(head)) == (st.st_size - sizeof(head)))
+    {
+      for (pos = batch = 0; (pos + sizeof(op)) <= (st.st_size - sizeof(head)); )
+      {
+        memcpy(&op, &((*data)[pos]), sizeof(op));
+        if (JOURNAL_MARK == op.flags)
+        {
+          if ((op.length != (pos - batch)) || (op.y != (uint32_t) hashBytes(&((*data)[batch]), op.length)))
+            break;
+          good = batch = pos += sizeof(op);
+        }
+        else
+          pos += sizeof(op) + ((op.flags & UNDO_INSERT) ? op.length : 0);
+      }
+    }
+  }
+  close(fd);
+  if (!good)
+  {
+    free(*data);
+    *data = NULL;
+  }
+
+  return good;
+}
+
+// TODO - Should draw the current border in green, the text as default (or highlight / bright).
+//          Then allow one other box to be red bordered (MC / dired destination box).
+//          All other boxes with dark gray border, and dim text.
+// spans are count pairs of start and end columns in contents to show in reverse video, in order.
+void drawLine(int y, int start, int end, char *left, char *internal, char *contents, char *right, int current,
+  uint32_t *spans, int count)
+{
+  int size = strlen(internal);
+  int len = (end - start) * size, x = 0, i;
+  char line[len + 1];
+
+  if ('\0' != left[0])  // Assumes that if one side has a border, then so does the other.
+    len -= 2 * size;
+
+  if (contents)
+  {
+    // strncpy wont add a null at the end if the source is longer, but will pad with nulls if source is shorter.
+    // So it's best to put a safety null in first.
+    line[len] = '\0';
+    strncpy(line, contents, len);
+    // Make sure the following while loop pads out line with the internal character.
+    x = strlen(line);
+  }
+  while (x < len)
+  {
+    strcpy(&line[x], internal);
+    x += size;
+  }
+  line[x++] = '\0';
+  if (current)
+    printf("\x1B[1m\x1B[%d;%dH%s", y + 1, start + 1, left);
+  else
+    printf("\x1B[m\x1B[%d;%dH%s", y + 1, start + 1, left);
+  // Turn reverse video on and off around the highlighted bits, without losing the bold.
+  for (x = 0, i = 0; i < count; i++)
+  {
+    int s = spans[i * 2], e = spans[i * 2 + 1];
+
+    if (s >= len)
+      break;
+    if (e > len)
+      e = len;
+    printf("%.*s\x1B[7m%.*s\x1B[27m", s - x, &line[x], e - s, &line[s]);
+    x = e;
+  }
+  // If there's no border, left and right are empty anyway.
+  printf("%s%s%s", &line[x], right, current ? "\x1B[m" : "");
+}
+
+void formatCheckCursor(view *view, long *cX, long *cY, char *input)
+{
+  int i = 0, o = 0, direction = (*cX) - view->cX;
+
+  // Adjust the cursor if needed, depending on the contents of the line, and the direction of travel.
+  while (input[i])
+  {
+    // When o is equal to the cX position, update the iX position to be where i is.
+    if ('\t' == input[i])
+    {
+      int j = 8 - (i % 8);
+
+      // Check if the cursor is in the middle of the tab.
+      if (((*cX) > o) && ((*cX) < (o + j)))
+      {
+        if (0 <= direction)
+        {
+          *cX = (o + j);
+          view->iX = i + 1;
+        }
+        else
+        {
+          *cX = o;
+          view->iX = i;
+        }
+      }
+      o += j;
+    }
+    else
+    {
+      if ((*cX) == o)
+        view->iX = i;
+      o++;
+    }
+    i++;
+  }
+  // One more check in case the cursor is at the end of the line.
+  if ((*cX) == o)
+    view->iX = i;
+}
+
+// TODO - Should convert control characters to reverse video, and deal with UTF8.
+
+/* FIXME - We get passed a NULL input, apparently when the file length is close to the screen length. -
+> On Thu, 6 Sep 2012 11:56:17 +0800 Roy Tam <roytam@gmail.com> wrote:
+>   
+> > 2012/9/6 David Seikel <onefang@gmail.com>:  
+> > >> Program received signal SIGSEGV, Segmentation fault.
+> > >> formatLine (view=0x8069168, input=0x0, output=0x806919c)
+> > >>     at toys/other/boxes.c:843
+> > >> 843        int len = strlen(input), i = 0, o = 0;
+> > >> (gdb) bt
+> > >> #0  formatLine (view=0x8069168, input=0x0, output=0x806919c)
+> > >>     at toys/other/boxes.c:843
+> > >> #1  0x0804f1dd in moveCursorAbsolute (view=0x8069168, cX=0,
+> > >> cY=10, sX=0, sY=0) at toys/other/boxes.c:951
+> > >> #2  0x0804f367 in moveCursorRelative (view=0x8069168, cX=0,
+> > >> cY=10, sX=0, sY=0) at toys/other/boxes.c:1011
+> > >> #3  0x0804f479 in upLine (view=0x8069168, event=0x0) at
+> > >> toys/other/boxes.c:1442 #4  0x0804fb63 in handleKey
+> > >> (view=0x8069168, i=2, keyName=<optimized out>, buffer=0xbffffad8
+> > >> "\033[A") at toys/other/boxes.c:1593 #5  0x0805008d in editLine
+> > >> (view=0x8069168, X=-1, Y=-1, W=-1, H=-1) at
+> > >> toys/other/boxes.c:1785 #6  0x08050288 in boxes_main () at
+> > >> toys/other/boxes.c:2482 #7  0x0804b262 in toy_exec
+> > >> (argv=0xbffffd58) at main.c:104 #8  0x0804b29d in toybox_main ()
+> > >> at main.c:118 #9  0x0804b262 in toy_exec (argv=0xbffffd54) at
+> > >> main.c:104 #10 0x0804b29d in toybox_main () at main.c:118
+> > >> #11 0x0804affa in main (argc=5, argv=0xbffffd54) at main.c:159  
+> > >
+> > > No segfault here when I try that, nor with different files.  As I
+> > > said, it has bugs.  I have seen other cases before when NULL lines
+> > > are passed around near that code.  Guess I've not got them all.
+> > > Might help to mention what terminal proggy you are using, it's
+> > > size in characters, toybox version, OS, etc.  Something is
+> > > different between you and me.  
+> > 
+> > Terminal Program: PuTTY
+> > Windows size: 80 * 25 chars
+> > Toybox version: hg head
+> > OS: Linux 3.2 (Debian wheezy)
+> > File: Toybox LICENSE file  
+> 
+> I'll install PuTTY, try toybox hg head, and play with them later, see
+> if I can reproduce that segfault.  I use the last released tarball of
+> toybox, an old Ubuntu, and a bunch of other terminal proggies.  I did
+> not know that PuTTY had been ported to Unix.
+> 
+> But as I mentioned, not interested in a bug hunt right now.  That will
+> be more appropriate when it's less of a "sandbox for testing the
+> ideas" and more of a "good enough to bother using".  Always good to
+> have other terminals for testing though.  
+
+Seems to be sensitive to the number of lines.  On my usual huge
+roxterm, using either toybox 0.4 or hg head, doing this -
+
+./toybox boxes -m less LICENSE -h 25
+
+and just hitting down arrow until you get to the bottom of the page
+segfaults as well.  -h means "pretend the terminal is that many lines
+high", there's a similar -w as well.  80x25 in any other terminal did
+the same.  For that particular file (17 lines long), any value of -h
+between 19 and 34 will segfault after some moving around.  -h 35 makes
+it segfault straight away.  Less than 19 or over 35 is fine.  Longer
+files don't have that problem, though I suspect it will happen on
+shortish files where the number of lines is about the length of the
+screen.
+
+I guess that somewhere I'm doing maths wrong and getting an out of
+bounds line number when the file length is close to the screen length.
+I'll make note of that, and fix it when I next get time to beat on
+boxes.
+
+Thanks for reporting it Roy.
+*/
+
+int formatLine(view *view, char *input, char **output)
+{
+  int len = strlen(input), i = 0, o = 0;
+
+  *output = xrealloc(*output, len + 1);
+
+  while (input[i])
+  {
+    if ('\t' == input[i])
+    {
+      int j = 8 - (i % 8);
+
+      *output = xrealloc(*output, len + j + 1);
+      for (; j; j--)
+      {
+        (*output)[o++] = ' ';
+        len++;
+      }
+      len--;  // Not counting the actual tab character itself.
+    }
+    else
+      (*output)[o++] = input[i];
+    i++;
+  }
+  (*output)[o++] = '\0';
+
+  return len;
+}
+
+// Figure out which columns the matches in a line end up in, once tabs are expanded the way formatLine() does, and
+// it's scrolled offset columns sideways.  Only those that show in width columns go in spans, returns how many.
+int highlightSpans(struct highlight *h, char *text, int offset, int width, uint32_t *spans)
+{
+  uint32_t i = 0, o = 0, m, s;
+  int count = 0;
+
+  for (m = 0; m < h->count; m++)
+  {
+    for (; i < h->matches[m * 2]; i++)
+      o += ('\t' == text[i]) ? 8 - (i % 8) : 1;
+    s = o;
+    for (; i < h->matches[m * 2 + 1]; i++)
+      o += ('\t' == text[i]) ? 8 - (i % 8) : 1;
+    if (o <= offset)
+      continue;
+    if (s >= offset + width)
+      break;
+    spans[count * 2] = ((s > offset) ? s : offset) - offset;
+    spans[count++ * 2 + 1] = o - offset;
+  }
+
+  return count;
+}
+
+void drawContentLine(view *view, int y, int start, int end, char *left, char *internal, char *contents, char *right, int current)
+{
+  struct highlight *h = highlightLine(view, contents);
+  char *temp = NULL;
+  int offset = view->offsetX, len, count = 0;
+  uint32_t spans[2 * (end - start) + 2];	// Every one that shows is at least a column wide.
+
+  if (contents == view->line->line)
+  {
+    view->oW = formatLine(view, contents, &(view->output));
+    temp = view->output;
+    len = view->oW;
+  }
+  else  // Only time we are not drawing the current line, and only used for drawing the entire page.
+    len = formatLine(NULL, contents, &(temp));
+
+  if (offset > len)
+    offset = len;
+  if (h)
+    count = highlightSpans(h, contents, offset, end - start, spans);
+  drawLine(y, start, end, left, internal, &(temp[offset]), right, current, spans, count);
+  if (temp != view->output)
+    free(temp);
+}
+
+void updateLine(view *view)
+{
+  int y, len;
+
+  if (headless)
+    return;
+  if (drawHeld)
+  {
+    lineHeld = 1;
+    return;
+  }
+  // Coz things might change out from under us, find the current view.  Again.
+  if (commandMode)	view = commandLine;
+  else		view = currentBox->view;
+
+  // Draw the prompt and the current line.
+  y = view->Y + (view->cY - view->offsetY);
+  len = strlen(view->prompt);
+  drawLine(y, view->X, view->X + view->W, "", " ", view->prompt, "", 0, NULL, 0);
+  // Until a filter has found something, there's nothing to show.
+  if (view->filter && !view->filter->count)
+    drawLine(y, view->X, view->X + view->W, "", " ", "", "", 1, NULL, 0);
+  else
+    drawContentLine(view, y, view->X + len, view->X + view->W, "", " ", view->line->line, "", 1);
+  // When the command line is not being used, show the status line there instead.
+  if (!commandMode)
+    drawLine(commandLine->Y, commandLine->X, commandLine->X + commandLine->W, "", " ", view->statusLine ? view->statusLine : "", "", 0, NULL, 0);
+  // Move the cursor.
+  printf("\x1B[%d;%dH", y + 1, view->X + len + (view->cX - view->offsetX) + 1);
+  fflush(stdout);
+}
+
+int rangeCommand(eventHandler handler);
+
+// Find the function a command starts with, and it's argument, what's after the name, or NULL if there's nothing.
+struct function *findCommand(view *view, char *command, char **arg)
+{
+  struct function *functions = view->content->context->commands;
+  char *end;
+  int i, l;
+
+  // ex commands don't need a space before their argument, like s/a/b/g.
+  for (end = command; isalnum(*end) || ('-' == *end); end++)
+    ;
+  l = end - command;
+  for (*arg = end; ' ' == **arg; (*arg)++)
+    ;
+  if (!**arg)
+    *arg = NULL;
+
+// TODO - Some editors have a shortcut command concept.  The smallest unique first part of each command will match, as well as anything longer.
+//          A further complication is if we are not implementing some commands that might change what is "shortest unique prefix".
+
+  for (i = 0; functions[i].name; i++)
+    if ((strncmp(functions[i].name, command, l) == 0) && !functions[i].name[l])
+      return &(functions[i]);
+
+  // ex's k doesn't need a space before it's mark either, so ka is k a.
+  if ((2 == l) && ('k' == command[0]) && islower(command[1]))
+  {
+    *arg = command + 1;
+    for (i = 0; functions[i].name; i++)
+      if (!strcmp(functions[i].name, "k"))
+        return &(functions[i]);
+  }
+
+  return NULL;
+}
+
+// The count the command was given, or 1.  Commands that use it call this, so they are not done count times as well.
+long countTake(void)
+{
+  long count = commandCount ? commandCount : 1;
+
+  commandCount = 0;
+  return count;
+}
+
+// Do handler with the count it was given.  Those that know about counts use it to do it all at once, the rest are done
+// again until that many, or until doing it again doesn't move or change anything.
+void countHandler(view *view, eventHandler handler, long count)
+{
+  struct content *content;
+  uint32_t cY, cX, length;
+  size_t done;
+  long i;
+
+  if (COUNT_MAX < count)
+    count = COUNT_MAX;
+  commandCount = count;
+  handler(view);
+  if (1 < commandCount)
+  {
+    commandCount = 0;
+    undoHeld++;
+    for (i = 1; i < count; i++)
+    {
+      content = view->content;
+      cY = view->cY;
+      cX = view->cX;
+      length = content->lines.length;
+      done = content->undo.length;
+      handler(view);
+      if ((view->cY == cY) && (view->cX == cX) && (content->lines.length == length) && (content->undo.length == done))
+        break;
+    }
+    undoHeld--;
+  }
+  commandCount = 0;
+}
+
+// Returns 0 if it's not a command, or it's range is bad, the status line says which.
+int doCommand(view *view, char *command, long count)
+{
+  struct function *function;
+  char *arg;
+  int result = 1, failed = commandFailed;
+
+  if (command)
+  {
+    // ex commands can have a range of lines first, like %s/a/b/g, just the range goes to that line.
+    if (!(command = commandRange(view, command)))
+    {
+      updateLine(view);
+      result = 0;
+    }
+    else if (commandRanged && !*command)
+    {
+      undoCursor(view, commandTo, 0);
+      updateLine(view);
+    }
+    else if ((function = findCommand(view, command, &arg)) && function->handler && commandRanged
+      && !rangeCommand(function->handler))
+    {
+      free(view->statusLine);
+      view->statusLine = xmprintf("No range allowed - %s", command);
+      updateLine(view);
+      result = 0;
+    }
+    else if (function && function->handler)
+    {
+      // Each command is undone, and drawn, as a whole.
+      if (!undoHeld)
+        view->content->undo.group = 1;
+      drawHold();
+      commandArgument = arg;
+      commandFailed = 0;
+      countHandler(view, function->handler, count);
+      commandArgument = NULL;
+      result = !commandFailed;
+      commandFailed = failed;
+      updateLine(view);
+      drawRelease();
+    }
+    else
+    {
+      free(view->statusLine);
+      view->statusLine = xmprintf("Not a command - %s", command);
+      updateLine(view);
+      result = 0;
+    }
+    commandRanged = 0;
+  }
+
+  return result;
+}
+
+// Put the command line back the way it was, after asking for an argument, or giving up on that.
+void promptDone(void)
+{
+  if (promptHandler)
+  {
+    free(commandLine->prompt);
+    commandLine->prompt = promptSaved;
+    promptHandler = NULL;
+  }
+  promptEmpty = 0;
+  currentBox->view->mode = 0;
+  commandMode = 0;
+}
+
+// Ask for the argument of a command on the command line, handler gets it when it's entered.
+void promptFor(view *view, char *prompt, eventHandler handler)
+{
+  struct mode *modes = view->content->context->modes;
+  int i;
+
+  for (i = 0; modes[i].keys && !(modes[i].flags & 1); i++)
+    ;
+  if (!modes[i].keys)
+    return;
+  promptDone();
+  promptSaved = commandLine->prompt;
+  commandLine->prompt = xstrdup(prompt);
+  promptHandler = handler;
+  view->mode = i;
+  commandMode = 1;
+}
+
+void cancelPrompt(view *view)
+{
+  isearchEnd(0);
+  promptDone();
+}
+
+// The line number of the current line, which is not cY in a filtered view.
+uint32_t viewLine(view *view)
+{
+  return view->filter ? view->filter->at : view->cY;
+}
+
+// Which row of a filtered view shows line number y, or the next one shown after it, or before it if back.
+long filterRow(struct filter *filter, uint32_t y, int back)
+{
+  long lo = 0, hi = filter->count, mid;
+
+  while (lo < hi)
+  {
+    mid = (lo + hi) / 2;
+    if (filter->rows[mid] < y)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (back && ((lo == filter->count) || (filter->rows[lo] != y)))
+    lo--;
+  if (lo >= filter->count)
+    lo = (long) filter->count - 1;
+
+  return (0 > lo) ? 0 : lo;
+}
+
+// The line shown in a row of a filtered view, found from the current line.  view->line has to be set to it.
+struct line *filterLine(view *view, long row)
+{
+  struct filter *filter = view->filter;
+  struct line *line = view->line;
+
+  if (row < filter->count)
+  {
+    line = stepLines(view->content, line, (long) filter->rows[row] - (long) filter->at);
+    filter->at = filter->rows[row];
+  }
+
+  return line;
+}
+
+int moveCursorAbsolute(view *view, long cX, long cY, long sX, long sY)
+{
+  struct line *newLine = view->line;
+  long oX = view->offsetX, oY = view->offsetY;
+  long lX = view->oW, lY = view->content->lines.length - 1;
+  long nY = view->cY;
+  uint16_t w = view->W - 1, h = view->H - 1;
+  int moved = 0, updatedY = 0, endOfLine = 0, loaded = 0;
+
+  // A filtered view moves through it's rows instead.
+  if (view->filter)
+    lY = (view->filter->count ? view->filter->count : 1) - 1;
+  // Moving past what's loaded so far has to wait until it is.
+  else if ((view->content->flags & CONTENT_LOADING) && (lY < cY))
+  {
+    loadLines(view->content, cY);
+    lY = view->content->lines.length - 1;
+    loaded = 1;
+  }
+
+  // Check if it's still within the contents.
+  if (0 > cY)    // Trying to move before the beginning of the content.
+    cY = 0;
+  else if (lY < cY)  // Trying to move beyond end of the content.
+    cY = lY;
+  if (0 > cX)    // Trying to move before the beginning of the line.
+  {
+    // See if we can move to the end of the previous line.
+    if (view->filter ? (0 < cY) : (view->line->prev != &(view->content->lines)))
+    {
+      cY--;
+      endOfLine = 1;
+    }
+    else
+      cX = 0;
+  }
+  else if (lX < cX)  // Trying to move beyond end of line.
+  {
+    // See if we can move to the begining of the next line.
+    if (view->filter ? (lY > cY) : (view->line->next != &(view->content->lines)))
+    {
+      cY++;
+      cX = 0;
+    }
+    else
+      cX = lX;
+  }
+
+  // Find the new line.
+  if (nY != cY)
+  {
+    updatedY = 1;
+    if (view->filter)
+      newLine = filterLine(view, cY);
+    else
+      newLine = stepLines(view->content, newLine, cY - nY);
+  }
+
+  // Check if we have moved past the end of the new line.
+  if (updatedY)
+  {
+    // Format it.
+    view->oW = formatLine(view, newLine->line, &(view->output));
+    if (view->oW < cX)
+      endOfLine = 1;
+    if (endOfLine)
+      cX = view->oW;
+  }
+
+  // Let the formatter decide if it wants to adjust things.
+  // It's up to the formatter to deal with things if it changes cY.
+  // On the other hand, changing cX is it's job.
+  formatCheckCursor(view, &cX, &cY, newLine->line);
+
+  // Check the scrolling.
+  lY -= view->H - 1;
+  oX += sX;
+  oY += sY;
+
+  if (oY > cY)      // Trying to move above the box.
+    oY += cY - oY;
+  else if ((oY + h) < cY)    // Trying to move below the box
+    oY += cY - (oY + h);
+  if (oX > cX)      // Trying to move to the left of the box.
+    oX += cX - oX;
+  else if ((oX + w) <= cX)  // Trying to move to the right of the box.
+    oX += cX - (oX + w);
+
+  if (oY >= lY)
+    oY = lY;
+  if (oY < 0)    // Content shorter than the box.
+    oY = 0;
+  if (oX < 0)
+    oX = 0;
+  // TODO - Should limit oX to less than the longest line, minus box width.
+  //          Gonna be a pain figuring out what the longest line is.
+  //          On the other hand, don't think that will be an actual issue unless "move past end of line" is enabled, and that's an advanced editor thing.
+  //          Though still might want to do that for the longest line on the new page to be.
+
+  if ((view->cX != cX) || (view->cY != cY))
+    moved = 1;
+
+  // Actually update stuff, though some have been done already.
+  view->cX = cX;
+  view->cY = cY;
+  view->line = newLine;
+
+  // Handle scrolling, or showing what was just loaded.
+  if ((view->offsetX != oX) || (view->offsetY != oY) || loaded)
+  {
+    view->offsetX = oX;
+    view->offsetY = oY;
+
+    if (view->box)
+      drawBox(view->box);
+  }
+
+  return moved;
+}
+
+int moveCursorRelative(view *view, long cX, long cY, long sX, long sY)
+{
+  return moveCursorAbsolute(view, view->cX + cX, view->cY + cY, sX, sY);
+}
+
+void sizeViewToBox(box *box, int X, int Y, int W, int H)
+{
+  uint16_t one = 1, two = 2;
+
+  if (!(box->flags & BOX_BORDER))
+  {
+      one = 0;
+      two = 0;
+  }
+  box->view->X = X;
+  box->view->Y = Y;
+  box->view->W = W;
+  box->view->H = H;
+  if (0 > X)  box->view->X = box->X + one;
+  if (0 > Y)  box->view->Y = box->Y + one;
+  if (0 > W)  box->view->W = box->W - two;
+  if (0 > H)  box->view->H = box->H - two;
+}
+
+view *addView(char *name, struct context *context, char *filePath, uint16_t X, uint16_t Y, uint16_t W, uint16_t H)
+{
+  view *result = xzalloc(sizeof(struct _view));
+
+  result->X = X;
+  result->Y = Y;
+  result->W = W;
+  result->H = H;
+
+  result->content = addContent(name, context, filePath);
+  result->prompt = xzalloc(1);
+  // If there was content, format it's first line as usual, otherwise create an empty first line.
+  if (result->content->lines.next != &(result->content->lines))
+  {
+    result->line = nextLine(result->content, &(result->content->lines));
+    result->oW = formatLine(result, result->line->line, &(result->output));
+  }
+  else
+  {
+    result->line = addLine(result->content, NULL, "\0", 0);
+    result->output = xzalloc(1);
+  }
+  if (result->content->flags & CONTENT_JOURNAL)
+    result->statusLine = xmprintf("%s has unsaved changes from last time, the recover command gets them back.", filePath);
+
+  return result;
+}
+
+box *addBox(char *name, struct context *context, char *filePath, uint16_t X, uint16_t Y, uint16_t W, uint16_t H)
+{
+  box *result = xzalloc(sizeof(struct _box));
+
+  result->X = X;
+  result->Y = Y;
+  result->W = W;
+  result->H = H;
+  result->view = addView(name, context, filePath, X, Y, W, H);
+  result->view->box = result;
+  sizeViewToBox(result, X, Y, W, H);
+
+  return result;
+}
+
+void freeBox(box *box)
+{
+  if (box)
+  {
+    freeBox(box->sub1);
+    freeBox(box->sub2);
+    if (box->view)
+    {
+      searchStop(box->view);
+      // In theory the line should not be part of the content if there is no content, so we should free it.
+      if (!box->view->content)
+        freeLine(NULL, box->view->line);
+      free(box->view->prompt);
+      free(box->view->statusLine);
+      free(box->view->output);
+      free(box->view);
+    }
+    free(box);
+  }
+}
+
+char **boxChars(box *box)
+{
+  if (box == currentBox)
+    return (toys.optflags & FLAG_a) ? borderCharsCurrent[0] : borderCharsCurrent[1];
+  return (toys.optflags & FLAG_a) ? borderChars[0] : borderChars[1];
+}
+
+void drawBox(box *box)
+{
+  // This could be heavily optimized, but let's keep things simple for now.
+  // Optimized for sending less characters I mean, on slow serial links for instance.
+
+  char **bchars = boxChars(box);
+  char *left = "\0", *right = "\0";
+  struct line *lines = NULL;
+  struct filter *filter = box->view ? box->view->filter : NULL;
+  int y = box->Y, current = (box == currentBox);
+  uint16_t h = box->Y + box->H;
+  uint32_t row = box->view ? box->view->offsetY : 0;
+
+  if (headless)
+    return;
+  if (drawHeld)
+  {
+    box->flags |= BOX_HELD;
+    return;
+  }
+  box->flags &= ~BOX_HELD;
+  // Slow and laborious way to figure out where in the linked list of lines we start from.
+  // Wont scale well, but is simple, and skips over evicted blocks at least.
+  if (box->view && box->view->content && !filter)
+    lines = stepLines(box->view->content, &(box->view->content->lines), box->view->offsetY);
+
+  if (box->flags & BOX_BORDER)
+  {
+    h--;
+    left = right = bchars[1];
+    drawLine(y++, box->X, box->X + box->W, bchars[2], bchars[0], NULL, bchars[3], current, NULL, 0);
+  }
+
+  while (y < h)
+  {
+    char *line = "";
+
+    // A filtered view only has it's rows, each found from the one before, the first from the current line.
+    if (filter && (row < filter->count))
+    {
+      if (row == box->view->offsetY)
+        lines = stepLines(box->view->content, box->view->line, (long) filter->rows[row] - (long) filter->at);
+      else
+        lines = stepLines(box->view->content, lines, filter->rows[row] - filter->rows[row - 1]);
+      line = lines->line;
+      if (box->view->Y + (box->view->cY - box->view->offsetY) == y)
+      {
+        box->view->line = lines;
+        filter->at = filter->rows[row];
+      }
+      row++;
+    }
+    else if (lines)
+    {
+      lines = nextLine(box->view->content, lines);
+      if (&(box->view->content->lines) == lines)  // We are at the end if we have wrapped to the beginning.
+        lines = NULL;
+      else
+        line = lines->line;
+      // Figure out which line is our current line while we are here.
+      if (box->view->Y + (box->view->cY - box->view->offsetY) == y)
+        box->view->line = lines;
+    }
+    drawContentLine(box->view, y++, box->X, box->X + box->W, left, " ", line, right, current);
+  }
+  if (box->flags & BOX_BORDER)
+    drawLine(y++, box->X, box->X + box->W, bchars[4], bchars[0], NULL, bchars[5], current, NULL, 0);
+  fflush(stdout);
+}
+
+// Draw just the lines of a box from line number from on, they are usually at the end.
+void drawBoxLines(box *box, uint32_t from)
+{
+  view *view = box->view;
+  struct line *line;
+  long i = view->content->lines.length - 1, last = view->offsetY + view->H - 1;
+  char *left = "\0", *right = "\0";
+
+  if (headless)
+    return;
+  // It's all drawn when the drawing is let go.
+  if (drawHeld || (box->flags & BOX_HELD))
+  {
+    drawBox(box);
+    return;
+  }
+  if (box->flags & BOX_BORDER)
+    left = right = boxChars(box)[1];
+  if (from < view->offsetY)
+    from = view->offsetY;
+  if (i > last)
+    i = last;
+  line = stepLines(view->content, &(view->content->lines), i - view->content->lines.length);
+  for (; (i >= from) && (&(view->content->lines) != line); i--, line = prevLine(view->content, line))
+    drawContentLine(view, view->Y + (i - view->offsetY), box->X, box->X + box->W, left, " ", line->line, right, box == currentBox);
+  fflush(stdout);
+}
+
+void drawBoxes(box *box)
+{
+  if (box->sub1)  // If there's one sub box, there's always two.
+  {
+    drawBoxes(box->sub1);
+    drawBoxes(box->sub2);
+  }
+  else
+    drawBox(box);
+}
+
+// Scripts, macros, and repeat counts hold the drawing until they are done, instead of drawing each step.  The boxes
+// that wanted drawing are remembered, and drawn once when the last hold is let go, with the current line.
+void drawHold(void)
+{
+  drawHeld++;
+}
+
+void drawHeldBoxes(box *box)
+{
+  if (box->sub1)
+  {
+    drawHeldBoxes(box->sub1);
+    drawHeldBoxes(box->sub2);
+  }
+  else if (box->flags & BOX_HELD)
+    drawBox(box);
+}
+
+void drawRelease(void)
+{
+  if (drawHeld && !--drawHeld)
+  {
+    if (rootBox)
+      drawHeldBoxes(rootBox);
+    if (lineHeld && currentBox)
+    {
+      lineHeld = 0;
+      updateLine(currentBox->view);
+    }
+  }
+}
+
+void calcBoxes(box *box)
+{
+  if (box->sub1)  // If there's one sub box, there's always two.
+  {
+    box->sub1->X = box->X;
+    box->sub1->Y = box->Y;
+    box->sub1->W = box->W;
+    box->sub1->H = box->H;
+    box->sub2->X = box->X;
+    box->sub2->Y = box->Y;
+    box->sub2->W = box->W;
+    box->sub2->H = box->H;
+    if (box->flags & BOX_HSPLIT)
+    {
+      box->sub1->H *= box->split;
+      box->sub2->H -= box->sub1->H;
+      box->sub2->Y += box->sub1->H;
+    }
+    else
+    {
+      box->sub1->W *= box->split;
+      box->sub2->W -= box->sub1->W;
+      box->sub2->X += box->sub1->W;
+    }
+    sizeViewToBox(box->sub1, -1, -1, -1, -1);
+    calcBoxes(box->sub1);
     sizeViewToBox(box->sub2, -1, -1, -1, -1);
     calcBoxes(box->sub2);
   }
-  // Move the cursor to where it is, to check it's not now outside the box.
-  moveCursorAbsolute(box->view, box->view->cX, box->view->cY, 0, 0);
+  // Move the cursor to where it is, to check it's not now outside the box.
+  moveCursorAbsolute(box->view, box->view->cX, box->view->cY, 0, 0);
+
+  // We could call drawBoxes() here, but this is recursive, and so is drawBoxes().
+  // The combination might be deadly.  Drawing the content of a box might be an expensive operation.
+  // Later we might use a dirty box flag to deal with this, if it's not too much of a complication.
+}
+
+void deleteBox(view *view)
+{
+  box *box = view->box;
+
+  if (box->parent)
+  {
+    struct _box *oldBox = box, *otherBox = box->parent->sub1;
+
+    if (otherBox == oldBox)
+      otherBox = box->parent->sub2;
+    if (currentBox->parent == box->parent)
+      currentBox = box->parent;
+    box = box->parent;
+    box->X = box->sub1->X;
+    box->Y = box->sub1->Y;
+    if (box->flags & BOX_HSPLIT)
+      box->H = box->sub1->H + box->sub2->H;
+    else
+      box->W = box->sub1->W + box->sub2->W;
+    box->flags &= ~BOX_HSPLIT;
+    // Move the other sub boxes contents up to this box.
+    box->sub1 = otherBox->sub1;
+    box->sub2 = otherBox->sub2;
+    if (box->sub1)
+    {
+        box->sub1->parent = box;
+        box->sub2->parent = box;
+        box->flags = otherBox->flags;
+        if (currentBox == box)
+          currentBox = box->sub1;
+    }
+    else
+    {
+      if (!box->parent)
+        box->flags &= ~BOX_BORDER;
+      box->split = 1.0;
+    }
+    otherBox->sub1 = NULL;
+    otherBox->sub2 = NULL;
+    // Safe to free the boxes now that we have all their contents.
+    freeBox(otherBox);
+    freeBox(oldBox);
+  }
+  // Otherwise it must be a single full screen box.  Never delete that one, unless we are quitting.
+
+  // Start the recursive recalculation of all the sub boxes.
+  calcBoxes(box);
+  drawBoxes(box);
+}
+
+void cloneBox(struct _box *box, struct _box *sub)
+{
+  sub->parent = box;
+  // Only a full screen box has no border.
+  sub->flags |= BOX_BORDER;
+  sub->view = xmalloc(sizeof(struct _view));
+  // TODO - After this is more stable, should check if the memcpy() is simpler than - xzalloc() then copy a few things manually.
+  //          Might even be able to arrange the structure so we can memcpy just part of it, leaving the rest blank.
+  memcpy(sub->view, box->view, sizeof(struct _view));
+  sub->view->damage = NULL;
+  sub->view->data = NULL;
+  sub->view->output = NULL;
+  sub->view->statusLine = NULL;
+  sub->view->box = sub;
+  if (box->view->prompt)
+    sub->view->prompt = strdup(box->view->prompt);
+}
+
+void splitBox(box *box, float split)
+{
+  uint16_t size;
+  int otherBox = 0;
+
+  // First some sanity checks.
+  if (0.0 > split)
+  {
+    // TODO - put this in the status line, or just silently fail.  Also, better message.  lol
+    fprintf(stderr, "User is crazy.\n");
+    return;
+  }
+  else if (1.0 <= split)  // User meant to unsplit, and it may already be split.
+  {
+    // Actually, this means that the OTHER sub box gets deleted.
+    if (box->parent)
+    {
+      if (box == box->parent->sub1)
+        deleteBox(box->parent->sub2->view);
+      else
+        deleteBox(box->parent->sub1->view);
+    }
+    return;
+  }
+  else if (0.0 < split)  // This is the normal case, so do nothing.
+  {
+  }
+  else      // User meant to delete this, zero split.
+  {
+      deleteBox(box->view);
+      return;
+  }
+  if (box->flags & BOX_HSPLIT)
+    size = box->H;
+  else
+    size = box->W;
+  if (6 > size)    // Is there room for 2 borders for each sub box and one character of content each?
+        // TODO - also should check the contents minimum size.
+        // No need to check the no border case, that's only for full screen.
+        // People using terminals smaller than 6 characters get what they deserve.
+  {
+    // TODO - put this in the status line, or just silently fail.
+    fprintf(stderr, "Box is too small to split.\n");
+    return;
+  }
+
+  // Note that a split box is actually three boxes.  The parent, which is not drawn, and the two subs, which are.
+  // Based on the assumption that there wont be lots of boxes, this keeps things simple.
+  // It's possible that the box has already been split, and this is called just to update the split.
+  box->split = split;
+  if (NULL == box->sub1)  // If not split already, do so.
+  {
+    box->sub1 = xzalloc(sizeof(struct _box));
+    box->sub2 = xzalloc(sizeof(struct _box));
+    cloneBox(box, box->sub1);
+    cloneBox(box, box->sub2);
+    if (box->flags & BOX_HSPLIT)
+    {
+      // Split the boxes in the middle of the content.
+      box->sub2->view->offsetY += (box->H * box->split) - 2;
+      // Figure out which sub box the cursor will be in, then update the cursor in the other box.
+      if (box->sub1->view->cY < box->sub2->view->offsetY)
+        box->sub2->view->cY = box->sub2->view->offsetY;
+      else
+      {
+        box->sub1->view->cY = box->sub2->view->offsetY - 1;
+        otherBox = 1;
+      }
+    }
+    else
+    {
+      // Split the boxes in the middle of the content.
+      box->sub2->view->offsetX += (box->W * box->split) - 2;
+      // Figure out which sub box the cursor will be in, then update the cursor in the other box.
+      if (box->sub1->view->cX < box->sub2->view->offsetX)
+        box->sub2->view->cX = box->sub2->view->offsetX;
+      else
+      {
+        box->sub1->view->cX = box->sub2->view->offsetX - 1;
+        otherBox = 1;
+      }
+    }
+  }
+
+  if ((currentBox == box) && (box->sub1))
+  {
+    if (otherBox)
+      currentBox = box->sub2;
+    else
+      currentBox = box->sub1;
+  }
+
+  // Start the recursive recalculation of all the sub boxes.
+  calcBoxes(box);
+  drawBoxes(box);
+}
+
+// TODO - Might be better to just have a double linked list of boxes, and traverse that instead.
+//          Except that leaves a problem when deleting boxes, could end up with a blank space.
+void switchBoxes(view *view)
+{
+  box *box = view->box;
+
+  // The assumption here is that box == currentBox.
+  struct _box *oldBox = currentBox;
+  struct _box *thisBox = box;
+  int backingUp = 0;
+
+  // Depth first traversal.
+  while ((oldBox == currentBox) && (thisBox->parent))
+  {
+    if (thisBox == thisBox->parent->sub1)
+    {
+      if (backingUp && (thisBox->parent))
+        currentBox = thisBox->parent->sub2;
+      else if (thisBox->sub1)
+        currentBox = thisBox->sub1;
+      else
+        currentBox = thisBox->parent->sub2;
+    }
+    else if (thisBox == thisBox->parent->sub2)
+    {
+      thisBox = thisBox->parent;
+      backingUp = 1;
+    }
+  }
+
+  // If we have not found the next box to move to, move back to the beginning.
+  if (oldBox == currentBox)
+    currentBox = rootBox;
+
+  // If we ended up on a parent box, go to it's first sub.
+  while (currentBox->sub1)
+    currentBox = currentBox->sub1;
+
+  // Just redraw them all.
+  drawBoxes(rootBox);
+}
+
+// TODO - It might be better to do away with this bunch of single line functions
+//        and map script commands directly to lower functions.
+//        How to deal with the various argument needs?
+//        Might be where we can re use the toybox argument stuff.
+
+void halveBoxHorizontally(view *view)
+{
+  view->box->flags |= BOX_HSPLIT;
+  splitBox(view->box, 0.5);
+}
+
+void halveBoxVertically(view *view)
+{
+  view->box->flags &= ~BOX_HSPLIT;
+  splitBox(view->box, 0.5);
+}
+
+void switchMode(view *view)
+{
+  // Switching away from being asked for an argument gives up on it.
+  if (promptHandler)
+  {
+    isearchEnd(0);
+    promptDone();
+    return;
+  }
+  currentBox->view->mode++;
+  // Assumes that modes will always have a key mapping, which I think is a safe bet.
+  if (NULL == currentBox->view->content->context->modes[currentBox->view->mode].keys)
+    currentBox->view->mode = 0;
+  commandMode = currentBox->view->content->context->modes[currentBox->view->mode].flags & 1;
+}
+
+// These all go count times as far, in one move.
+void leftChar(view *view)
+{
+  moveCursorRelative(view, 0 - countTake(), 0, 0, 0);
+}
+
+void rightChar(view *view)
+{
+  moveCursorRelative(view, countTake(), 0, 0, 0);
+}
+
+void upLine(view *view)
+{
+  moveCursorRelative(view, 0, 0 - countTake(), 0, 0);
+}
+
+void downLine(view *view)
+{
+  moveCursorRelative(view, 0, countTake(), 0, 0);
+}
+
+void upPage(view *view)
+{
+  long count = countTake() * (view->H - 1);
+
+  moveCursorRelative(view, 0, 0 - count, 0, 0 - count);
+}
+
+void downPage(view *view)
+{
+  long count = countTake() * (view->H - 1);
+
+  moveCursorRelative(view, 0, count, 0, count);
+}
+
+// Go to the line number given as a count, or the first line.
+void firstLine(view *view)
+{
+  undoCursor(view, commandCount ? countTake() - 1 : 0, 0);
+}
+
+// Go to the line number given as a count, or the last line.
+void lastLine(view *view)
+{
+  undoCursor(view, commandCount ? countTake() - 1 : view->content->lines.length - 1, 0);
+}
+
+void endOfLine(view *view)
+{
+  moveCursorAbsolute(view, strlen(view->prompt) + view->oW, view->cY, 0, 0);
+}
+
+void startOfLine(view *view)
+{
+  // TODO - add the advanced editing "smart home".
+  moveCursorAbsolute(view, strlen(view->prompt), view->cY, 0, 0);
+}
+
+// Insert len bytes of text at the cursor, newlines and all, remembering it for undo.  Returns the line it ends on.
+struct line *editInsert(view *view, char *text, uint32_t len, uint8_t flags)
+{
+  undoRecord(view->content, UNDO_INSERT | flags, view->cY, view->iX, text, len);
+  journalRecord(view->content, UNDO_INSERT, view->cY, view->iX, text, len);
+  return insertText(view->content, view->line, view->iX, text, len);
+}
+
+// Delete len bytes at the cursor, newlines and all, remembering them for undo.  Onto the end of cut, if it's not NULL.
+void editDelete(view *view, uint32_t len, uint8_t flags, struct content *cut)
+{
+  char *deleted = xmalloc(len + 1);
+
+  len = deleteText(view->content, view->line, view->iX, len, deleted, cut);
+  undoRecord(view->content, UNDO_DELETE | flags, view->cY, view->iX, deleted, len);
+  journalRecord(view->content, UNDO_DELETE, view->cY, view->iX, deleted, len);
+  free(deleted);
+}
+
+void splitLine(view *view)
+{
+  long count = countTake();
+  char *newlines = xmalloc(count);
+
+  // A count of them all go in at once.
+  memset(newlines, '\n', count);
+  editInsert(view, newlines, count, 0);
+  free(newlines);
+  moveCursorAbsolute(view, 0, view->cY + count, 0, 0);
+  if (view->box)
+    drawBox(view->box);
+}
+
+void deleteChar(view *view)
+{
+  long count = countTake();
+
+  // A count of them, newlines and all, go in one delete, but no further than the end.
+  if (1 < count)
+  {
+    struct line *line = view->line;
+    uint32_t len;
+
+    for (len = strlen(&(line->line[view->iX])); len < count; len += strlen(line->line) + 1)
+      if (&(view->content->lines) == (line = nextLine(view->content, line)))
+        break;
+    if (len > count)
+      len = count;
+    if (len)
+      editDelete(view, len, 0, NULL);
+    view->oW = formatLine(view, view->line->line, &(view->output));
+    if ((line != view->line) && view->box)
+      drawBox(view->box);
+  }
+  // If we are at the end of the line, then join this and the next line.
+  else if (view->oW == view->cX)
+  {
+    // Only if there IS a next line.
+    if (&(view->content->lines) != view->line->next)
+    {
+      editDelete(view, 1, 0, NULL);
+      // TODO - should check if we are on the last page, then deal with scrolling.
+      if (view->box)
+        drawBox(view->box);
+    }
+  }
+  else
+  {
+    editDelete(view, 1, 0, NULL);
+    view->oW = formatLine(view, view->line->line, &(view->output));
+  }
+}
+
+void backSpaceChar(view *view)
+{
+  long count = countTake(), back = 0;
+
+  // Back over a count of them, then they all go at once.
+  while ((back < count) && moveCursorRelative(view, -1, 0, 0, 0))
+    back++;
+  if (back)
+  {
+    commandCount = back;
+    deleteChar(view);
+  }
+}
+
+// Put the cursor at byte x of line y, after the lines changed under it.
+void undoCursor(view *view, uint32_t y, uint32_t x)
+{
+  // y is a line number, filtered views want a row.
+  if (view->filter)
+    y = filterRow(view->filter, y, 0);
+  moveCursorAbsolute(view, 0, y, 0, 0);
+  view->oW = formatLine(view, view->line->line, &(view->output));
+  moveCursorAbsolute(view, x, y, 0, 0);
+}
+
+// Do, or undo, one record.
+void undoApply(view *view, struct undoOp *op, int undo)
+{
+  char *text = (char *) (op + 1), *end, *nl;
+  uint32_t y = op->y, x = op->x;
+
+  undoCursor(view, y, x);
+  if ((!(op->flags & UNDO_INSERT)) == !undo)
+  {
+    deleteText(view->content, view->line, x, op->length, NULL, NULL);
+    journalRecord(view->content, UNDO_DELETE, y, x, NULL, op->length);
+    undoCursor(view, y, x);
+  }
+  else
+  {
+    insertText(view->content, view->line, x, text, op->length);
+    journalRecord(view->content, UNDO_INSERT, y, x, text, op->length);
+    // Redoing leaves the cursor after what was put back, undoing leaves it where it was.
+    if (!undo)
+    {
+      x += op->length;
+      for (end = text + op->length; (nl = memchr(text, '\n', end - text)); text = nl + 1)
+      {
+        y++;
+        x = end - (nl + 1);
+      }
+    }
+    undoCursor(view, y, x);
+  }
+}
+
+void undo(view *view)
+{
+  struct undo *undo = &(view->content->undo);
+  struct undoOp *op;
+
+  if (!undo->at)
+  {
+    free(view->statusLine);
+    view->statusLine = xstrdup("Nothing to undo");
+    return;
+  }
+
+  // Step back through the group, undoing as we go.  Big groups would scroll the box for every record, so it's only
+  // drawn once they are all done.
+  drawHold();
+  do
+  {
+    op = (struct undoOp *) &(undo->arena[(undo->at < undo->length) ? undo->at - ((struct undoOp *) &(undo->arena[undo->at]))->prev : undo->last]);
+    undoApply(view, op, 1);
+    undo->at = (char *) op - undo->arena;
+  }
+  while (undo->at && !(op->flags & UNDO_GROUP));
+  // Typing after an undo doesn't get added to what's before it.
+  undo->group = 1;
+  if (view->box)
+    drawBox(view->box);
+  drawRelease();
+}
+
+void redo(view *view)
+{
+  struct undo *undo = &(view->content->undo);
+  struct undoOp *op;
+
+  if (undo->at >= undo->length)
+  {
+    free(view->statusLine);
+    view->statusLine = xstrdup("Nothing to redo");
+    return;
+  }
+
+  drawHold();
+  do
+  {
+    op = (struct undoOp *) &(undo->arena[undo->at]);
+    undoApply(view, op, 0);
+    undo->at += op->size;
+  }
+  while ((undo->at < undo->length) && !(((struct undoOp *) &(undo->arena[undo->at]))->flags & UNDO_GROUP));
+  undo->group = 1;
+  if (view->box)
+    drawBox(view->box);
+  drawRelease();
+}
+
+// Replay the journal of unsaved changes left behind when we didn't quit properly.
+void recover(view *view)
+{
+  struct content *content = view->content;
+  struct journalOp op;
+  char *data = content->recovery;
+  off_t size = content->recoverySize, pos;
+  uint32_t count = 0, y = 0, x = 0;
+
+  free(view->statusLine);
+  // Only what was read when the file was opened, not what this time's journal has in it.
+  if (!(content->flags & CONTENT_JOURNAL))
+  {
+    view->statusLine = xmprintf("No unsaved changes to %s to recover", content->path ? content->path : content->name);
+    return;
+  }
+
+  // They go through the new journal, and can be undone as one.
+  for (pos = 0; pos < size; pos += sizeof(op))
+  {
+    memcpy(&op, &(data[pos]), sizeof(op));
+    if (JOURNAL_MARK == op.flags)
+      continue;
+    moveCursorAbsolute(view, 0, op.y, 0, 0);
+    view->iX = op.x;
+    if (op.flags & UNDO_INSERT)
+    {
+      editInsert(view, &(data[pos + sizeof(op)]), op.length, 0);
+      pos += op.length;
+    }
+    else
+      editDelete(view, op.length, 0, NULL);
+    y = op.y;
+    x = op.x;
+    count++;
+  }
+  free(data);
+  content->recovery = NULL;
+  content->recoverySize = 0;
+  content->flags &= ~CONTENT_JOURNAL;
+  undoCursor(view, y, x);
+  view->statusLine = xmprintf("Recovered %u changes to %s", count, content->path);
+  if (view->box)
+    drawBox(view->box);
+}
+
+void saveContent(view *view)
+{
+  free(view->statusLine);
+  if (saveFile(view->content))
+    view->statusLine = xmprintf("Can't save %s - %s", view->content->path ? view->content->path : view->content->name, strerror(errno));
+  else
+    view->statusLine = xmprintf("Saved %s", view->content->path);
+}
+
+// Cut and copied text goes to the front of the kill ring, or to a named buffer.  Each is a content with just a list of
+// lines and no file, the text is them joined with newlines, so whole lines end with an empty line.
+#define KILL_RING  8
+static struct content *killRing[KILL_RING];	// The newest first.
+static struct content *namedBuffers[26];
+// Cutting again straight after a cut, from the same place, adds to it.  Pasting remembers where, for yankPop().
+static struct
+{
+  struct content *content;
+  size_t at;
+  uint32_t y, x, length, ring;
+} lastKill, lastPaste;
+
+struct content *newBuffer(void)
+{
+  struct content *result = xzalloc(sizeof(struct content));
+
+  result->lines.next = &(result->lines);
+  result->lines.prev = &(result->lines);
+  return result;
+}
+
+void freeBuffer(struct content *buffer)
+{
+  if (buffer)
+  {
+    if (buffer->lines.length)
+      mooshLines(buffer, &(buffer->lines), buffer->lines.prev, buffer->lines.length, NULL, NULL);
+    free(buffer);
+  }
+}
+
+// The named buffer given as the command argument, or the newest in the kill ring.
+struct content *pasteBuffer(void)
+{
+  if (commandArgument && isalpha(*commandArgument))
+    return namedBuffers[tolower(*commandArgument) - 'a'];
+  return killRing[0];
+}
+
+// Where to cut or copy to.  A capital buffer name adds to that buffer, as does cutting again from the same place.
+struct content *killBuffer(view *view)
+{
+  struct content **buffer = &(killRing[0]);
+
+  if (commandArgument && isalpha(*commandArgument))
+  {
+    buffer = &(namedBuffers[tolower(*commandArgument) - 'a']);
+    if (isupper(*commandArgument) && *buffer)
+      return *buffer;
+  }
+  else if ((lastKill.content == view->content) && (lastKill.at == view->content->undo.at) && (lastKill.y == view->cY)
+    && (lastKill.x == view->iX) && *buffer)
+    return *buffer;
+  else
+  {
+    freeBuffer(killRing[KILL_RING - 1]);
+    memmove(&(killRing[1]), &(killRing[0]), (KILL_RING - 1) * sizeof(struct content *));
+    *buffer = NULL;
+  }
+  freeBuffer(*buffer);
+
+  return *buffer = newBuffer();
+}
+
+#define REGION_MARK  0	// From the mark to the cursor, or the whole line without a mark.
+#define REGION_LINE  1	// The whole line, and it's newline.
+#define REGION_END   2	// To the end of the line, or just the newline if already there.
+
+// Move the cursor to the start of a region, and return how many bytes are in it, newlines and all.
+// Sets end if the region is whole lines that run to the end of the content, so there's no newline after the last.
+uint32_t region(view *view, int type, int *end)
+{
+  struct line *line;
+  uint32_t y = view->cY, x = view->iX, y2 = y, x2 = x, len;
+
+  if ((REGION_MARK == type) && view->marked)
+  {
+    if ((view->mY < y) || ((view->mY == y) && (view->mX < x)))
+    {
+      y = view->mY;
+      x = view->mX;
+    }
+    else
+    {
+      y2 = view->mY;
+      x2 = view->mX;
+    }
+    view->marked = 0;
+  }
+  else if (REGION_END == type)
+    x2 = strlen(view->line->line);
+  else
+  {
+    // ex commands can be given a range of lines.
+    if (commandRanged)
+    {
+      y = commandFrom;
+      y2 = commandTo;
+    }
+    x = x2 = 0;
+    y2++;
+  }
+  *end = 0;
+  undoCursor(view, y, x);
+  if (x > strlen(view->line->line))
+    x = strlen(view->line->line);
+  view->iX = x;
+
+  // A newline at the end of the line, or the end of the content.
+  if ((y == y2) && (x == x2) && (REGION_END == type))
+    return 1;
+  for (line = view->line, len = 0 - x; y < y2; y++)
+  {
+    len += strlen(line->line) + 1;
+    if (&(view->content->lines) == (line = nextLine(view->content, line)))
+    {
+      *end = 1;
+      return len - 1;
+    }
+  }
+
+  return len + x2;
+}
+
+void killText(view *view, int type, int cut)
+{
+  struct content *content = view->content, *buffer = killBuffer(view);
+  int end;
+  uint32_t len = region(view, type, &end);
+
+  if (cut)
+  {
+    editDelete(view, len, 0, buffer);
+    // The last lines have no newline after them to take, so take the one before them, unless it's all the lines,
+    // then one empty line is left.  Either way the buffer gets whole lines.
+    if (end)
+    {
+      addLine(buffer, NULL, "", 0);
+      if (viewLine(view))
+      {
+        undoCursor(view, viewLine(view) - 1, 0);
+        view->iX = strlen(view->line->line);
+        editDelete(view, 1, 0, NULL);
+        len++;
+      }
+    }
+    lastKill.content = content;
+    lastKill.at = content->undo.at;
+    lastKill.y = view->cY;
+    lastKill.x = view->iX;
+  }
+  else
+  {
+    len = copyText(content, view->line, view->iX, len, buffer);
+    if (end)
+      addLine(buffer, NULL, "", 0);
+  }
+  free(view->statusLine);
+  view->statusLine = xmprintf("%s %u bytes", cut ? "Cut" : "Copied", len);
+  if (view->box)
+    drawBox(view->box);
+}
+
+void setMark(view *view)
+{
+  view->mY = view->cY;
+  view->mX = view->iX;
+  view->marked = 1;
+  free(view->statusLine);
+  view->statusLine = xstrdup("Mark set");
+}
+
+void cutRegion(view *view)
+{
+  killText(view, REGION_MARK, 1);
+}
+
+void copyRegion(view *view)
+{
+  killText(view, REGION_MARK, 0);
+}
+
+// A count means that many lines, like 5dd in vi, all cut at once.
+void countLines(view *view)
+{
+  long count = countTake();
+
+  if ((1 < count) && !commandRanged)
+  {
+    commandFrom = viewLine(view);
+    commandTo = ((commandFrom + count) < view->content->lines.length) ? commandFrom + count - 1
+      : view->content->lines.length - 1;
+    commandRanged = 1;
+  }
+}
+
+void cutLine(view *view)
+{
+  countLines(view);
+  killText(view, REGION_LINE, 1);
+}
+
+void copyLine(view *view)
+{
+  countLines(view);
+  killText(view, REGION_LINE, 0);
+}
+
+void cutToEnd(view *view)
+{
+  killText(view, REGION_END, 1);
+}
+
+// The text of a buffer all in one piece, for the undo and unsaved changes journals.
+char *bufferText(struct content *buffer, uint32_t *len)
+{
+  struct line *line;
+  char *result;
+  uint32_t l;
+
+  for (*len = 0, line = buffer->lines.next; &(buffer->lines) != line; line = line->next)
+    *len += strlen(line->line) + 1;
+  result = xmalloc(*len);
+  for (*len = 0, line = buffer->lines.next; &(buffer->lines) != line; line = line->next)
+  {
+    memcpy(&(result[*len]), line->line, l = strlen(line->line));
+    *len += l;
+    result[(*len)++] = '\n';
+  }
+  // The last line has no newline.
+  if (*len)
+    result[--(*len)] = '\0';
+
+  return result;
+}
+
+void pasteFrom(view *view, struct content *buffer)
+{
+  struct content *content = view->content;
+  uint32_t len, y = view->cY, x = view->iX;
+  char *text;
+
+  if (!buffer || !buffer->lines.length)
+  {
+    free(view->statusLine);
+    view->statusLine = xstrdup("Nothing to paste");
+    return;
+  }
+  text = bufferText(buffer, &len);
+  undoRecord(content, UNDO_INSERT, y, x, text, len);
+  journalRecord(content, UNDO_INSERT, y, x, text, len);
+  free(text);
+  pasteLines(content, view->line, x, buffer);
+  // Leave the cursor after it.
+  if (1 < buffer->lines.length)
+    undoCursor(view, y + buffer->lines.length - 1, strlen(buffer->lines.prev->line));
+  else
+    undoCursor(view, y, x + len);
+  lastPaste.content = content;
+  lastPaste.at = content->undo.at;
+  lastPaste.y = y;
+  lastPaste.x = x;
+  lastPaste.length = len;
+  if (view->box)
+    drawBox(view->box);
+}
+
+void paste(view *view)
+{
+  lastPaste.ring = 0;
+  pasteFrom(view, pasteBuffer());
+}
+
+// Swap what was just pasted for the next older one in the kill ring.
+void yankPop(view *view)
+{
+  if ((lastPaste.content != view->content) || (lastPaste.at != view->content->undo.at))
+  {
+    free(view->statusLine);
+    view->statusLine = xstrdup("Last command was not a paste");
+    return;
+  }
+  undoCursor(view, lastPaste.y, lastPaste.x);
+  view->iX = lastPaste.x;
+  editDelete(view, lastPaste.length, 0, NULL);
+  do
+    lastPaste.ring = (lastPaste.ring + 1) % KILL_RING;
+  while (lastPaste.ring && !killRing[lastPaste.ring]);
+  pasteFrom(view, killRing[lastPaste.ring]);
+}
+
+// Vi puts whole lines after the current one, anything else after the cursor.  ex's put goes after the line it's given,
+// or the last of the range, and anything that's not whole lines goes there as lines of it's own.
+void viPut(view *view)
+{
+  struct content *buffer = pasteBuffer();
+  int lines = buffer && (1 < buffer->lines.length) && !buffer->lines.prev->line[0];
+
+  if (commandRanged)
+    undoCursor(view, commandTo, 0);
+  if (lines && (&(view->content->lines) != view->line->next))
+  {
+    undoCursor(view, view->cY + 1, 0);
+    pasteFrom(view, buffer);
+    undoCursor(view, lastPaste.y, 0);
+  }
+  else if (lines || (commandRanged && buffer && buffer->lines.length))
+  {
+    // The newline goes first, and after the last line there's no empty line left after it.
+    view->iX = strlen(view->line->line);
+    editInsert(view, "\n", 1, 0);
+    undoCursor(view, view->cY + 1, 0);
+    pasteFrom(view, buffer);
+    if (lines)
+    {
+      moveCursorRelative(view, -1, 0, 0, 0);
+      editDelete(view, 1, 0, NULL);
+    }
+    undoCursor(view, lastPaste.y, 0);
+  }
+  else
+  {
+    if (view->line->line[view->iX])
+      view->iX++;
+    pasteFrom(view, buffer);
+  }
+}
+
+void viPutBefore(view *view)
+{
+  struct content *buffer = pasteBuffer();
+
+  if (buffer && (1 < buffer->lines.length) && !buffer->lines.prev->line[0])
+  {
+    view->iX = 0;
+    pasteFrom(view, buffer);
+    undoCursor(view, lastPaste.y, 0);
+  }
+  else
+    pasteFrom(view, buffer);
+}
+
+// Send a buffer to the terminals clipboard, as an OSC 52 escape sequence.  It's base64 encoded a chunk at a time, so
+// big ones don't need another copy.
+void clipboard(view *view)
+{
+  static char *base64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  struct content *buffer = pasteBuffer();
+  struct line *line;
+  unsigned char in[3];
+  char *c;
+  size_t total = 0;
+  int have = 0, out = 0;
+
+  free(view->statusLine);
+  if (!buffer || !buffer->lines.length)
+  {
+    view->statusLine = xstrdup("Nothing to copy to the clipboard");
+    return;
+  }
+  if (headless)
+  {
+    view->statusLine = xstrdup("No terminal to copy to the clipboard of");
+    return;
+  }
+  fputs("\x1B]52;c;", stdout);
+  for (line = buffer->lines.next; &(buffer->lines) != line; line = line->next)
+  {
+    for (c = line->line; ; c++)
+    {
+      // The newlines are between lines.
+      if (!*c && (&(buffer->lines) == line->next))
+        break;
+      in[have++] = *c ? *c : '\n';
+      total++;
+      if (3 == have)
+      {
+        toybuf[out++] = base64[in[0] >> 2];
+        toybuf[out++] = base64[((in[0] & 3) << 4) | (in[1] >> 4)];
+        toybuf[out++] = base64[((in[1] & 15) << 2) | (in[2] >> 6)];
+        toybuf[out++] = base64[in[2] & 63];
+        have = 0;
+        if ((sizeof(toybuf) - 4) < out)
+        {
+          fwrite(toybuf, 1, out, stdout);
+          out = 0;
+        }
+      }
+      if (!*c)
+        break;
+    }
+  }
+  if (have)
+  {
+    if (1 == have)
+      in[1] = 0;
+    toybuf[out++] = base64[in[0] >> 2];
+    toybuf[out++] = base64[((in[0] & 3) << 4) | (in[1] >> 4)];
+    toybuf[out++] = (2 == have) ? base64[(in[1] & 15) << 2] : '=';
+    toybuf[out++] = '=';
+  }
+  fwrite(toybuf, 1, out, stdout);
+  fputs("\a", stdout);
+  fflush(stdout);
+  view->statusLine = xmprintf("Copied %lu bytes to the clipboard", (unsigned long) total);
+}
+
+// Emacs copies the region to the clipboard, as well as the kill ring.
+void copyClipboard(view *view)
+{
+  copyRegion(view);
+  clipboard(view);
+}
+
+// Searching.  Each line is searched on it's own, matches don't cross lines.  The lines of a block that has not been
+// changed are still all together in it's data, with '\0' between them, so those get searched in one go, and so do
+// evicted blocks, read into a buffer without making lines out of them.  Only the line a match is in gets looked for,
+// and only the evicted block it's in gets read back in.  Places that could match are found by checking the first and
+// last bytes of the pattern, sixteen places at a time where there's SSE2, then the rest gets memcmp()ed.
+struct regex;
+
+struct search
+{
+  struct search *next;	// The ones a context remembers, the last one used first.
+  char *text;		// What was searched for.
+  char *pattern;	// Folded to lower case when ignoring case.  For regular expressions, what every match starts with.
+  uint32_t len;
+  uint8_t syntax;	// SEARCH_LITERAL, SEARCH_BRE, or SEARCH_ERE.
+  int back, fold;
+  struct regex *regex;	// NULL if it's not a regular expression.
+};
+
+static char *searchData;	// Evicted blocks get read into here to be searched.
+static size_t searchSize;
+static uint32_t searchGeneration = 1;	// Goes up when what's highlighted changes.
+static int highlighting = 1;		// If the last search gets highlighted.
+
+#define FOLD(c)  ((('A' <= (c)) && ('Z' >= (c))) ? (c) + 32 : (c))
+
+// The other case of an ASCII letter, or c.
+unsigned char otherCase(unsigned char c)
+{
+  return (('a' <= c) && ('z' >= c)) ? c - 32 : c;
+}
+
+// Check if the pattern is at text, the first and last bytes are already known to match.
+int matchAt(struct search *search, char *text)
+{
+  uint32_t i;
+
+  if (!search->fold)
+    return (3 > search->len) || !memcmp(text + 1, search->pattern + 1, search->len - 2);
+  for (i = 1; i + 1 < search->len; i++)
+    if (FOLD((unsigned char) text[i]) != (unsigned char) search->pattern[i])
+      return 0;
+  return 1;
+}
+
+// Check if the pattern is at text.
+int matchHere(struct search *search, char *text)
+{
+  unsigned char f = text[0], l = text[search->len - 1];
+
+  if (search->fold)
+  {
+    f = FOLD(f);
+    l = FOLD(l);
+  }
+  return (f == (unsigned char) search->pattern[0]) && (l == (unsigned char) search->pattern[search->len - 1])
+    && matchAt(search, text);
+}
+
+// Find the first place the pattern is in len bytes of text, or the last when searching backwards.  Returns NULL if
+// it's not there.
+char *findBytes(struct search *search, char *text, size_t len)
+{
+  size_t n, i = 0;
+
+  if (!search->len || (len < search->len))
+    return NULL;
+  n = len - search->len + 1;	// How many places a match could start.
+#ifdef __SSE2__
+  {
+    unsigned char f = search->pattern[0], l = search->pattern[search->len - 1];
+    __m128i f1 = _mm_set1_epi8(f), f2 = _mm_set1_epi8(search->fold ? otherCase(f) : f);
+    __m128i l1 = _mm_set1_epi8(l), l2 = _mm_set1_epi8(search->fold ? otherCase(l) : l);
+    __m128i a, b;
+    unsigned mask;
+    char *c;
+
+    // Each bit of mask is a place where both the first and last bytes match.
+    if (!search->back)
+    {
+      for (; i + 16 <= n; i += 16)
+      {
+        c = text + i;
+        a = _mm_loadu_si128((__m128i *) c);
+        b = _mm_loadu_si128((__m128i *) (c + search->len - 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, f1), _mm_cmpeq_epi8(a, f2)),
+          _mm_or_si128(_mm_cmpeq_epi8(b, l1), _mm_cmpeq_epi8(b, l2))));
+        for (; mask; mask &= mask - 1)
+          if (matchAt(search, c + __builtin_ctz(mask)))
+            return c + __builtin_ctz(mask);
+      }
+    }
+    else
+    {
+      for (; 16 <= n; n -= 16)
+      {
+        c = text + n - 16;
+        a = _mm_loadu_si128((__m128i *) c);
+        b = _mm_loadu_si128((__m128i *) (c + search->len - 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, f1), _mm_cmpeq_epi8(a, f2)),
+          _mm_or_si128(_mm_cmpeq_epi8(b, l1), _mm_cmpeq_epi8(b, l2))));
+        for (; mask; mask &= ~(1U << (31 - __builtin_clz(mask))))
+          if (matchAt(search, c + 31 - __builtin_clz(mask)))
+            return c + 31 - __builtin_clz(mask);
+      }
+    }
+  }
+#endif
+  // What's left over, or all of it without SSE2.
+  if (!search->back)
+  {
+    for (; i < n; i++)
+      if (matchHere(search, text + i))
+        return text + i;
+  }
+  else
+    while (n--)
+      if (matchHere(search, text + n))
+        return text + n;
+
+  return NULL;
+}
+
+// Regular expressions.  What's searched for is parsed into a tree, which is turned into an NFA, a graph of nodes that
+// each match a set of bytes, split two ways, or check for the start or end of a line.  Running the NFA means keeping
+// track of the set of nodes it could be at after each byte.  Each set that turns up becomes a DFA state, when it's
+// first needed, and remembers which state each byte takes it to, so mostly it's one table lookup per byte.  When there
+// gets to be too many states, they are thrown away and it starts again, and if that keeps happening, it just runs the
+// NFA.  There's two DFAs, one finds where the first match ends, starting anywhere, the other finds the longest match
+// starting at a given place.  Between them they find the leftmost longest match, like POSIX says.  If every match
+// starts with the same few bytes, findBytes() looks for those first, and only the places they are get checked.
+// Back references and word boundaries are not regular, so those are left to regexec(), one line at a time.
+// Lines never have '\0' or '\n' in them, so those are always the end of a line.
+
+#define RE_SET     1	// Tree and NFA node types.
+#define RE_CAT     2
+#define RE_ALT     3
+#define RE_REPEAT  4
+#define RE_BOL     5
+#define RE_EOL     6
+#define RE_EMPTY   7
+#define RE_SPLIT   8
+#define RE_MATCH   9
+
+#define RE_NODES    32768	// The most NFA nodes a regular expression can have.
+#define RE_STATES   1024	// The most DFA states kept at once, each has 256 transitions.
+#define RE_FLUSHES  16		// How many times in a row the states can be thrown away without getting far, before just
+				// running the NFA.
+#define RE_PREFIX   64		// The most of a literal prefix that gets looked for.
+
+#define RE_UNKNOWN   0		// Transitions not worked out yet.
+#define RE_DEAD      INT32_MIN	// Nothing can match from here.
+#define RE_EOLMATCH  (INT32_MIN + 1)	// A match ended at the end of the line.
+
+struct reTree
+{
+  uint8_t type;
+  int a, b;		// The sub trees, or for RE_SET, which set.
+  int min, max;		// For RE_REPEAT, a max of -1 means there's no limit.
+};
+
+struct reNode
+{
+  uint8_t type;		// RE_SET, RE_SPLIT, RE_BOL, RE_EOL, or RE_MATCH.
+  uint32_t set, out, out1;
+};
+
+struct dfaState
+{
+  uint32_t *nodes, count, hash;
+  uint8_t bol, match, eol;	// At the start of a line, a match ends here, one does if the line ends here.
+};
+
+struct dfa
+{
+  struct dfaState *states;	// State 0 isn't used, so transitions can be negative for the match states.
+  int32_t *next;		// 256 transitions per state, RE_UNKNOWN until they are worked out.
+  uint32_t *table;		// Hash table of states.
+  uint32_t count, flushes;
+  size_t scanned;		// How many bytes it's gone through since the states where last thrown away.
+  int32_t start[2];		// Where to start from in the middle of a line, and at the start of one.
+  int anchored;			// Matches have to start where it starts, otherwise they can start anywhere.
+  uint8_t skip[16], skips;	// The bytes that leave the start state in the middle of a line, if there's few enough.
+};
+
+struct regex
+{
+  struct reTree *tree;		// Only while it's being compiled.
+  uint32_t trees;
+  uint8_t (*sets)[32];
+  uint32_t setCount;
+  struct reNode *nodes;
+  uint32_t nodeCount, start;
+  uint32_t *mark, generation, *stack, *list, *list2;	// For working out which nodes come next.
+  struct dfa scan, anchored;
+  regex_t *posix;		// For those that the DFA can't do, or NULL.
+  int clone;			// The NFA and posix belong to another one.
+};
+
+struct reParse
+{
+  struct regex *re;
+  char *p, *why;
+  int syntax, fold, depth, posix;
+};
+
+int reTreeNew(struct reParse *rp, uint8_t type, int a, int b)
+{
+  struct reTree *tree;
+
+  if (!(rp->re->trees % 64))
+    rp->re->tree = xrealloc(rp->re->tree, (rp->re->trees + 64) * sizeof(struct reTree));
+  tree = &(rp->re->tree[rp->re->trees]);
+  tree->type = type;
+  tree->a = a;
+  tree->b = b;
+  tree->min = tree->max = 0;
+
+  return rp->re->trees++;
+}
+
+// A new set of bytes, with nothing in it yet.  Returns a tree node for it.
+int reSetNew(struct reParse *rp)
+{
+  struct regex *re = rp->re;
+
+  if (!(re->setCount % 16))
+    re->sets = xrealloc(re->sets, (re->setCount + 16) * sizeof(*re->sets));
+  memset(re->sets[re->setCount], 0, sizeof(*re->sets));
+
+  return reTreeNew(rp, RE_SET, re->setCount++, 0);
+}
+
+void reSetAdd(struct reParse *rp, int t, unsigned char c)
+{
+  uint8_t *set = rp->re->sets[rp->re->tree[t].a];
+
+  set[c >> 3] |= 1 << (c & 7);
+  if (rp->fold)
+  {
+    c = ('a' <= c) && ('z' >= c) ? c - 32 : FOLD(c);
+    set[c >> 3] |= 1 << (c & 7);
+  }
+}
+
+// The character classes, as in [:alpha:], \w and friends are made from these.
+int reClass(char *name, unsigned char c)
+{
+  if (!strcmp(name, "alpha"))	return isalpha(c);
+  if (!strcmp(name, "digit"))	return isdigit(c);
+  if (!strcmp(name, "alnum"))	return isalnum(c);
+  if (!strcmp(name, "upper"))	return isupper(c);
+  if (!strcmp(name, "lower"))	return islower(c);
+  if (!strcmp(name, "space"))	return isspace(c);
+  if (!strcmp(name, "blank"))	return (' ' == c) || ('\t' == c);
+  if (!strcmp(name, "punct"))	return ispunct(c);
+  if (!strcmp(name, "print"))	return isprint(c);
+  if (!strcmp(name, "graph"))	return isgraph(c);
+  if (!strcmp(name, "cntrl"))	return iscntrl(c);
+  if (!strcmp(name, "xdigit"))	return isxdigit(c);
+  if (!strcmp(name, "word"))	return isalnum(c) || ('_' == c);
+  return -1;
+}
+
+// Finish off a set, inverting it if need be.  The ends of lines are never in it.
+void reSetEnd(struct reParse *rp, int t, int invert)
+{
+  uint8_t *set = rp->re->sets[rp->re->tree[t].a];
+  int i;
+
+  if (invert)
+    for (i = 0; i < 32; i++)
+      set[i] = ~set[i];
+  set[0] &= ~1;
+  set['\n' >> 3] &= ~(1 << ('\n' & 7));
+}
+
+// \w \s \d, and their inverses, or -1 if it's not one of those.
+int reEscapeClass(struct reParse *rp, char c)
+{
+  char *name = NULL;
+  int t, i;
+
+  switch (tolower(c))
+  {
+    case 'w' :  name = "word";  break;
+    case 's' :  name = "space";  break;
+    case 'd' :  name = "digit";  break;
+    default :  return -1;
+  }
+  t = reSetNew(rp);
+  for (i = 1; i < 256; i++)
+    if (reClass(name, i))
+      reSetAdd(rp, t, i);
+  reSetEnd(rp, t, isupper(c));
+
+  return t;
+}
+
+// A bracket expression, rp->p is just after the [.
+int reBracket(struct reParse *rp)
+{
+  int t = reSetNew(rp), invert = 0, i;
+  unsigned char c, d;
+  char *start, *end;
+
+  if ('^' == *rp->p)
+  {
+    invert = 1;
+    rp->p++;
+  }
+  // A ] straight away is just a ].
+  for (start = rp->p; ']' != (c = *rp->p) || (rp->p == start); )
+  {
+    if (!c)
+    {
+      rp->why = "Unmatched [";
+      return t;
+    }
+    rp->p++;
+    if (('[' == c) && *rp->p && strchr(":=.", *rp->p) && (end = strchr(rp->p + 1, *rp->p)) && (']' == end[1]))
+    {
+      char *name = xstrndup(rp->p + 1, end - rp->p - 1);
+
+      if (':' == *rp->p)
+      {
+        if (0 > reClass(name, 'a'))
+          rp->why = "Invalid character class";
+        else
+          for (i = 1; i < 256; i++)
+            if (reClass(name, i))
+              reSetAdd(rp, t, i);
+      }
+      // Equivalence classes and collating elements, there's only the one byte of each here.
+      else
+        for (i = 0; name[i]; i++)
+          reSetAdd(rp, t, name[i]);
+      free(name);
+      rp->p = end + 2;
+      continue;
+    }
+    if (('-' == *rp->p) && rp->p[1] && (']' != rp->p[1]))
+    {
+      d = rp->p[1];
+      rp->p += 2;
+      if (d < c)
+        rp->why = "Invalid range end";
+      for (i = c; i <= d; i++)
+        reSetAdd(rp, t, i);
+    }
+    else
+      reSetAdd(rp, t, c);
+  }
+  rp->p++;
+  reSetEnd(rp, t, invert);
+
+  return t;
+}
+
+int reAlt(struct reParse *rp);
+
+// Check if rp->p is at the given operator, which is escaped in BREs and not in EREs.  Some only exist in one.
+int reIs(struct reParse *rp, char c, int ere, int bre)
+{
+  if (SEARCH_ERE == rp->syntax)
+    return ere && (c == rp->p[0]);
+  return bre && ('\\' == rp->p[0]) && (c == rp->p[1]);
+}
+
+void reSkip(struct reParse *rp)
+{
+  rp->p += (SEARCH_ERE == rp->syntax) ? 1 : 2;
+}
+
+// One thing to match.  first is 1 at the start of the expression, or of a group or alternative, the only place a BRE
+// ^ is an anchor, and 2 just after that ^.  BREs treat * as just a * at either.
+int reAtom(struct reParse *rp, int first)
+{
+  int t;
+  char c = *rp->p;
+
+  if (reIs(rp, '(', 1, 1))
+  {
+    reSkip(rp);
+    rp->depth++;
+    t = reAlt(rp);
+    rp->depth--;
+    if (!reIs(rp, ')', 1, 1))
+      rp->why = "Unmatched ( or \\(";
+    else
+      reSkip(rp);
+    return t;
+  }
+  if (reIs(rp, ')', 0, 1))
+    rp->why = "Unmatched ) or \\)";
+  rp->p++;
+  if (('^' == c) && ((1 == first) || (SEARCH_ERE == rp->syntax)))
+    return reTreeNew(rp, RE_BOL, 0, 0);
+  // In BREs, $ is only special at the end.
+  if (('$' == c) && ((SEARCH_ERE == rp->syntax) || !*rp->p || reIs(rp, ')', 0, 1) || reIs(rp, '|', 0, 1)))
+    return reTreeNew(rp, RE_EOL, 0, 0);
+  if ('.' == c)
+  {
+    t = reSetNew(rp);
+    reSetEnd(rp, t, 1);
+    return t;
+  }
+  if ('[' == c)
+    return reBracket(rp);
+  if ('\\' == c)
+  {
+    if (!(c = *rp->p++))
+    {
+      rp->why = "Trailing backslash";
+      return reTreeNew(rp, RE_EMPTY, 0, 0);
+    }
+    if (0 <= (t = reEscapeClass(rp, c)))
+      return t;
+    // Back references and word boundaries.
+    if (strchr("123456789<>bB", c))
+    {
+      rp->posix = 1;
+      return reTreeNew(rp, RE_EMPTY, 0, 0);
+    }
+    if ('t' == c)
+      c = '\t';
+  }
+  t = reSetNew(rp);
+  reSetAdd(rp, t, c);
+  reSetEnd(rp, t, 0);
+
+  return t;
+}
+
+// An atom, and any repeats of it.
+int reRepeat(struct reParse *rp, int first)
+{
+  int t, min, max;
+  char *end;
+
+  // A * at the start is just a *, but there's nothing for a count to count.
+  if ((first && ('*' == *rp->p)) || ((SEARCH_ERE == rp->syntax) && strchr("*+?", *rp->p) && *rp->p))
+  {
+    t = reSetNew(rp);
+    reSetAdd(rp, t, *rp->p++);
+    reSetEnd(rp, t, 0);
+  }
+  else if (first && reIs(rp, '{', 0, 1))
+  {
+    rp->why = "Invalid preceding regular expression";
+    return reTreeNew(rp, RE_EMPTY, 0, 0);
+  }
+  // A BRE's leading ^ can't be repeated, what comes after it is still at the start.
+  else if ((1 == first) && ('^' == *rp->p) && (SEARCH_ERE != rp->syntax))
+    return reAtom(rp, first);
+  else
+    t = reAtom(rp, first);
+  while (!rp->why)
+  {
+    if ('*' == *rp->p)
+    {
+      rp->p++;
+      min = 0;
+      max = -1;
+    }
+    else if (reIs(rp, '+', 1, 1))
+    {
+      reSkip(rp);
+      min = 1;
+      max = -1;
+    }
+    else if (reIs(rp, '?', 1, 1))
+    {
+      reSkip(rp);
+      min = 0;
+      max = 1;
+    }
+    // EREs treat a { that doesn't start a count as just a {, like GNU does.
+    else if (reIs(rp, '{', 1, 1) && ((SEARCH_ERE != rp->syntax) || isdigit(rp->p[1])))
+    {
+      reSkip(rp);
+      min = max = strtol(rp->p, &end, 10);
+      if ((end == rp->p) && (',' != *end))
+        rp->why = "Invalid interval";
+      if (',' == *end)
+      {
+        rp->p = ++end;
+        max = isdigit(*rp->p) ? strtol(rp->p, &end, 10) : -1;
+      }
+      rp->p = end;
+      if (!reIs(rp, '}', 1, 1) || (255 < min) || (255 < max) || ((0 <= max) && (max < min)))
+        rp->why = "Invalid interval";
+      else
+        reSkip(rp);
+    }
+    else
+      break;
+    t = reTreeNew(rp, RE_REPEAT, t, 0);
+    rp->re->tree[t].min = min;
+    rp->re->tree[t].max = max;
+  }
+
+  return t;
+}
+
+// A sequence of things to match, up to the end, a | or a ).
+int reCat(struct reParse *rp)
+{
+  int t = -1, u, first = 1, next;
+
+  while (*rp->p && !rp->why && !reIs(rp, '|', 1, 1) && !(rp->depth && reIs(rp, ')', 1, 1)))
+  {
+    next = ((1 == first) && ('^' == *rp->p)) ? 2 : 0;
+    u = reRepeat(rp, first);
+    first = next;
+    t = (0 > t) ? u : reTreeNew(rp, RE_CAT, t, u);
+  }
+
+  return (0 > t) ? reTreeNew(rp, RE_EMPTY, 0, 0) : t;
+}
+
+int reAlt(struct reParse *rp)
+{
+  int t = reCat(rp);
+
+  while (!rp->why && reIs(rp, '|', 1, 1))
+  {
+    reSkip(rp);
+    t = reTreeNew(rp, RE_ALT, t, reCat(rp));
+  }
+
+  return t;
+}
+
+uint32_t reNodeNew(struct regex *re, uint8_t type, uint32_t set, uint32_t out, uint32_t out1)
+{
+  struct reNode *node;
+
+  if (RE_NODES <= re->nodeCount)
+    return 0;
+  if (!(re->nodeCount % 256))
+    re->nodes = xrealloc(re->nodes, (re->nodeCount + 256) * sizeof(struct reNode));
+  node = &(re->nodes[re->nodeCount]);
+  node->type = type;
+  node->set = set;
+  node->out = out;
+  node->out1 = out1;
+
+  return re->nodeCount++;
+}
+
+// Turn tree t into NFA nodes that carry on to next.  Returns the first of them.
+uint32_t reCompile(struct regex *re, int t, uint32_t next)
+{
+  struct reTree *tree = &(re->tree[t]);
+  uint32_t e = next, n;
+  int i;
+
+  if (RE_NODES <= re->nodeCount)
+    return 0;
+  switch (tree->type)
+  {
+    case RE_SET :  return reNodeNew(re, RE_SET, tree->a, next, 0);
+    case RE_CAT :  return reCompile(re, tree->a, reCompile(re, tree->b, next));
+    case RE_BOL :
+    case RE_EOL :  return reNodeNew(re, tree->type, 0, next, 0);
+    case RE_ALT :
+      n = reCompile(re, tree->a, next);
+      return reNodeNew(re, RE_SPLIT, 0, n, reCompile(re, tree->b, next));
+    case RE_REPEAT :
+      if (0 > tree->max)
+      {
+        e = reNodeNew(re, RE_SPLIT, 0, 0, next);
+        n = reCompile(re, tree->a, e);
+        re->nodes[e].out = n;
+      }
+      else
+        for (i = tree->min; i < tree->max; i++)
+        {
+          n = reCompile(re, tree->a, e);
+          e = reNodeNew(re, RE_SPLIT, 0, n, next);
+        }
+      for (i = 0; i < tree->min; i++)
+        e = reCompile(re, tree->a, e);
+      return e;
+  }
+
+  return next;
+}
+
+// Add the literal bytes every match of tree t starts with to prefix.  Returns 0 once there's no more.
+int rePrefix(struct regex *re, int t, char *prefix, uint32_t *len, int fold)
+{
+  struct reTree *tree = &(re->tree[t]);
+  uint8_t *set;
+  int i, c = 0, count = 0;
+
+  switch (tree->type)
+  {
+    case RE_CAT :  return rePrefix(re, tree->a, prefix, len, fold) && rePrefix(re, tree->b, prefix, len, fold);
+    case RE_BOL :
+    case RE_EMPTY :  return 1;
+    case RE_REPEAT :
+      if (tree->min)
+        rePrefix(re, tree->a, prefix, len, fold);
+      return 0;
+    case RE_SET :
+      set = re->sets[tree->a];
+      for (i = 0; i < 256; i++)
+        if (set[i >> 3] & (1 << (i & 7)))
+        {
+          count++;
+          c = i;
+        }
+      // Just the one byte, or both cases of a letter when ignoring case.
+      if (fold && (2 == count) && (otherCase(c) != c) && (set[otherCase(c) >> 3] & (1 << (otherCase(c) & 7))))
+        count = 1;
+      if ((1 != count) || (RE_PREFIX <= *len))
+        return 0;
+      prefix[(*len)++] = fold ? FOLD(c) : c;
+      return 1;
+  }
+
+  return 0;
+}
+
+// Add node n, and the nodes it leads to without using up a byte, to list.  Returns how many are in list now.
+uint32_t reAdd(struct regex *re, uint32_t *list, uint32_t count, uint32_t n, int bol)
+{
+  uint32_t top = 0;
+
+  re->stack[top++] = n;
+  while (top)
+  {
+    n = re->stack[--top];
+    if (re->generation == re->mark[n])
+      continue;
+    re->mark[n] = re->generation;
+    switch (re->nodes[n].type)
+    {
+      case RE_SPLIT :
+        re->stack[top++] = re->nodes[n].out1;
+        re->stack[top++] = re->nodes[n].out;
+        break;
+      case RE_BOL :
+        if (bol)
+          re->stack[top++] = re->nodes[n].out;
+        break;
+      default :
+        list[count++] = n;
+        break;
+    }
+  }
+
+  return count;
+}
+
+// Start working out a new list of nodes.
+void reNewList(struct regex *re)
+{
+  if (!++re->generation)
+  {
+    memset(re->mark, 0, re->nodeCount * sizeof(uint32_t));
+    re->generation = 1;
+  }
+}
+
+// Where the nodes in list go to with byte c.  If it's not anchored, a match could start after c as well.
+uint32_t reStep(struct regex *re, uint32_t *list, uint32_t count, unsigned char c, int anchored, uint32_t *out)
+{
+  struct reNode *node;
+  uint32_t i, n = 0;
+
+  reNewList(re);
+  for (i = 0; i < count; i++)
+  {
+    node = &(re->nodes[list[i]]);
+    if ((RE_SET == node->type) && (re->sets[node->set][c >> 3] & (1 << (c & 7))))
+      n = reAdd(re, out, n, node->out, 0);
+  }
+  if (!anchored)
+    n = reAdd(re, out, n, re->start, 0);
+
+  return n;
+}
+
+int reMatches(struct regex *re, uint32_t *list, uint32_t count)
+{
+  while (count--)
+    if (RE_MATCH == re->nodes[list[count]].type)
+      return 1;
+  return 0;
+}
+
+// Check if there's a match if the line ends here.
+int reAtEol(struct regex *re, uint32_t *list, uint32_t count, int bol)
+{
+  uint32_t top = 0, n;
+
+  reNewList(re);
+  while (count--)
+    if (RE_EOL == re->nodes[list[count]].type)
+      re->stack[top++] = re->nodes[list[count]].out;
+  while (top)
+  {
+    n = re->stack[--top];
+    if (re->generation == re->mark[n])
+      continue;
+    re->mark[n] = re->generation;
+    switch (re->nodes[n].type)
+    {
+      case RE_MATCH :  return 1;
+      case RE_SPLIT :
+        re->stack[top++] = re->nodes[n].out1;
+        // Falls through.
+      case RE_EOL :
+        re->stack[top++] = re->nodes[n].out;
+        break;
+      case RE_BOL :
+        if (bol)
+          re->stack[top++] = re->nodes[n].out;
+        break;
+    }
+  }
+
+  return 0;
+}
+
+int reCompare(const void *a, const void *b)
+{
+  return (*(uint32_t *) a > *(uint32_t *) b) - (*(uint32_t *) a < *(uint32_t *) b);
+}
+
+// Throw away all the DFA states.
+void dfaFlush(struct dfa *dfa)
+{
+  uint32_t i;
+
+  for (i = 1; i <= dfa->count; i++)
+    free(dfa->states[i].nodes);
+  if (dfa->table)
+    memset(dfa->table, 0, 2 * RE_STATES * sizeof(uint32_t));
+  dfa->count = 0;
+}
+
+// Find the state for a list of nodes, making it if it's new.  Returns it's number, negative if it's a match, or
+// RE_UNKNOWN if there's no room for it.
+int32_t dfaAdd(struct regex *re, struct dfa *dfa, uint32_t *list, uint32_t count, int bol)
+{
+  struct dfaState *state;
+  uint32_t hash = bol, i, h;
+
+  qsort(list, count, sizeof(uint32_t), reCompare);
+  for (i = 0; i < count; i++)
+    hash = hash * 31 + list[i];
+  for (h = hash; (i = dfa->table[h % (2 * RE_STATES)]); h++)
+  {
+    state = &(dfa->states[i]);
+    if ((state->hash == hash) && (state->count == count) && (state->bol == bol)
+      && !memcmp(state->nodes, list, count * sizeof(uint32_t)))
+      return state->match ? -(int32_t) i : (int32_t) i;
+  }
+  if (RE_STATES <= dfa->count)
+    return RE_UNKNOWN;
+
+  if (!(dfa->count % 64))
+  {
+    dfa->states = xrealloc(dfa->states, (dfa->count + 65) * sizeof(struct dfaState));
+    dfa->next = xrealloc(dfa->next, (dfa->count + 65) * 256 * sizeof(int32_t));
+  }
+  i = ++dfa->count;
+  dfa->table[h % (2 * RE_STATES)] = i;
+  memset(&(dfa->next[i * 256]), 0, 256 * sizeof(int32_t));
+  state = &(dfa->states[i]);
+  state->nodes = xmalloc(count * sizeof(uint32_t) + 1);
+  memcpy(state->nodes, list, count * sizeof(uint32_t));
+  state->count = count;
+  state->hash = hash;
+  state->bol = bol;
+  state->match = reMatches(re, list, count);
+  state->eol = reAtEol(re, list, count, bol);
+
+  return state->match ? -(int32_t) i : (int32_t) i;
+}
+
+// Make the start states, for the middle of a line, and the start of one.
+void dfaStart(struct regex *re, struct dfa *dfa)
+{
+  int bol;
+
+  if (!dfa->table)
+    dfa->table = xzalloc(2 * RE_STATES * sizeof(uint32_t));
+  for (bol = 0; bol < 2; bol++)
+  {
+    reNewList(re);
+    dfa->start[bol] = abs(dfaAdd(re, dfa, re->list2, reAdd(re, re->list2, 0, re->start, bol), bol));
+  }
+}
+
+// Work out where state s goes with byte c.  Returns RE_UNKNOWN if it's had to throw away states to many times.
+int32_t dfaNext(struct regex *re, struct dfa *dfa, int32_t s, unsigned char c)
+{
+  struct dfaState *state = &(dfa->states[s]);
+  uint32_t count;
+  int32_t t;
+
+  if (RE_FLUSHES < dfa->flushes)
+    return RE_UNKNOWN;
+  if (!c || ('\n' == c))
+  {
+    if (state->eol)
+      t = RE_EOLMATCH;
+    else if (dfa->anchored)
+      t = RE_DEAD;
+    else
+      t = dfa->states[dfa->start[1]].match ? -dfa->start[1] : dfa->start[1];
+    return dfa->next[s * 256 + c] = t;
+  }
+  if (!(count = reStep(re, state->nodes, state->count, c, dfa->anchored, re->list)))
+    return dfa->next[s * 256 + c] = RE_DEAD;
+  if (RE_UNKNOWN != (t = dfaAdd(re, dfa, re->list, count, 0)))
+    return dfa->next[s * 256 + c] = t;
+
+  // Full up, start again, or give up if that keeps happening for not many bytes.
+  if (dfa->scanned > 10 * RE_STATES)
+    dfa->flushes = 0;
+  else if (RE_FLUSHES < ++dfa->flushes)
+    return RE_UNKNOWN;
+  dfa->scanned = 0;
+  dfaFlush(dfa);
+  dfaStart(re, dfa);
+  return dfaAdd(re, dfa, re->list, count, 0);
+}
+
+int isSep(char c)
+{
+  return !c || ('\n' == c);
+}
+
+// Find the next of count bytes in text, from i, there can be up to sixteen of them.  Returns len if there's none of them.
+size_t skipTo(char *text, size_t i, size_t len, uint8_t *bytes, int count)
+{
+  int j;
+
+#ifdef __SSE2__
+  {
+    __m128i b[16], a, m;
+    unsigned mask;
+
+    for (j = 0; j < count; j++)
+      b[j] = _mm_set1_epi8(bytes[j]);
+    for (; i + 16 <= len; i += 16)
+    {
+      a = _mm_loadu_si128((__m128i *) (text + i));
+      m = _mm_cmpeq_epi8(a, b[0]);
+      for (j = 1; j < count; j++)
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(a, b[j]));
+      if ((mask = _mm_movemask_epi8(m)))
+        return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < len; i++)
+    for (j = 0; j < count; j++)
+      if ((uint8_t) text[i] == bytes[j])
+        return i;
+
+  return len;
+}
+
+// Run the NFA, for when the DFA has to many states.  Returns the same as dfaRun().
+ssize_t nfaRun(struct regex *re, int anchored, int longest, char *text, size_t len, size_t p)
+{
+  uint32_t *list = re->list, *other = re->list2, *swap, count;
+  ssize_t last = -1;
+  int bol = !p || isSep(text[p - 1]);
+
+  reNewList(re);
+  count = reAdd(re, list, 0, re->start, bol);
+  while (1)
+  {
+    if (reMatches(re, list, count))
+    {
+      if (!longest)
+        return p;
+      last = p;
+    }
+    if ((p == len) || isSep(text[p]))
+    {
+      if (reAtEol(re, list, count, bol))
+        return p;
+      if (anchored || (p == len))
+        return last;
+      reNewList(re);
+      count = reAdd(re, list, 0, re->start, bol = 1);
+    }
+    else
+    {
+      count = reStep(re, list, count, text[p], anchored, other);
+      swap = list;
+      list = other;
+      other = swap;
+      bol = 0;
+      if (anchored && !count)
+        return last;
+    }
+    p++;
+  }
+}
+
+// Run the DFA from byte p of text.  If it's anchored, returns where the longest match that starts at p ends, or the
+// shortest if that's all that's wanted, otherwise where the first match to end does.  Returns -1 if there's none.
+ssize_t dfaRun(struct regex *re, struct dfa *dfa, int longest, char *text, size_t len, size_t p)
+{
+  ssize_t last = -1;
+  size_t i = p, mark = p;
+  int32_t s, t;
+
+  if (!dfa->count)
+    dfaStart(re, dfa);
+  s = dfa->start[!p || isSep(text[p - 1])];
+  if (dfa->states[s].match)
+  {
+    if (!longest)
+      return p;
+    last = p;
+  }
+  while (i < len)
+  {
+    // Don't bother with the bytes that just stay in the start state.
+    if ((s == dfa->start[0]) && dfa->skips && (len == (i = skipTo(text, i, len, dfa->skip, dfa->skips))))
+      break;
+    // Most of the time it's just this.
+    if (0 < (t = dfa->next[s * 256 + (unsigned char) text[i]]))
+    {
+      s = t;
+      i++;
+      continue;
+    }
+    if (RE_UNKNOWN == t)
+    {
+      dfa->scanned += i - mark;
+      mark = i;
+      if (RE_UNKNOWN == (t = dfaNext(re, dfa, s, text[i])))
+        return nfaRun(re, dfa->anchored, longest, text, len, p);
+    }
+    if (0 < t)
+      s = t;
+    else if (RE_EOLMATCH == t)
+      return i;
+    else if (RE_DEAD == t)
+    {
+      if (dfa->anchored)
+        return last;
+      // Nothing more can match on this line, try the next.
+      if (len == (i = skipTo(text, i, len, (uint8_t *) "\0\n", 2)))
+        return -1;
+      s = dfa->start[1];
+      if (dfa->states[s].match)
+        return i + 1;
+    }
+    else
+    {
+      s = -t;
+      if (!longest)
+        return i + 1;
+      last = i + 1;
+    }
+    i++;
+  }
+
+  return dfa->states[s].eol ? (ssize_t) len : last;
+}
+
+// Find a match with regexec(), one line at a time, for those that the DFA can't do.
+char *posixFind(struct search *search, char *text, size_t len, size_t lo, size_t hi, size_t *end)
+{
+  static char *copy;
+  static size_t copySize;
+  regmatch_t match;
+  char *found = NULL;
+  size_t ls, le, o;
+
+  // Lines that have any of lo to hi in them.
+  for (ls = lo; ls && !isSep(text[ls - 1]); ls--)
+    ;
+  for (; ls < hi; ls = le + 1)
+  {
+    for (le = ls; (le < len) && !isSep(text[le]); le++)
+      ;
+    if (copySize <= le - ls)
+      copy = xrealloc(copy, copySize = le - ls + 1);
+    memcpy(copy, text + ls, le - ls);
+    copy[le - ls] = '\0';
+    for (o = 0; (o <= le - ls) && (ls + o < hi); o = match.rm_so + 1)
+    {
+      if (regexec(search->regex->posix, copy + o, 1, &match, o ? REG_NOTBOL : 0))
+        break;
+      match.rm_so += o;
+      match.rm_eo += o;
+      if (ls + match.rm_so >= hi)
+        break;
+      if (ls + match.rm_so < lo)
+        continue;
+      found = text + ls + match.rm_so;
+      if (end)
+        *end = ls + match.rm_eo;
+      if (!search->back)
+        return found;
+    }
+    if (le == len)
+      break;
+  }
+
+  return found;
+}
+
+// Find the first match that starts from byte lo up to hi of len bytes of text, or the last when searching backwards.
+// Returns NULL if there's none, otherwise where it starts, and where it ends goes in end, if that's not NULL.  Matches
+// can be empty, so hi can be len + 1, to find them at the end.
+char *findText(struct search *search, char *text, size_t len, size_t lo, size_t hi, size_t *end)
+{
+  struct regex *re = search->regex;
+  char *found = NULL, *f;
+  ssize_t e = -1;
+  size_t fe = 0, p;
+
+  if (hi > len + 1)
+    hi = len + 1;
+  if (lo >= hi)
+    return NULL;
+  if (!re)
+  {
+    p = (len < hi + search->len - 1) ? len : hi + search->len - 1;
+    if ((found = findBytes(search, text + lo, p - lo)) && end)
+      *end = found - text + search->len;
+    return found;
+  }
+  if (re->posix)
+    return posixFind(search, text, len, lo, hi, end);
+
+  // Every match starts with the same bytes, so only check where those are.
+  if (search->len)
+  {
+    while ((lo < hi) && (found = findBytes(search, text + lo, ((len < hi + search->len - 1) ? len : hi + search->len - 1) - lo)))
+    {
+      p = found - text;
+      if (0 <= (e = dfaRun(re, &(re->anchored), !!end, text, len, p)))
+        break;
+      if (search->back)
+        hi = p;
+      else
+        lo = p + 1;
+      found = NULL;
+    }
+    if (found && end)
+      *end = e;
+    return found;
+  }
+
+  // Going backwards, find them all going forwards, and keep the last.
+  if (search->back)
+  {
+    search->back = 0;
+    while ((f = findText(search, text, len, lo, hi, end ? &fe : NULL)))
+    {
+      found = f;
+      lo = f - text + 1;
+    }
+    search->back = 1;
+    if (found && end)
+      *end = fe;
+    return found;
+  }
+
+  // The first match to end, the one that starts first is on the same line, at or before where that starts.
+  if (0 > (e = dfaRun(re, &(re->scan), 0, text, len, lo)))
+    return NULL;
+  for (p = e; (p > lo) && !isSep(text[p - 1]); p--)
+    ;
+  for (; (p <= (size_t) e) && (p < hi); p++)
+    if (0 <= (e = dfaRun(re, &(re->anchored), !!end, text, len, p)))
+    {
+      if (end)
+        *end = e;
+      return text + p;
+    }
+
+  return NULL;
+}
+
+// Work out which bytes can start a match in the middle of a line, the rest can be skipped over.
+void reStartBytes(struct regex *re)
+{
+  struct dfa *dfa = &(re->scan);
+  uint8_t set[32] = {1};
+  uint32_t count, i;
+  int c;
+
+  // The ends of lines always leave it.
+  set['\n' >> 3] |= 1 << ('\n' & 7);
+  reNewList(re);
+  count = reAdd(re, re->list, 0, re->start, 0);
+  for (i = 0; i < count; i++)
+    if (RE_SET == re->nodes[re->list[i]].type)
+      for (c = 0; c < 32; c++)
+        set[c] |= re->sets[re->nodes[re->list[i]].set][c];
+  for (c = 0; c < 256; c++)
+    if (set[c >> 3] & (1 << (c & 7)))
+    {
+      if (sizeof(dfa->skip) <= dfa->skips)
+      {
+        dfa->skips = 0;
+        break;
+      }
+      dfa->skip[dfa->skips++] = c;
+    }
+}
+
+void freeRegex(struct regex *re)
+{
+  if (!re)
+    return;
+  dfaFlush(&(re->scan));
+  dfaFlush(&(re->anchored));
+  free(re->scan.states);
+  free(re->scan.next);
+  free(re->scan.table);
+  free(re->anchored.states);
+  free(re->anchored.next);
+  free(re->anchored.table);
+  if (!re->clone)
+  {
+    if (re->posix)
+    {
+      regfree(re->posix);
+      free(re->posix);
+    }
+    free(re->sets);
+    free(re->nodes);
+  }
+  free(re->tree);
+  free(re->mark);
+  free(re->stack);
+  free(re->list);
+  free(re->list2);
+  free(re);
+}
+
+// A copy for another thread to use.  It shares the NFA, which doesn't change, but has it's own DFA states.
+struct regex *regexClone(struct regex *re)
+{
+  struct regex *copy = xmalloc(sizeof(struct regex));
+
+  *copy = *re;
+  copy->clone = 1;
+  memset(&(copy->scan), 0, sizeof(struct dfa));
+  memset(&(copy->anchored), 0, sizeof(struct dfa));
+  memcpy(copy->scan.skip, re->scan.skip, sizeof(re->scan.skip));
+  copy->scan.skips = re->scan.skips;
+  copy->anchored.anchored = 1;
+  copy->generation = 0;
+  if (!re->posix)
+  {
+    copy->mark = xzalloc(re->nodeCount * sizeof(uint32_t));
+    copy->stack = xmalloc((2 * re->nodeCount + 2) * sizeof(uint32_t));
+    copy->list = xmalloc(re->nodeCount * sizeof(uint32_t));
+    copy->list2 = xmalloc(re->nodeCount * sizeof(uint32_t));
+  }
+
+  return copy;
+}
+
+// Compile a BRE or ERE.  The literal bytes every match starts with go in prefix.  Returns NULL, with why set to what's
+// wrong, if it's no good.
+struct regex *regexCompile(char *pattern, int syntax, int fold, char *prefix, uint32_t *len, char **why)
+{
+  struct regex *re = xzalloc(sizeof(struct regex));
+  struct reParse rp = {re, pattern, NULL, syntax, fold, 0, 0};
+  int t = reAlt(&rp);
+
+  if (!rp.why && *rp.p)
+    rp.why = "Unmatched ) or \\)";
+  if (!rp.why && rp.posix)
+  {
+    re->posix = xmalloc(sizeof(regex_t));
+    if (regcomp(re->posix, pattern, ((SEARCH_ERE == syntax) ? REG_EXTENDED : 0) | (fold ? REG_ICASE : 0)))
+    {
+      free(re->posix);
+      re->posix = NULL;
+      rp.why = "Invalid back reference";
+    }
+  }
+  if (!rp.why && !rp.posix)
+  {
+    re->start = reCompile(re, t, reNodeNew(re, RE_MATCH, 0, 0, 0));
+    if (RE_NODES <= re->nodeCount)
+      rp.why = "Regular expression too big";
+    else
+    {
+      rePrefix(re, t, prefix, len, fold);
+      re->mark = xzalloc(re->nodeCount * sizeof(uint32_t));
+      re->stack = xmalloc((2 * re->nodeCount + 2) * sizeof(uint32_t));
+      re->list = xmalloc(re->nodeCount * sizeof(uint32_t));
+      re->list2 = xmalloc(re->nodeCount * sizeof(uint32_t));
+      re->anchored.anchored = 1;
+      reStartBytes(re);
+    }
+  }
+  free(re->tree);
+  re->tree = NULL;
+  if ((*why = rp.why))
+  {
+    freeRegex(re);
+    return NULL;
+  }
+
+  return re;
+}
+
+// Check if text points into a block's data.
+int inBlock(struct block *block, char *text)
+{
+  return block->data && (text >= block->data) && (text <= block->data + block->size);
+}
+
+// A lot of evicted blocks to search is mostly waiting for the disk, so threads search those, while the main loop
+// carries on.  Searching what's in memory notes which evicted blocks it passed over, in the order it came to them,
+// then the threads take them in that order.  The first one with a match wins, so those after it don't need searching,
+// and if none of them match, it's whatever was found in memory.  The threads poke the main loop as they go.
+
+#define SEARCH_THREADS  64
+#define SEARCH_INLINE   (4 * BLOCK_SIZE)	// Less than this much to read is just searched straight away.
+#define SEARCH_SLICE    (16 * BLOCK_SIZE)	// How much an incremental search looks at between key presses.
+
+struct searchUnit
+{
+  off_t offset, size;	// Where it is in the file.
+  uint32_t y, k, x;	// The line number of it's first line, then which line of it has the match, and where.
+  int wrapped;		// It comes after the search wrapped around.
+  int state;		// 0 until it's searched, then 1 if there's no match, 2 if there is.
+};
+
+struct searchJob
+{
+  view *view;
+  struct search *search;	// The threads each make their own copy of this.
+  struct searchUnit *units;
+  uint32_t count, next, best;	// How many units, the next one to search, and the first one with a match so far.
+  uint32_t checked;		// Those before this are known to have no match.
+  int fd, wake[2], cancel;
+  pthread_t *threads;
+  int threadCount;
+  int found;			// What was found in memory.
+  uint32_t y, x;
+  size_t undoLength, undoAt;	// If these change, the text did, and what's found might not be there any more.
+  // Incremental searches walk what's in memory a bit at a time to, so typing isn't held up.  The walk stops once it
+  // has looked at budget bytes, and line, ly, lines, and wrapped are where it got to.  start, sy, and sx are where
+  // it started from.
+  int walking, wrapped;
+  size_t budget;
+  struct line *start, *line;
+  uint32_t sy, sx, ly, lines;
+};
+
+static struct searchJob *searching;
+
+void searchAddUnit(struct searchJob *job, struct block *block, uint32_t y, int wrapped);
+
+// Search content from byte x of line, which is line number y, to the end, or the start when going backwards, then
+// wrap around to where it started.  Returns 0 if there's no match, otherwise 1, or 2 if it had to wrap around, and
+// moves line, y, and x to the match.  A match at x is only found once it's wrapped around to it.  If there's a job,
+// evicted blocks are left for it, in the order they where come to, rather than searched.  If it has a budget as well,
+// returns -1 when that runs out, and the job remembers where to carry on from next time.
+int searchContent(struct content *content, struct search *search, struct line **at, uint32_t *y, uint32_t *x,
+  struct searchJob *job)
+{
+  struct line *start = *at, *line = start, *unit = start;
+  struct block *block;
+  char *text = start->line, *found, *c, *nl;
+  size_t len = strlen(text), hi;
+  uint32_t ly = *y, lines = 1, k = 0;
+  int back = search->back, wrapped = 0, sep = '\0';
+
+  // The rest of the line it starts on, unless it's carrying on from where it got to last time.
+  if (job && job->line)
+  {
+    line = job->line;
+    ly = job->ly;
+    lines = job->lines;
+    wrapped = job->wrapped;
+    found = NULL;
+  }
+  else if (back)
+    found = findText(search, text, len, 0, *x, NULL);
+  else
+    found = findText(search, text, len, *x + 1, len + 1, NULL);
+
+  // Then the next piece of text, which might be a line, or a whole block of them.  ly is the line number of it's first
+  // line, lines how many it has, unit the line it starts at, and line the one to go on from.
+  while (!found)
+  {
+    if (back)
+      line = line->prev;
+    else
+    {
+      line = line->next;
+      ly += lines;
+    }
+    if (&(content->lines) == line)
+    {
+      wrapped = 1;
+      line = back ? line->prev : line->next;
+      ly = back ? content->lines.length : 0;
+    }
+    unit = line;
+    lines = 1;
+    sep = '\0';
+
+    if (line == start)
+    {
+      // Back around to where it started, what's left of that line.
+      text = start->line;
+      len = strlen(text);
+      if (back)
+        found = findText(search, text, len, *x, len + 1, NULL);
+      else
+        found = findText(search, text, len, 0, *x + 1, NULL);
+      ly = *y;
+      break;
+    }
+    else if (isStub(content, line))
+    {
+      ssize_t got = 0;
+
+      block = &(content->blocks[line->block]);
+      lines = line->length;
+      if (job)
+      {
+        if (back)
+          ly -= lines;
+        searchAddUnit(job, block, ly, wrapped);
+        continue;
+      }
+      if (pageFile(content))
+      {
+        if (searchSize < block->size)
+          searchData = xrealloc(searchData, searchSize = block->size);
+        if (0 > (got = pread(content->page, searchData, block->size, block->offset)))
+          got = 0;
+      }
+      text = searchData;
+      len = got;
+      sep = '\n';
+    }
+    else if (line->block && (line->block <= content->blockCount)
+      && !((block = &(content->blocks[line->block]))->flags & BLOCK_DIRTY)
+      && (back ? (blockEnd(content, line->block) == line->next) : (block->first == line))
+      && inBlock(block, line->line) && !inBlock(block, start->line))
+    {
+      // A whole block that has not changed, and doesn't have the line it started on.
+      lines = block->lines;
+      text = block->data;
+      len = block->size;
+      unit = block->first;
+      line = back ? block->first : blockEnd(content, line->block)->prev;
+    }
+    else
+    {
+      text = line->line;
+      len = strlen(text);
+    }
+    if (back)
+      ly -= lines;
+    // Nothing can start after the last line ends.
+    hi = (len && isSep(text[len - 1])) ? len : len + 1;
+    found = findText(search, text, len, 0, hi, NULL);
+    if (!found && job && job->budget)
+    {
+      if (job->budget > len)
+        job->budget -= len;
+      else
+      {
+        job->budget = 0;
+        job->line = line;
+        job->ly = ly;
+        job->lines = lines;
+        job->wrapped = wrapped;
+        return -1;
+      }
+    }
+  }
+  if (!found)
+    return 0;
+
+  // Find which line of the piece of text it's in.
+  for (c = text; (nl = memchr(c, sep, found - c)); c = nl + 1)
+    k++;
+  if (isStub(content, unit))
+    unit = pageIn(content, unit);
+  else
+    lruTouch(content, unit->block);
+  *y = ly + k;
+  while (k-- && (&(content->lines) != unit->next))
+    unit = unit->next;
+  *at = unit;
+  *x = found - c;
+
+  return 1 + wrapped;
+}
+
+void freeSearch(struct search *search)
+{
+  freeRegex(search->regex);
+  free(search->text);
+  free(search->pattern);
+  free(search);
+}
+
+// A copy of a search, for another thread to use.
+struct search *searchClone(struct search *search)
+{
+  struct search *copy = xmalloc(sizeof(struct search));
+
+  *copy = *search;
+  copy->next = NULL;
+  copy->text = xstrdup(search->text);
+  copy->pattern = xstrndup(search->pattern, search->len);
+  if (search->regex)
+    copy->regex = regexClone(search->regex);
+
+  return copy;
+}
+
+void searchAddUnit(struct searchJob *job, struct block *block, uint32_t y, int wrapped)
+{
+  struct searchUnit *unit;
+
+  if (!(job->count % 256))
+    job->units = xrealloc(job->units, (job->count + 256) * sizeof(struct searchUnit));
+  unit = &(job->units[job->count++]);
+  memset(unit, 0, sizeof(struct searchUnit));
+  unit->offset = block->offset;
+  unit->size = block->size;
+  unit->y = y;
+  unit->wrapped = wrapped;
+}
+
+// Read one of the evicted blocks into buf, and search it.
+void searchUnit(struct searchJob *job, struct search *search, uint32_t i, char **buf, size_t *size)
+{
+  struct searchUnit *unit = &(job->units[i]);
+  char *found = NULL, *c, *nl;
+  ssize_t got;
+
+  if (*size < unit->size)
+    *buf = xrealloc(*buf, *size = unit->size);
+  do
+    got = pread(job->fd, *buf, unit->size, unit->offset);
+  while ((0 > got) && (EINTR == errno));
+  if ((0 < got) && (found = findText(search, *buf, got, 0, isSep((*buf)[got - 1]) ? got : got + 1, NULL)))
+  {
+    for (c = *buf; (nl = memchr(c, '\n', found - c)); c = nl + 1)
+      unit->k++;
+    unit->x = found - c;
+  }
+  __atomic_store_n(&(unit->state), found ? 2 : 1, __ATOMIC_RELEASE);
+}
+
+void *searchThread(void *data)
+{
+  struct searchJob *job = data;
+  struct search *search = searchClone(job->search);
+  char *buf = NULL;
+  size_t size = 0;
+  uint32_t i, best;
+
+  // They are handed out in order, so once one is after the first match, the rest are to.
+  while (!__atomic_load_n(&(job->cancel), __ATOMIC_RELAXED)
+    && ((i = __atomic_fetch_add(&(job->next), 1, __ATOMIC_RELAXED)) < job->count)
+    && (i < __atomic_load_n(&(job->best), __ATOMIC_RELAXED)))
+  {
+    searchUnit(job, search, i, &buf, &size);
+    if (2 == job->units[i].state)
+    {
+      best = __atomic_load_n(&(job->best), __ATOMIC_RELAXED);
+      while ((i < best) && !__atomic_compare_exchange_n(&(job->best), &best, i, 0, __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED))
+        ;
+    }
+    writeall(job->wake[1], "", 1);
+  }
+  free(buf);
+  freeSearch(search);
+  writeall(job->wake[1], "", 1);
+  return NULL;
+}
+
+// Stop searching in the background, if it's for view, or for any view if that's NULL.  Returns 1 if it was.
+int searchStop(view *view)
+{
+  struct searchJob *job = searching;
+  int i;
+
+  if (!job || (view && (view != job->view)))
+    return 0;
+  if (job->walking)
+    delWatcher(-1, job);
+  else
+  {
+    __atomic_store_n(&(job->cancel), 1, __ATOMIC_RELAXED);
+    for (i = 0; i < job->threadCount; i++)
+      pthread_join(job->threads[i], NULL);
+    delWatcher(job->wake[0], job);
+    close(job->wake[0]);
+    close(job->wake[1]);
+    close(job->fd);
+  }
+  freeSearch(job->search);
+  free(job->threads);
+  free(job->units);
+  free(job);
+  searching = NULL;
+
+  return 1;
+}
+
+void searchCancel(view *view)
+{
+  if (searchStop(NULL))
+  {
+    free(view->statusLine);
+    view->statusLine = xstrdup("Search cancelled");
+  }
+}
+
+// Which unit has the first match, count if none of them do, or -1 if that's not known yet.
+long searchDecide(struct searchJob *job)
+{
+  for (; job->checked < job->count; job->checked++)
+    switch (__atomic_load_n(&(job->units[job->checked].state), __ATOMIC_ACQUIRE))
+    {
+      case 0 :  return -1;
+      case 2 :  return job->checked;
+    }
+
+  return job->count;
+}
+
+// Take any \c out of a pattern, it means ignore case.  Returns 1 if there was one.  Escapes are skipped over whole, so
+// the c in \\c is just a c after a backslash.
+int patternFold(char *pattern)
+{
+  char *from = pattern, *to = pattern;
+  int fold = 0;
+
+  while (*from)
+  {
+    if (('\\' == from[0]) && ('c' == from[1]))
+    {
+      from += 2;
+      fold = 1;
+      continue;
+    }
+    if (('\\' == from[0]) && from[1])
+      *to++ = *from++;
+    *to++ = *from++;
+  }
+  *to = '\0';
+
+  return fold;
+}
+
+// Find what to search for in the ones the context remembers, or make it.  With -i, or \c in it, case is ignored.
+// Returns NULL, and says why, if it's a regular expression that's no good.
+struct search *searchCompile(view *view, char *text, uint8_t syntax)
+{
+  struct context *context = view->content->context;
+  struct search **s, *search, *last = context->searches;
+  char prefix[RE_PREFIX], *c, *why = NULL;
+  int count = 0;
+
+  // A search that's still going might be using one that's about to be forgotten.
+  searchStop(NULL);
+  for (s = &(context->searches); (search = *s); s = &(search->next))
+    if ((search->syntax == syntax) && !strcmp(search->text, text))
+    {
+      *s = search->next;
+      break;
+    }
+
+  if (!search)
+  {
+    search = xzalloc(sizeof(struct search));
+    search->text = xstrdup(text);
+    search->pattern = xstrdup(text);
+    search->syntax = syntax;
+    search->fold = patternFold(search->pattern) || (toys.optflags & FLAG_i);
+    if (SEARCH_LITERAL != syntax)
+    {
+      if (!(search->regex = regexCompile(search->pattern, syntax, search->fold, prefix, &(search->len), &why)))
+      {
+        free(view->statusLine);
+        view->statusLine = xmprintf("Bad regular expression - %s", why);
+        freeSearch(search);
+        return NULL;
+      }
+      free(search->pattern);
+      search->pattern = xstrndup(prefix, search->len);
+    }
+    else
+    {
+      search->len = strlen(search->pattern);
+      if (search->fold)
+        for (c = search->pattern; *c; c++)
+          *c = FOLD(*c);
+    }
+  }
+
+  // What gets highlighted is the last one used, and a new search turns that back on.
+  if ((last != search) || !highlighting)
+    searchGeneration++;
+  highlighting = 1;
+
+  // The last one used goes first, and the oldest get forgotten.
+  search->next = context->searches;
+  context->searches = search;
+  for (s = &(context->searches); *s; s = &((*s)->next))
+    if (SEARCH_CACHE <= count++)
+    {
+      while ((search = *s))
+      {
+        *s = search->next;
+        freeSearch(search);
+      }
+      break;
+    }
+
+  return context->searches;
+}
+
+// Find where the last search matches in a line that's about to be drawn, or remember where it did last time.
+// Returns NULL if there's nothing to highlight.
+struct highlight *highlightLine(view *view, char *text)
+{
+  struct content *content = view->content;
+  struct search *search = content->context->searches;
+  struct highlight *h;
+  size_t len, lo = 0, end;
+  char *found;
+  int back;
+
+  if (!highlighting || !search || (commandLine == view) || !*text)
+    return NULL;
+  if (!view->highlights)
+    view->highlights = xzalloc(sizeof(struct highlight) << HIGHLIGHT_BITS);
+  // None of them are any good for a different search.
+  if (view->highlighted != searchGeneration)
+  {
+    for (h = view->highlights; h < &(view->highlights[1 << HIGHLIGHT_BITS]); h++)
+      h->text = NULL;
+    view->highlighted = searchGeneration;
+  }
+
+  h = &(view->highlights[(((uint64_t) (uintptr_t) text) * 0x9E3779B97F4A7C15ULL) >> (64 - HIGHLIGHT_BITS)]);
+  if ((h->text == text) && (h->generation == content->generation))
+    return h->count ? h : NULL;
+  h->text = text;
+  h->generation = content->generation;
+  h->count = 0;
+  len = strlen(text);
+  back = search->back;
+  search->back = 0;
+  while ((lo < len) && (found = findText(search, text, len, lo, len, &end)))
+  {
+    lo = found - text;
+    // Empty matches don't show.
+    if (end > lo)
+    {
+      if (!(h->count % 16))
+        h->matches = xrealloc(h->matches, (h->count + 16) * 2 * sizeof(uint32_t));
+      h->matches[h->count * 2] = lo;
+      h->matches[h->count++ * 2 + 1] = end;
+      lo = end;
+    }
+    else
+      lo++;
+  }
+  search->back = back;
+
+  return h->count ? h : NULL;
+}
+
+void highlightToggle(view *view)
+{
+  highlighting = !highlighting;
+  searchGeneration++;
+  drawBox(view->box);
+}
+
+// Like vi's :nohlsearch, off until the next search.
+void highlightOff(view *view)
+{
+  if (highlighting)
+    highlightToggle(view);
+}
+
+// Say what was found, and move the cursor there.  If line is NULL, it's found from y.
+void searchShow(view *view, struct search *search, int found, struct line *line, uint32_t y, uint32_t x)
+{
+  free(view->statusLine);
+  view->statusLine = NULL;
+  if (!found)
+    view->statusLine = xmprintf("Not found - %s", search->text);
+  else
+  {
+    if (2 == found)
+      view->statusLine = xstrdup(search->back ? "Search wrapped to the end" : "Search wrapped to the start");
+    // Lines that are filtered out can't be shown, so the nearest one that is instead.
+    if (view->filter)
+    {
+      struct filter *filter = view->filter;
+      long row = filterRow(filter, y, search->back);
+
+      if (filter->count && (filter->rows[row] != y))
+      {
+        y = filter->rows[row];
+        x = 0;
+      }
+    }
+    else if (line)
+    {
+      view->line = line;
+      view->cY = y;
+    }
+    undoCursor(view, y, x);
+  }
+  // If it didn't scroll, what's highlighted on the screen still changed.
+  if (highlighting && (view->highlighted != searchGeneration) && view->box)
+    drawBox(view->box);
+  isearchFound(view, found);
+}
+
+// The search threads poke the main loop as they go.  Once it's known which match is first, show it.
+void searchProgress(struct watcher *watcher)
+{
+  struct searchJob *job = watcher->data;
+  struct content *content = job->view->content;
+  struct searchUnit *unit;
+  uint32_t checked = job->checked;
+  long i;
+
+  while (0 < read(job->wake[0], toybuf, sizeof(toybuf)))
+    ;
+  if (0 > (i = searchDecide(job)))
+  {
+    // Only bother updating the status line when the percentage changes.
+    if ((checked * 100) / job->count != (job->checked * 100) / job->count)
+    {
+      free(job->view->statusLine);
+      job->view->statusLine = xmprintf("Searching %d%%", (int) ((job->checked * 100) / job->count));
+      updateLine(currentBox->view);
+    }
+    return;
+  }
+
+  if ((content->undo.length != job->undoLength) || (content->undo.at != job->undoAt))
+  {
+    free(job->view->statusLine);
+    job->view->statusLine = xstrdup("Search abandoned, the text changed");
+  }
+  else if (i < job->count)
+  {
+    unit = &(job->units[i]);
+    searchShow(job->view, job->search, 1 + unit->wrapped, NULL, unit->y + unit->k, unit->x);
+  }
+  else
+    searchShow(job->view, job->search, job->found, NULL, job->y, job->x);
+  searchStop(NULL);
+  updateLine(currentBox->view);
+}
+
+// Start threads searching the evicted blocks.  Returns 0 if it can't.
+int searchStart(struct searchJob *job, struct search *search)
+{
+  struct content *content = job->view->content;
+  long threads = (toys.optflags & FLAG_t) ? TT.t : sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (threads > job->count)
+    threads = job->count;
+  if (threads > SEARCH_THREADS)
+    threads = SEARCH_THREADS;
+  if (1 > threads)
+    threads = 1;
+  if (pipe2(job->wake, O_CLOEXEC | O_NONBLOCK))
+    return 0;
+  // It's own copy of the file, and the search, so they stay the same while the threads use them.
+  if (-1 == (job->fd = dup(content->page)))
+  {
+    job->fd = content->page;
+    close(job->wake[0]);
+    close(job->wake[1]);
+    return 0;
+  }
+  if (!job->search)
+    job->search = searchClone(search);
+  job->best = job->count;
+  job->threads = xzalloc(threads * sizeof(pthread_t));
+  for (; job->threadCount < threads; job->threadCount++)
+    if (pthread_create(&(job->threads[job->threadCount]), NULL, searchThread, job))
+      break;
+  if (!job->threadCount)
+  {
+    // What was found in memory is still needed, so the caller searches them instead.
+    close(job->fd);
+    job->fd = content->page;
+    close(job->wake[0]);
+    close(job->wake[1]);
+    free(job->threads);
+    job->threads = NULL;
+    return 0;
+  }
+  searching = job;
+  addWatcher(job->wake[0], searchProgress, job);
+
+  return 1;
+}
+
+// What's in memory has been searched, found says what that found, now for the evicted blocks it passed over.
+void searchWalked(struct searchJob *job, struct search *search, int found, struct line *line, uint32_t y, uint32_t x)
+{
+  view *view = job->view;
+  off_t size = 0;
+  uint32_t i;
+
+  for (i = 0; i < job->count; i++)
+    size += job->units[i].size;
+  if ((SEARCH_INLINE <= size) && searchStart(job, search))
+  {
+    job->found = found;
+    job->y = y;
+    job->x = x;
+    free(view->statusLine);
+    view->statusLine = xstrdup("Searching");
+    return;
+  }
+
+  // Not much, or no threads, so just search them now.
+  for (i = 0; i < job->count; i++)
+  {
+    searchUnit(job, search, i, &searchData, &searchSize);
+    if (2 == job->units[i].state)
+    {
+      found = 1 + job->units[i].wrapped;
+      line = NULL;
+      y = job->units[i].y + job->units[i].k;
+      x = job->units[i].x;
+      break;
+    }
+  }
+  searchShow(view, search, found, line, y, x);
+  if (job->search)
+    freeSearch(job->search);
+  free(job->units);
+  free(job);
+}
+
+// An incremental search carries on walking through what's in memory, while nothing is being typed.
+void searchWalk(struct watcher *watcher)
+{
+  struct searchJob *job = watcher->data;
+  struct content *content = job->view->content;
+  struct line *line = job->start;
+  uint32_t y = job->sy, x = job->sx;
+  int found;
+
+  if ((content->undo.length != job->undoLength) || (content->undo.at != job->undoAt))
+  {
+    searchStop(NULL);
+    free(job->view->statusLine);
+    job->view->statusLine = xstrdup("Search abandoned, the text changed");
+    updateLine(currentBox->view);
+    return;
+  }
+  job->budget = SEARCH_SLICE;
+  if (0 > (found = searchContent(content, job->search, &line, &y, &x, job)))
+    return;
+  delWatcher(-1, job);
+  job->walking = 0;
+  searching = NULL;
+  searchWalked(job, job->search, found, line, y, x);
+  updateLine(currentBox->view);
+}
+
+// Move the cursor to the next match after byte x of the current line.  If slice isn't 0, only that much is searched
+// straight away, the rest of it is done in the background.
+void searchFrom(view *view, struct search *search, uint32_t x, size_t slice)
+{
+  struct content *content = view->content;
+  struct searchJob *job = xzalloc(sizeof(struct searchJob));
+  struct line *line = view->line;
+  uint32_t y = viewLine(view);
+  int found;
+
+  job->view = view;
+  pageFile(content);
+  job->fd = content->page;
+  job->undoLength = content->undo.length;
+  job->undoAt = content->undo.at;
+  job->start = line;
+  job->sy = y;
+  job->sx = x;
+  if ((job->budget = slice))
+    job->search = searchClone(search);
+  if (0 > (found = searchContent(content, search, &line, &y, &x, job)))
+  {
+    job->walking = 1;
+    searching = job;
+    addWatcher(-1, searchWalk, job);
+    free(view->statusLine);
+    view->statusLine = xstrdup("Searching");
+    return;
+  }
+  searchWalked(job, search, found, line, y, x);
+}
+
+// Move the cursor to the next match.
+void searchView(view *view, struct search *search)
+{
+  searchStop(NULL);
+  if (!search || !*search->text)
+  {
+    free(view->statusLine);
+    view->statusLine = xstrdup("Nothing to search for");
+    return;
+  }
+  searchFrom(view, search, view->iX, 0);
+}
+
+// Follow mode replaces the partial last line as it grows.  A search walking the lines that started there carries on
+// from the new one, but if that's where it had got to, where it's up to is lost.
+void searchReplaceLine(struct content *content, struct line *old, struct line *new)
+{
+  struct searchJob *job = searching;
+
+  if (!job || !job->walking || (job->view->content != content))
+    return;
+  if (job->line == old)
+  {
+    free(job->view->statusLine);
+    job->view->statusLine = xstrdup("Search abandoned, the text changed");
+    searchStop(NULL);
+  }
+  else if (job->start == old)
+    job->start = new;
+}
+
+// Search for the command argument, or ask for it.
+void searchFor(view *view, int back, uint8_t syntax, char *prompt, eventHandler handler)
+{
+  struct search *search;
+
+  if (!commandArgument || !*commandArgument)
+  {
+    promptFor(view, prompt, handler);
+    return;
+  }
+  if ((search = searchCompile(view, commandArgument, syntax)))
+  {
+    search->back = back;
+    searchView(view, search);
+  }
+}
+
+void searchForward(view *view)
+{
+  searchFor(view, 0, view->content->context->syntax, "/", searchForward);
+}
+
+void searchBackward(view *view)
+{
+  searchFor(view, 1, view->content->context->syntax, "?", searchBackward);
+}
+
+// For editors that have separate commands to search for regular expressions.
+void searchRegexForward(view *view)
+{
+  searchFor(view, 0, SEARCH_BRE, "Regexp search: ", searchRegexForward);
+}
+
+void searchRegexBackward(view *view)
+{
+  searchFor(view, 1, SEARCH_BRE, "Regexp search backward: ", searchRegexBackward);
+}
+
+// Search for the last thing searched for again, the same way, or the other way.
+void searchAgain(view *view, int reverse)
+{
+  struct search *search = view->content->context->searches, again;
+
+  if (search)
+  {
+    again = *search;
+    again.back ^= reverse;
+    search = &again;
+  }
+  searchView(view, search);
+}
+
+void searchNext(view *view)
+{
+  searchAgain(view, 0);
+}
+
+void searchPrevious(view *view)
+{
+  searchAgain(view, 1);
+}
+
+// Go through len bytes of text, lines ending with sep, adding those that get shown to the filter.  Returns how many
+// lines there where.
+uint32_t filterText(struct filter *filter, char *text, size_t len, char sep)
+{
+  size_t p = 0, e, hi = (len && isSep(text[len - 1])) ? len : len + 1;
+  uint32_t lines = 0;
+  char *found = NULL, *nl;
+  int more = 1;
+
+  while (p < len)
+  {
+    // The next match, unless it's further on still.  Most lines won't have one, so they are found a block at a time.
+    if (more && (!found || (found < (text + p))))
+      more = !!(found = findText(filter->search, text, len, p, hi, NULL));
+    e = (nl = memchr(text + p, sep, len - p)) ? nl - text : len;
+    if ((found && (found <= (text + e))) != filter->invert)
+    {
+      if (filter->count == filter->size)
+        filter->rows = xrealloc(filter->rows, (filter->size = filter->size ? filter->size * 2 : 1024) * sizeof(uint32_t));
+      filter->rows[filter->count++] = filter->y;
+    }
+    filter->y++;
+    lines++;
+    p = e + 1;
+  }
+
+  return lines;
+}
+
+// Look through about budget bytes more of the content for lines to show.  Returns 0 once it's looked at them all.
+int filterLook(struct content *content, struct filter *filter, size_t budget)
+{
+  struct line *line = filter->line;
+  struct block *block;
+  ssize_t got;
+
+  if (!line && filter->block && (filter->block <= content->blockCount))
+    line = content->blocks[filter->block].first;
+  // Usually it's carrying on from near the end, after more lines turned up.
+  if (!line)
+    line = filter->y ? stepLines(content, &(content->lines), (long) filter->y - (long) content->lines.length)
+      : content->lines.next;
+  filter->line = NULL;
+  filter->block = 0;
+
+  while (&(content->lines) != line)
+  {
+    // The partial last line while following, and the blank line before anything arrives, are still to come.
+    if ((content->tail == line) || ((&(content->lines) == line->next) && !line->block
+      && ((content->flags & CONTENT_LOADING) || (-1 != content->fd))))
+      return 0;
+    block = (line->block && (line->block <= content->blockCount)) ? &(content->blocks[line->block]) : NULL;
+    if (!budget && (!block || (block->flags & BLOCK_DIRTY) || (block->first == line)))
+    {
+      if (block && !(block->flags & BLOCK_DIRTY))
+        filter->block = line->block;
+      else
+        filter->line = line;
+      return 1;
+    }
+
+    if (isStub(content, line))
+    {
+      // Evicted blocks are read into the search buffer, not back into the content.
+      got = 0;
+      if (pageFile(content))
+      {
+        if (searchSize < block->size)
+          searchData = xrealloc(searchData, searchSize = block->size);
+        if (0 > (got = pread(content->page, searchData, block->size, block->offset)))
+          got = 0;
+      }
+      got = filterText(filter, searchData, got, '\n');
+      // Lines that couldn't be read are empty.
+      for (; got < line->length; got++)
+        filterText(filter, "", 1, '\0');
+      line = line->next;
+      got = block->size;
+    }
+    else if (block && !(block->flags & BLOCK_DIRTY) && (block->first == line) && inBlock(block, line->line))
+    {
+      // A whole block that has not changed.
+      filterText(filter, block->data, block->size, '\0');
+      line = blockEnd(content, line->block);
+      got = block->size;
+    }
+    else
+    {
+      got = strlen(line->line) + 1;
+      filterText(filter, line->line, got, '\0');
+      line = line->next;
+    }
+    budget = (budget > got) ? budget - got : 0;
+  }
+
+  return 0;
+}
+
+// The text changed, so start again from the top.
+void filterRestart(view *view)
+{
+  struct filter *filter = view->filter;
+
+  filter->count = filter->y = filter->block = 0;
+  filter->line = NULL;
+  filter->undoLength = view->content->undo.length;
+  filter->undoAt = view->content->undo.at;
+  view->cY = view->offsetY = 0;
+  view->line = stepLines(view->content, &(view->content->lines), 1);
+  filter->at = 0;
+}
+
+// Say how far the filter got, or how many lines it shows once it's done.
+void filterStatus(view *view)
+{
+  struct filter *filter = view->filter;
+
+  free(view->statusLine);
+  if (filter->walking)
+    view->statusLine = xmprintf("Filtering %d%%",
+      (int) (((uint64_t) filter->y * 100) / (view->content->lines.length ? view->content->lines.length : 1)));
+  else
+    view->statusLine = xmprintf("%u of %u lines %s %s", filter->count, view->content->lines.length,
+      filter->invert ? "don't match" : "match", filter->search->text);
+}
+
+// The main loop calls this when it's idle, to look at some more lines.
+void filterWalk(struct watcher *watcher)
+{
+  view *view = watcher->data;
+  struct filter *filter = view->filter;
+  uint32_t before = filter->count, oY = view->offsetY;
+  int pin = (view->content->flags & CONTENT_FOLLOW) && ((view->cY + 1) >= before);
+
+  if ((view->content->undo.length != filter->undoLength) || (view->content->undo.at != filter->undoAt))
+  {
+    filterRestart(view);
+    before = 0;
+  }
+  if (!filterLook(view->content, filter, SEARCH_SLICE))
+  {
+    delWatcher(-1, view);
+    filter->walking = 0;
+  }
+  filterStatus(view);
+
+  // Only redraw if there's more to see.
+  if (pin && (filter->count > before))
+    moveCursorAbsolute(view, 0, filter->count - 1, 0, 0);
+  if ((oY == view->offsetY) && (filter->count > before) && (before < (view->offsetY + view->H)) && view->box)
+    drawBox(view->box);
+  updateLine(currentBox->view);
+}
+
+// Look at lines that turned up since it last looked.
+void filterMore(view *view)
+{
+  struct filter *filter = view->filter;
+
+  if (!filter->walking && (filter->y < view->content->lines.length))
+  {
+    filter->walking = 1;
+    addWatcher(-1, filterWalk, view);
+  }
+}
+
+// Show all the lines again, staying on the same one.
+void filterStop(view *view)
+{
+  struct filter *filter = view->filter;
+  long oY;
+
+  if (!filter)
+    return;
+  if (filter->walking)
+    delWatcher(-1, view);
+  oY = (long) filter->at - (long) (view->cY - view->offsetY);
+  view->cY = filter->at;
+  view->offsetY = (0 > oY) ? 0 : oY;
+  freeSearch(filter->search);
+  free(filter->rows);
+  free(filter);
+  view->filter = NULL;
+  free(view->statusLine);
+  view->statusLine = NULL;
+}
+
+// Like less &, only show the lines that match, or those that don't if it starts with !.  Again shows them all.
+void filterLines(view *view)
+{
+  struct filter *filter;
+  struct search *search;
+  char *text = commandArgument;
+  int invert = 0;
+
+  if (view->filter)
+  {
+    filterStop(view);
+    drawBox(view->box);
+    return;
+  }
+  if (!text || !*text)
+  {
+    promptFor(view, "&", filterLines);
+    return;
+  }
+  if ('!' == *text)
+  {
+    invert = 1;
+    text++;
+  }
+  if (!*text || !(search = searchCompile(view, text, view->content->context->syntax)))
+    return;
+
+  filter = view->filter = xzalloc(sizeof(struct filter));
+  filter->search = searchClone(search);
+  filter->search->back = 0;
+  filter->invert = invert;
+  filter->undoLength = view->content->undo.length;
+  filter->undoAt = view->content->undo.at;
+  filter->at = view->cY;
+  view->cY = view->offsetY = 0;
+  // The first screen full is likely found straight away, the rest in the background.
+  if ((filter->walking = filterLook(view->content, filter, SEARCH_SLICE)))
+    addWatcher(-1, filterWalk, view);
+  filterStatus(view);
+  drawBox(view->box);
+}
+
+// Add n bytes to the end of a buffer that grows as needed.
+void appendBytes(char **buf, size_t *size, size_t *used, char *text, size_t n)
+{
+  if ((*used + n + 1) > *size)
+  {
+    *size = (*used + n + 1) * 2;
+    *buf = xrealloc(*buf, *size);
+  }
+  memcpy(&((*buf)[*used]), text, n);
+  *used += n;
+}
+
+// Replace what search matches with rep, on lines from up to to, all of them on each line if all, otherwise the first.
+// Unless it's a literal search, & or \0 in rep is what matched, \1 to \9 what it's groups matched, and \ quotes the
+// next character.  Only regexec() knows where the groups are, so matches get found again with that if rep wants
+// them.  All the matches on a line
+// are found first, then the line gets it's new text all at once, recorded as one delete and one insert of just the
+// part that changed, all in the one undo group, and the box is drawn after they are all done.
+uint32_t replaceLines(view *view, struct search *search, char *rep, uint32_t from, uint32_t to, int all)
+{
+  struct content *content = view->content;
+  struct line *line;
+  char *text, *found, *r, *buf = NULL;
+  size_t len, lo, end, start = 0, last = 0, size = 0, out, n;
+  uint32_t y, count = 0, lines = 0, changed = 0, reps;
+  int back = search->back, magic = SEARCH_LITERAL != search->syntax, want = 0, k;
+  regex_t own, *groups = NULL;
+  regmatch_t sub[10];
+
+  if (to >= content->lines.length)
+    to = content->lines.length - 1;
+  if ((!content->lines.length) || (from > to))
+    return 0;
+
+  for (r = rep; magic && *r; r++)
+    if (('\\' == *r) && r[1] && ('0' < *++r) && ('9' >= *r) && ((*r - '0') > want))
+      want = *r - '0';
+  if (want)
+  {
+    if (!(groups = search->regex->posix))
+    {
+      char *pattern = xstrdup(search->text);
+
+      patternFold(pattern);
+      if (!regcomp(&own, pattern, ((SEARCH_ERE == search->syntax) ? REG_EXTENDED : 0) | (search->fold ? REG_ICASE : 0)))
+        groups = &own;
+      free(pattern);
+    }
+    if ((!groups) || (want > groups->re_nsub))
+    {
+      if (groups == &own)
+        regfree(&own);
+      free(view->statusLine);
+      view->statusLine = xmprintf("No \\%d group in %s", want, search->text);
+      commandFailed = 1;
+      return 0;
+    }
+  }
+  search->back = 0;
+  line = stepLines(content, view->line, (long) from - (long) viewLine(view));
+  for (y = from; ; y++)
+  {
+    text = line->line;
+    len = strlen(text);
+    for (lo = 0, out = 0, reps = 0; (lo <= len) && (found = findText(search, text, len, lo, len + 1, &end)); )
+    {
+      n = found - text;
+      // Like vi, an empty match straight after the last one doesn't count.
+      if ((n == end) && reps && (n == last))
+      {
+        lo = n + 1;
+        continue;
+      }
+      if (!reps)
+        start = last = n;
+      appendBytes(&buf, &size, &out, &(text[last]), n - last);
+      if (groups && regexec(groups, found, 10, sub, n ? REG_NOTBOL : 0))
+        memset(sub, -1, sizeof(sub));
+      for (r = rep; *r; )
+      {
+        size_t plain = magic ? strcspn(r, "&\\") : strlen(r);
+
+        appendBytes(&buf, &size, &out, r, plain);
+        r += plain;
+        if (('&' == *r) || (('\\' == r[0]) && ('0' == r[1]) && r++))
+          appendBytes(&buf, &size, &out, found, end - n);
+        else if (groups && ('\\' == r[0]) && ('0' < r[1]) && ('9' >= r[1]))
+        {
+          if (-1 != sub[k = *++r - '0'].rm_so)
+            appendBytes(&buf, &size, &out, found + sub[k].rm_so, sub[k].rm_eo - sub[k].rm_so);
+        }
+        else if (r[0] && r[1])
+          appendBytes(&buf, &size, &out, ++r, 1);
+        if (*r)
+          r++;
+      }
+      last = end;
+      reps++;
+      if (!all)
+        break;
+      lo = (end > n) ? end : n + 1;
+    }
+
+    if (reps)
+    {
+      undoRecord(content, UNDO_DELETE, y, start, &(text[start]), last - start);
+      journalRecord(content, UNDO_DELETE, y, start, &(text[start]), last - start);
+      undoRecord(content, UNDO_INSERT, y, start, buf, out);
+      journalRecord(content, UNDO_INSERT, y, start, buf, out);
+      lineRoom(line, len - (last - start) + out);
+      text = line->line;
+      memmove(&(text[start + out]), &(text[last]), len - last + 1);
+      memcpy(&(text[start]), buf, out);
+      dirtyLine(content, line);
+      count += reps;
+      lines++;
+      changed = y;
+    }
+    if (y == to)
+      break;
+    line = nextLine(content, line);
+  }
+  search->back = back;
+  free(buf);
+  if (groups == &own)
+    regfree(&own);
+
+  free(view->statusLine);
+  if (count)
+  {
+    view->statusLine = xmprintf("Replaced %u on %u line%s", count, lines, (1 == lines) ? "" : "s");
+    undoCursor(view, changed, start);
+  }
+  else
+    view->statusLine = xmprintf("Not found - %s", search->text);
+  if (view->box)
+    drawBox(view->box);
+
+  return count;
+}
+
+// ex's s/re/rep/g, on the current line, or the range of lines it was given.  Anything but a letter, digit, or space
+// can be used instead of /, and \ quotes it.  An empty re is the last one searched for, g replaces all of them on each
+// line, not just the first.
+void viSubstitute(view *view)
+{
+  struct search *search = view->content->context->searches;
+  char *text, *re, *rep, *flags, *from, *to, sep;
+  uint32_t y = viewLine(view);
+
+  if (!commandArgument || !(sep = *commandArgument) || isalnum(sep) || ('\\' == sep) || isspace(sep))
+  {
+    free(view->statusLine);
+    view->statusLine = xstrdup("Substitute what?  Like s/this/that/g");
+    return;
+  }
+
+  // Split it up, taking the backslashes off the separators.
+  text = xzalloc(strlen(commandArgument) + 3);
+  strcpy(text, commandArgument + 1);
+  re = rep = flags = NULL;
+  for (from = to = text; ; from++)
+  {
+    if (('\\' == *from) && (sep == from[1]))
+      from++;
+    else if ((sep == *from) || !*from)
+    {
+      int done = !*from;
+
+      *to++ = '\0';
+      if (!rep)
+        rep = to;
+      else if (!flags)
+        flags = to;
+      if (done)
+        break;
+      continue;
+    }
+    *to++ = *from;
+  }
+  re = text;
+  if (!rep)
+    rep = to;
+  if (!flags)
+    flags = to;
+
+  if (*re)
+    search = searchCompile(view, re, view->content->context->syntax);
+  else if (!search)
+  {
+    free(view->statusLine);
+    view->statusLine = xstrdup("No previous regular expression");
+  }
+  if (search)
+    replaceLines(view, search, rep, commandRanged ? commandFrom : y, commandRanged ? commandTo : y, !!strchr(flags, 'g'));
+  free(text);
+}
+
+static char *replacing;	// What replace all is replacing, while it asks what with.
+
+void replaceWith(view *view)
+{
+  struct search *search;
+
+  if (replacing && (search = searchCompile(view, replacing, view->content->context->syntax)))
+    replaceLines(view, search, commandArgument ? commandArgument : "", 0, view->content->lines.length - 1, 1);
+  free(replacing);
+  replacing = NULL;
+}
+
+// Replace all of something with something else, asking what they are, like mcedit and nano do.
+void replaceAll(view *view)
+{
+  if (!commandArgument || !*commandArgument)
+  {
+    promptFor(view, "Replace: ", replaceAll);
+    return;
+  }
+  free(replacing);
+  replacing = xstrdup(commandArgument);
+  promptFor(view, "Replace with: ", replaceWith);
+  // Replacing with nothing is fine.
+  promptEmpty = 1;
+}
+
+// The next line after line y that search matches, or the one before it if back, wrapping around.  -1 if none do.
+long matchLine(view *view, struct search *search, uint32_t y, int back)
+{
+  struct content *content = view->content;
+  struct line *line = stepLines(content, view->line, (long) y - (long) viewLine(view));
+  uint32_t i, len;
+  int was = search->back;
+
+  search->back = 0;
+  for (i = 0; i < content->lines.length; i++)
+  {
+    if (back)
+    {
+      if (&(content->lines) == (line = prevLine(content, line)))
+        line = prevLine(content, line);
+      y = y ? y - 1 : content->lines.length - 1;
+    }
+    else
+    {
+      if (&(content->lines) == (line = nextLine(content, line)))
+        line = nextLine(content, line);
+      y = (y + 1 < content->lines.length) ? y + 1 : 0;
+    }
+    len = strlen(line->line);
+    if (findText(search, line->line, len, 0, len + 1, NULL))
+      break;
+  }
+  search->back = was;
+
+  return (i < content->lines.length) ? y : -1;
+}
+
+// Say what's wrong with a command, returning NULL.
+char *commandBad(view *view, char *why, char *what)
+{
+  free(view->statusLine);
+  view->statusLine = xmprintf(why, what);
+  return NULL;
+}
+
+// Take the separator at the start of text, and what's up to the next one, or the end, with backslashes taken off any
+// separators in it.  Returns a copy of that, and text is left after it.
+char *commandPart(char **text)
+{
+  char sep = **text, *from, *result, *to;
+
+  for (from = *text + 1, result = to = xzalloc(strlen(*text) + 1); *from && (sep != *from); from++)
+  {
+    if (('\\' == *from) && (sep == from[1]))
+      from++;
+    *to++ = *from;
+  }
+  *text = *from ? from + 1 : from;
+
+  return result;
+}
+
+// Work out one ex line address, a line number, ., $, 'a for a mark, or /re/ or ?re? for the next or previous line that
+// matches, with any + and - after it, which are from the current line if there's nothing before them.  ex counts lines
+// from 1, we count them from 0.  Returns -1 if there's no address, or -2 if it's no good, after saying why.
+long commandAddress(view *view, char **command, long dot)
+{
+  struct content *content = view->content;
+  struct search *search;
+  char *c = *command, *re;
+  long y = -1, n;
+  int sign;
+
+  if (isdigit(*c))
+  {
+    // Line 0 is before the first line, which is the first line as far as we are concerned.
+    if (0 > (y = strtol(c, &c, 10) - 1))
+      y = 0;
+    loadLines(content, y);
+  }
+  else if ('.' == *c)
+  {
+    y = dot;
+    c++;
+  }
+  else if ('$' == *c)
+  {
+    loadLines(content, UINT32_MAX);
+    y = content->lines.length - 1;
+    c++;
+  }
+  else if ('\'' == *c)
+  {
+    if (!islower(c[1]) || !content->marks[c[1] - 'a'])
+    {
+      commandBad(view, "Mark not set - %.2s", c);
+      return -2;
+    }
+    y = content->marks[c[1] - 'a'] - 1;
+    c += 2;
+  }
+  else if (('/' == *c) || ('?' == *c))
+  {
+    sign = ('?' == *c);
+    loadLines(content, UINT32_MAX);
+    re = commandPart(&c);
+    search = *re ? searchCompile(view, re, content->context->syntax) : content->context->searches;
+    if (search && (0 > (y = matchLine(view, search, dot, sign))))
+      commandBad(view, "Not found - %s", search->text);
+    free(re);
+    if (!search || (0 > y))
+      return -2;
+  }
+
+  while (('+' == *c) || ('-' == *c))
+  {
+    sign = ('+' == *c++) ? 1 : -1;
+    n = isdigit(*c) ? strtol(c, &c, 10) : 1;
+    if (0 > y)
+      y = dot;
+    y += sign * n;
+  }
+  if (((0 > y) && (c != *command)) || (y >= (long) content->lines.length))
+  {
+    commandBad(view, "Invalid range", NULL);
+    return -2;
+  }
+  *command = c;
+
+  return y;
+}
+
+// Work out the range of lines an ex command starts with, if it has one, into commandFrom and commandTo, setting
+// commandRanged.  Returns what's after the range, or NULL if it's no good, after saying why.
+char *commandRange(view *view, char *command)
+{
+  long dot = viewLine(view), from, to;
+
+  commandRanged = 0;
+  if ('%' == *command)
+  {
+    loadLines(view->content, UINT32_MAX);
+    from = 0;
+    to = view->content->lines.length ? view->content->lines.length - 1 : 0;
+    command++;
+  }
+  else
+  {
+    if (-2 == (from = to = commandAddress(view, &command, dot)))
+      return NULL;
+    if ((',' == *command) || (';' == *command))
+    {
+      // With ; the second one is from the first one.
+      if (0 > from)
+        from = dot;
+      else if (';' == *command)
+        dot = from;
+      command++;
+      if (-2 == (to = commandAddress(view, &command, dot)))
+        return NULL;
+      if (0 > to)
+        to = dot;
+    }
+    if (0 > from)
+      return command;
+  }
+  // Backwards ranges are just turned around.
+  commandFrom = (from < to) ? from : to;
+  commandTo = (from < to) ? to : from;
+  commandRanged = 1;
+  while (' ' == *command)
+    command++;
+
+  return command;
+}
+
+// ex's mark and k, which mark the current line, or the last of the range, as a to z, for 'a addresses.
+void viMark(view *view)
+{
+  char *c = commandArgument;
+
+  free(view->statusLine);
+  view->statusLine = NULL;
+  if (!c || !islower(*c))
+    view->statusLine = xstrdup("Mark it as what?  A letter from a to z");
+  else
+    view->content->marks[*c - 'a'] = (commandRanged ? commandTo : viewLine(view)) + 1;
+}
+
+// ex's g/re/command, on all the lines, or the range, that match, or that don't for g! and v.  Which lines match is
+// found first, like a filtered view does, then the command is done on each of them, from the start, without drawing
+// the box until the end, and all in the one undo group.  Deletes and substitutes are done a run of lines at a time, from
+// the end back, so the line numbers of the ones still to go don't change.  An empty re is the last one searched for.
+void viGlobalDo(view *view, int invert)
+{
+  struct content *content = view->content;
+  struct search *search = content->context->searches;
+  struct function *function;
+  struct filter found = {0};
+  struct line *line;
+  char *text = commandArgument, *re, *command, *rest, *arg = NULL;
+  uint32_t from = commandRanged ? commandFrom : 0, to = commandRanged ? commandTo : UINT32_MAX, i, j, y;
+  long before;
+
+  // Without a range it's all of the lines, so they all have to be loaded.
+  if (!commandRanged)
+  {
+    loadLines(content, UINT32_MAX);
+    to = content->lines.length - 1;
+  }
+  before = content->lines.length;
+  if (text && ('!' == *text))
+  {
+    invert = !invert;
+    text++;
+  }
+  if (!text || !*text || isalnum(*text) || ('\\' == *text) || isspace(*text))
+  {
+    commandBad(view, "Which lines?  Like g/this/d", NULL);
+    commandFailed = 1;
+    return;
+  }
+  command = text;
+  re = commandPart(&command);
+  if (*re)
+    search = searchCompile(view, re, content->context->syntax);
+  free(re);
+  if (!search)
+  {
+    if (!view->statusLine)
+      commandBad(view, "No previous regular expression", NULL);
+    commandFailed = 1;
+    return;
+  }
+  if (view->filter)
+    filterStop(view);
+
+  // Find them all first.
+  found.search = searchClone(search);
+  found.search->back = 0;
+  found.invert = invert;
+  if (!from && ((to + 1) >= content->lines.length))
+    filterLook(content, &found, (size_t) -1);
+  else
+  {
+    found.y = from;
+    for (line = stepLines(content, view->line, (long) from - (long) viewLine(view)); found.y <= to;
+      line = nextLine(content, line))
+      filterText(&found, line->line, strlen(line->line) + 1, '\0');
+  }
 
-  // We could call drawBoxes() here, but this is recursive, and so is drawBoxes().
-  // The combination might be deadly.  Drawing the content of a box might be an expensive operation.
-  // Later we might use a dirty box flag to deal with this, if it's not too much of a complication.
+  drawHold();
+  if (!found.count)
+    commandBad(view, "Not found - %s", search->text);
+  else if (*command)
+  {
+    undoCursor(view, found.rows[0], 0);
+    if (!(rest = commandRange(view, command)))
+      commandFailed = 1;
+    else if (!(function = findCommand(view, rest, &arg)) || !function->handler)
+    {
+      commandBad(view, "Not a command - %s", rest);
+      commandFailed = 1;
+    }
+    else if (commandRanged && !rangeCommand(function->handler))
+    {
+      commandBad(view, "No range allowed - %s", rest);
+      commandFailed = 1;
+    }
+    else if (((cutLine == function->handler) || (viSubstitute == function->handler)) && !commandRanged)
+    {
+      for (i = found.count; i--; )
+      {
+        for (j = i; i && (found.rows[i - 1] + 1 == found.rows[i]); i--)
+          ;
+        undoCursor(view, found.rows[i], 0);
+        commandFrom = found.rows[i];
+        commandTo = found.rows[j];
+        commandRanged = 1;
+        commandArgument = arg;
+        function->handler(view);
+      }
+    }
+    else
+    {
+      for (i = 0; i < found.count; i++)
+      {
+        // Lines added or deleted by the command move the ones after it.
+        y = found.rows[i] + (content->lines.length - before);
+        if (y >= content->lines.length)
+          break;
+        undoCursor(view, y, 0);
+        if (!commandRange(view, command))
+        {
+          commandFailed = 1;
+          break;
+        }
+        commandArgument = arg;
+        function->handler(view);
+      }
+    }
+    commandArgument = NULL;
+    commandRanged = 0;
+  }
+  else
+    undoCursor(view, found.rows[found.count - 1], 0);
+
+  if (commandFailed)
+    ;
+  else if (found.count && (content->lines.length != before))
+  {
+    free(view->statusLine);
+    view->statusLine = xmprintf("%u line%s matched, %ld %s lines", found.count, (1 == found.count) ? "" : "s",
+      labs(content->lines.length - before), (content->lines.length < before) ? "fewer" : "more");
+  }
+  else if (found.count)
+  {
+    free(view->statusLine);
+    view->statusLine = xmprintf("%u line%s matched", found.count, (1 == found.count) ? "" : "s");
+  }
+  freeSearch(found.search);
+  free(found.rows);
+  if (view->box)
+    drawBox(view->box);
+  drawRelease();
 }
 
-void deleteBox(view *view)
+void viGlobal(view *view)
 {
-  box *box = view->box;
+  viGlobalDo(view, 0);
+}
 
-  if (box->parent)
+void viGlobalInverted(view *view)
+{
+  viGlobalDo(view, 1);
+}
+
+// The ex commands that know what to do with a range of lines, the rest are not given one.
+int rangeCommand(eventHandler handler)
+{
+  return (cutLine == handler) || (copyLine == handler) || (viSubstitute == handler) || (viMark == handler)
+    || (viGlobal == handler) || (viGlobalInverted == handler) || (viPut == handler);
+}
+
+// Incremental searches move to the first match as each character is typed, and back to where they started if given
+// up on.  Each thing searched for is remembered, with where it was found, so backing up goes back there.  When what's
+// typed just adds ordinary characters to the last one, the new one can only match where that one did, so it carries
+// on from that match, or from where that search had got to if it's still looking.
+
+struct isearchStep
+{
+  char *text;
+  int found;		// What searchShow() said, -1 while it's still looking, or -2 if it's no good.
+  int wrapped;		// It carried on from one that wrapped around.
+  uint32_t y, x;	// Where the cursor ended up.
+};
+
+struct isearch
+{
+  view *view;
+  eventHandler handler;	// The prompt is for this, typing into other prompts is left alone.
+  char *prompt;
+  uint8_t syntax;
+  int back;
+  uint32_t y, x;	// Where it started.
+  struct isearchStep *steps;
+  int count;
+};
+
+static struct isearch *isearching;
+
+// Say how it's going in the prompt, like emacs does.
+void isearchPrompt(struct isearch *is)
+{
+  struct isearchStep *step = is->count ? &(is->steps[is->count - 1]) : NULL;
+  char *how = "";
+
+  if (promptHandler != is->handler)
+    return;
+  if (step && ((0 == step->found) || (-2 == step->found)))
+    how = "Failing ";
+  else if (step && (2 == step->found))
+    how = "Wrapped ";
+  free(commandLine->prompt);
+  commandLine->prompt = xmprintf("%s%s", how, is->prompt);
+}
+
+// searchShow() tells an incremental search what it found, which might be a while after it was typed.
+void isearchFound(view *view, int found)
+{
+  struct isearch *is = isearching;
+  struct isearchStep *step;
+
+  if (!is || (view != is->view) || !is->count || (promptHandler != is->handler))
+    return;
+  step = &(is->steps[is->count - 1]);
+  if (2 == found)
+    step->wrapped = 1;
+  if (found && step->wrapped)
+    found = 2;
+  step->found = found;
+  step->y = viewLine(view);
+  step->x = view->iX;
+  isearchPrompt(is);
+}
+
+// Does text just add ordinary characters to what step searched for?
+int isearchExtends(struct isearch *is, struct isearchStep *step, char *text)
+{
+  size_t len = strlen(step->text);
+  char *special = "";
+
+  if (strncmp(step->text, text, len))
+    return 0;
+  if (SEARCH_BRE == is->syntax)
+    special = "\\.[]*^$";
+  else if (SEARCH_ERE == is->syntax)
+    special = "\\.[]*^$+?(){}|";
+
+  return !text[len + strcspn(&(text[len]), special)];
+}
+
+// searchCompile() stops searching, but a search that's walking what's in memory has it's own copy of what it's
+// looking for, so that can keep going.
+struct search *isearchCompile(struct isearch *is, char *text)
+{
+  struct searchJob *job = searching;
+  struct search *search;
+
+  if (job && job->walking && (job->view == is->view))
+    searching = NULL;
+  else
+    job = NULL;
+  search = searchCompile(is->view, text, is->syntax);
+  if (job)
+    searching = job;
+
+  return search;
+}
+
+// Finished with the incremental search.  If it's given up on, go back to where it started.
+void isearchEnd(int keep)
+{
+  struct isearch *is = isearching;
+  int i;
+
+  if (!is)
+    return;
+  if (!keep && (promptHandler == is->handler))
   {
-    struct _box *oldBox = box, *otherBox = box->parent->sub1;
+    searchStop(NULL);
+    undoCursor(is->view, is->y, is->x);
+  }
+  for (i = 0; i < is->count; i++)
+    free(is->steps[i].text);
+  free(is->steps);
+  free(is->prompt);
+  free(is);
+  isearching = NULL;
+}
 
-    if (otherBox == oldBox)
-      otherBox = box->parent->sub2;
-    if (currentBox->parent == box->parent)
-      currentBox = box->parent;
-    box = box->parent;
-    box->X = box->sub1->X;
-    box->Y = box->sub1->Y;
-    if (box->flags & BOX_HSPLIT)
-      box->H = box->sub1->H + box->sub2->H;
+// After each key press, search for what's on the command line now.
+void isearchTyped(void)
+{
+  struct isearch *is = isearching;
+  struct isearchStep *step, *base;
+  struct searchJob *job = NULL;
+  struct search *search;
+  view *view;
+  char *text;
+  size_t len;
+  uint32_t y, x;
+  int found = -1, wrapped = 0;
+
+  if (!is || (promptHandler != is->handler))
+    return;
+  view = is->view;
+  text = commandLine->line->line;
+  if (is->count && !strcmp(is->steps[is->count - 1].text, text))
+    return;
+
+  // Forget those that are not the start of it, and one that's all of it but never finished looking.
+  while (is->count)
+  {
+    step = &(is->steps[is->count - 1]);
+    len = strlen(step->text);
+    if (!strncmp(step->text, text, len) && (text[len] || (-1 != step->found)))
+      break;
+    free(step->text);
+    is->count--;
+  }
+  base = is->count ? &(is->steps[is->count - 1]) : NULL;
+
+  // Backed up to one it already found, or all the way.
+  if (!*text || (base && !strcmp(base->text, text)))
+  {
+    searchStop(NULL);
+    if (base)
+      undoCursor(view, base->y, base->x);
     else
-      box->W = box->sub1->W + box->sub2->W;
-    box->flags &= ~BOX_HSPLIT;
-    // Move the other sub boxes contents up to this box.
-    box->sub1 = otherBox->sub1;
-    box->sub2 = otherBox->sub2;
-    if (box->sub1)
+      undoCursor(view, is->y, is->x);
+    isearchPrompt(is);
+    updateLine(commandLine);
+    return;
+  }
+
+  if (base && ((-2 == base->found) || !isearchExtends(is, base, text)))
+    base = NULL;
+  y = is->y;
+  x = is->x;
+  if (base)
+  {
+    found = base->found;
+    wrapped = base->wrapped || (2 == found);
+    y = base->y;
+    x = base->x;
+    if (-1 == found)
+    {
+      // Still looking, keep it going.
+      if (searching && searching->walking && (searching->view == view))
+        job = searching;
+      else
+      {
+        base = NULL;
+        wrapped = 0;
+        y = is->y;
+        x = is->x;
+      }
+    }
+  }
+  search = isearchCompile(is, text);
+
+  if (!(is->count % 16))
+    is->steps = xrealloc(is->steps, (is->count + 16) * sizeof(struct isearchStep));
+  step = &(is->steps[is->count++]);
+  memset(step, 0, sizeof(struct isearchStep));
+  step->text = xstrdup(text);
+  step->found = -1;
+  step->wrapped = wrapped;
+  step->y = viewLine(view);
+  step->x = view->iX;
+
+  if (search && job)
+  {
+    // What it's looked at so far had no match for the last one, so none for this one either.
+    search->back = is->back;
+    freeSearch(job->search);
+    job->search = searchClone(search);
+  }
+  else
+  {
+    searchStop(NULL);
+    if (!search)
+      step->found = -2;
+    else if (base && !found)
+      step->found = 0;
+    else
+    {
+      search->back = is->back;
+      undoCursor(view, y, x);
+      // A match right where it starts counts to, searchContent() only finds those after it.
+      x = view->iX;
+      x = is->back ? x + 1 : x - 1;
+      searchFrom(view, search, x, SEARCH_SLICE);
+    }
+  }
+  isearchPrompt(is);
+  updateLine(commandLine);
+}
+
+// Go to the next match, or if nothing has been typed yet, start with the last thing searched for.
+void isearchRepeat(int back)
+{
+  struct isearch *is = isearching;
+  struct isearchStep *step;
+  struct search *search;
+
+  if (!is || (promptHandler != is->handler))
+    return;
+  is->back = back;
+  if (!is->count)
+  {
+    if ((search = is->view->content->context->searches))
+    {
+      editInsert(commandLine, search->text, strlen(search->text), UNDO_TYPED);
+      commandLine->oW = formatLine(commandLine, commandLine->line->line, &(commandLine->output));
+      moveCursorRelative(commandLine, strlen(search->text), 0, 0, 0);
+    }
+    return;
+  }
+  step = &(is->steps[is->count - 1]);
+  if ((0 >= step->found) || !(search = searchCompile(is->view, step->text, is->syntax)))
+    return;
+  search->back = back;
+  step->found = -1;
+  searchFrom(is->view, search, is->view->iX, SEARCH_SLICE);
+  isearchPrompt(is);
+}
+
+// Search as it's typed.  Enter finishes it, where it got to.
+void isearchFor(view *view, int back, uint8_t syntax, char *prompt, eventHandler handler)
+{
+  struct isearch *is = isearching;
+
+  if (commandArgument)
+  {
+    if (is && (is->view == view) && is->count && !strcmp(is->steps[is->count - 1].text, commandArgument))
+    {
+      // Backing up doesn't search again, but it's what was searched for last, for searching again.
+      isearchCompile(is, commandArgument);
+      isearchEnd(1);
+    }
+    else
+      searchFor(view, back, syntax, prompt, handler);
+    return;
+  }
+  isearchEnd(1);
+  promptFor(view, prompt, handler);
+  if (promptHandler != handler)
+    return;
+  // Start with nothing typed, on the blank line at the end of the command line history.
+  undoCursor(commandLine, commandLine->content->lines.length - 1, 0);
+  editDelete(commandLine, strlen(commandLine->line->line), 0, NULL);
+  commandLine->oW = formatLine(commandLine, commandLine->line->line, &(commandLine->output));
+  is = isearching = xzalloc(sizeof(struct isearch));
+  is->view = view;
+  is->handler = handler;
+  is->prompt = xstrdup(prompt);
+  is->syntax = syntax;
+  is->back = back;
+  is->y = viewLine(view);
+  is->x = view->iX;
+}
+
+// Emacs searches for the text as is.
+void isearchForward(view *view)
+{
+  isearchFor(view, 0, SEARCH_LITERAL, "I-search: ", isearchForward);
+}
+
+void isearchBackward(view *view)
+{
+  isearchFor(view, 1, SEARCH_LITERAL, "I-search backward: ", isearchBackward);
+}
+
+void isearchRepeatForward(view *view)
+{
+  isearchRepeat(0);
+}
+
+void isearchRepeatBackward(view *view)
+{
+  isearchRepeat(1);
+}
+
+void incSearchForward(view *view)
+{
+  isearchFor(view, 0, view->content->context->syntax, "/", incSearchForward);
+}
+
+void incSearchBackward(view *view)
+{
+  isearchFor(view, 1, view->content->context->syntax, "?", incSearchBackward);
+}
+
+// Do a line from the command line, or a script, unless it's the argument a command asked for.
+// Returns 0 if it's not a command.
+int executeCommand(char *line)
+{
+  int result = 1;
+
+  if (promptHandler)
+  {
+    eventHandler handler = promptHandler;
+    int empty = promptEmpty;
+
+    promptDone();
+    if (line[0] || empty)
+    {
+      if (!undoHeld)
+        currentBox->view->content->undo.group = 1;
+      commandArgument = line;
+      handler(currentBox->view);
+      commandArgument = NULL;
+    }
+  }
+  // Don't bother doing much if there's nothing on this line.
+  else if (line[0])
+    result = doCommand(currentBox->view, line, 0);
+
+  return result;
+}
+
+void executeLine(view *view)
+{
+  struct line *result = view->line;
+
+  executeCommand(result->line);
+  if (result->line[0])
+  {
+    if (view->content->flags & CONTENT_HISTORY)
+    {
+      struct line *line = view->content->lines.next, *next;
+      int before = 1;
+
+      appendHistory(view->content, result->line);
+      // Only keep the latest copy of each entry.
+      while (&(view->content->lines) != line)
+      {
+        next = line->next;
+        if (line == result)
+          before = 0;
+        else if (strcmp(line->line, result->line) == 0)
+        {
+          freeLine(view->content, line);
+          if (before)
+            view->cY--;
+        }
+        line = next;
+      }
+    }
+    // If we are not at the end of the history contents.
+    if (&(view->content->lines) != result->next)
+    {
+      struct line *line = view->content->lines.prev;
+
+      // Remove the line first.
+      result->next->prev = result->prev;
+      result->prev->next = result->next;
+      // Check if the last line is already blank, then remove it.
+      if ('\0' == line->line[0])
+      {
+        freeLine(view->content, line);
+        line = view->content->lines.prev;
+      }
+      // Then add it to the end.
+      result->next = line->next;
+      result->prev = line;
+      line->next->prev = result;
+      line->next = result;
+      view->cY = view->content->lines.length - 1;
+    }
+    moveCursorAbsolute(view, 0, view->content->lines.length, 0, 0);
+    // Make sure there is one blank line at the end.
+    if ('\0' != view->line->line[0])
+    {
+      endOfLine(view);
+      splitLine(view);
+    }
+  }
+}
+
+void quit(view *view)
+{
+  handle_keys_quit();
+}
+
+void nop(view *view)
+{
+  // 'tis a nop, don't actually do anything.
+}
+
+
+// The things besides the keyboard that the main loop keeps an eye on, struct watcher is up the top.
+static struct watcher *watchers;
+
+void addWatcher(int fd, void (*handler)(struct watcher *watcher), void *data)
+{
+  struct watcher *result = xzalloc(sizeof(struct watcher));
+
+  result->fd = fd;
+  result->handler = handler;
+  result->data = data;
+  result->next = watchers;
+  watchers = result;
+  if (-1 != fd)
+    handle_keys_watch(fd, 1);
+}
+
+void delWatcher(int fd, void *data)
+{
+  struct watcher **watcher, *gone;
+
+  for (watcher = &watchers; *watcher; watcher = &((*watcher)->next))
+  {
+    if (((*watcher)->fd == fd) && ((*watcher)->data == data))
+    {
+      gone = *watcher;
+      *watcher = gone->next;
+      free(gone);
+      if (-1 != fd)
+        handle_keys_watch(fd, 0);
+      break;
+    }
+  }
+}
+
+// Scripts don't wait for the main loop, so a search a command started gets finished off before the next one.  The
+// rest of what's going in the background, like loading, is left to the main loop, commands that want more of the
+// file wait for it themselves.  Without a terminal there's no main loop, so then it all gets finished.
+void scriptSettle(void)
+{
+  struct watcher *watcher, *next;
+  struct pollfd fd;
+  int busy = 1;
+
+  while (busy)
+  {
+    busy = 0;
+    for (watcher = watchers; watcher; watcher = next)
     {
-        box->sub1->parent = box;
-        box->sub2->parent = box;
-        box->flags = otherBox->flags;
-        if (currentBox == box)
-          currentBox = box->sub1;
+      next = watcher->next;
+      if ((-1 == watcher->fd) && (headless || (searching && (watcher->data == searching))))
+      {
+        watcher->handler(watcher);
+        busy = 1;
+      }
     }
-    else
+    // Search threads wake up their watcher when they are done.
+    if (!busy && searching && !searching->walking)
     {
-      if (!box->parent)
-        box->flags &= ~BOX_BORDER;
-      box->split = 1.0;
+      fd.fd = searching->wake[0];
+      fd.events = POLLIN;
+      if (0 < poll(&fd, 1, -1))
+        for (watcher = watchers; watcher; watcher = watcher->next)
+          if (watcher->fd == fd.fd)
+          {
+            watcher->handler(watcher);
+            break;
+          }
+      busy = 1;
     }
-    otherBox->sub1 = NULL;
-    otherBox->sub2 = NULL;
-    // Safe to free the boxes now that we have all their contents.
-    freeBox(otherBox);
-    freeBox(oldBox);
   }
-  // Otherwise it must be a single full screen box.  Never delete that one, unless we are quitting.
+}
 
-  // Start the recursive recalculation of all the sub boxes.
-  calcBoxes(box);
-  drawBoxes(box);
+// Do a line of a script, which is line number of where, returns 0 if it's not a command.
+int scriptLine(char *where, long number, char *line)
+{
+  view *view = currentBox->view;
+  int result = executeCommand(line);
+
+  if (!result)
+  {
+    char *status = number ? xmprintf("%s:%ld: %s", where, number, view->statusLine) : xstrdup(view->statusLine);
+
+    if (headless)
+    {
+      error_msg("%s", status);
+      toys.exitval = 1;
+    }
+    free(view->statusLine);
+    view->statusLine = status;
+  }
+  scriptSettle();
+
+  return result;
 }
 
-void cloneBox(struct _box *box, struct _box *sub)
+// Do each line of a script file as a command, drawing it all once it's done.  Returns how many lines where not
+// commands, or -1 if it can't be read.
+long sourceFile(char *path)
 {
-  sub->parent = box;
-  // Only a full screen box has no border.
-  sub->flags |= BOX_BORDER;
-  sub->view = xmalloc(sizeof(struct _view));
-  // TODO - After this is more stable, should check if the memcpy() is simpler than - xzalloc() then copy a few things manually.
-  //          Might even be able to arrange the structure so we can memcpy just part of it, leaving the rest blank.
-  memcpy(sub->view, box->view, sizeof(struct _view));
-  sub->view->damage = NULL;
-  sub->view->data = NULL;
-  sub->view->output = NULL;
-  sub->view->box = sub;
-  if (box->view->prompt)
-    sub->view->prompt = strdup(box->view->prompt);
+  long number = 0, bad = 0;
+  char *line;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (-1 == fd)
+    return -1;
+  drawHold();
+  while ((line = get_rawline(fd, NULL, '\n')))
+  {
+    char *end = line + strlen(line);
+
+    if ((end > line) && ('\n' == end[-1]))
+      *(--end) = '\0';
+    if (!scriptLine(path, ++number, line))
+      bad++;
+    free(line);
+  }
+  close(fd);
+  // The script might have ended with a command still waiting for it's argument.
+  promptDone();
+  drawRelease();
+
+  return bad;
 }
 
-void splitBox(box *box, float split)
+void source(view *view)
 {
-  uint16_t size;
-  int otherBox = 0;
+  char *path = commandArgument;
+  long bad;
 
-  // First some sanity checks.
-  if (0.0 > split)
+  if (!path)
   {
-    // TODO - put this in the status line, or just silently fail.  Also, better message.  lol
-    fprintf(stderr, "User is crazy.\n");
+    promptFor(view, "Source: ", source);
     return;
   }
-  else if (1.0 <= split)  // User meant to unsplit, and it may already be split.
+  // The script's commands use commandArgument to.
+  path = xstrdup(path);
+  bad = sourceFile(path);
+  // Whatever the script did might be to a different box.
+  view = currentBox->view;
+  if (bad)
   {
-    // Actually, this means that the OTHER sub box gets deleted.
-    if (box->parent)
-    {
-      if (box == box->parent->sub1)
-        deleteBox(box->parent->sub2->view);
-      else
-        deleteBox(box->parent->sub1->view);
-    }
+    free(view->statusLine);
+    if (0 > bad)
+      view->statusLine = xmprintf("Can't source %s - %s", path, strerror(errno));
+    else
+      view->statusLine = xmprintf("%ld line%s of %s where not commands", bad, (1 == bad) ? "" : "s", path);
+  }
+  free(path);
+}
+
+// Keyboard macros remember the commands the keys turned into, and what was typed, not the keys.  So playing them
+// back doesn't go through handle_keys(), or even looking up the commands, and it's all one undo, drawn once.
+
+struct macroStep
+{
+  eventHandler handler;	// The command, or NULL if it's typed text.
+  char *text;		// The command's argument, or the typed text.
+  uint32_t length;
+  long count;		// The count typed before the command.
+};
+
+struct macro
+{
+  struct macroStep *steps;
+  uint32_t count, size;
+};
+
+#define MACRO_DEPTH  16	// Macros can play macros, but not forever.
+
+static struct macro macros[27];	// vi's a to z, then emacs' one.
+static struct macro *recording;	// What's being recorded, or NULL.
+static struct macro *lastPlayed;
+static eventHandler keyHandler;	// What gets the next key as it's argument, like vi's q and @ do.
+static long keyCount;	// The count it was given.
+
+// Ask for the next key as the argument of handler, which gets the count to.
+void keyFor(view *view, char *status, eventHandler handler)
+{
+  free(view->statusLine);
+  view->statusLine = xstrdup(status);
+  keyHandler = handler;
+  keyCount = countTake();
+}
+
+// Add a step to the macro being recorded, typed text gets added to the last step if that's typed text to.
+void macroAdd(eventHandler handler, char *text, uint32_t length, long count)
+{
+  struct macroStep *step = recording->count ? &(recording->steps[recording->count - 1]) : NULL;
+
+  if (!handler && step && !step->handler)
+  {
+    step->text = xrealloc(step->text, step->length + length + 1);
+    memcpy(&(step->text[step->length]), text, length);
+    step->text[step->length += length] = '\0';
     return;
   }
-  else if (0.0 < split)  // This is the normal case, so do nothing.
+  if (recording->count == recording->size)
+    recording->steps = xrealloc(recording->steps, (recording->size += 16) * sizeof(struct macroStep));
+  step = &(recording->steps[recording->count++]);
+  step->handler = handler;
+  step->text = text ? xstrndup(text, length) : NULL;
+  step->length = length;
+  step->count = count;
+}
+
+void macroFree(struct macro *macro)
+{
+  while (macro->count)
+    free(macro->steps[--macro->count].text);
+}
+
+void macroStart(view *view, struct macro *macro, int append)
+{
+  if (!append)
+    macroFree(macro);
+  recording = macro;
+  free(view->statusLine);
+  view->statusLine = xstrdup("Recording");
+}
+
+void macroStop(view *view)
+{
+  free(view->statusLine);
+  if (recording)
+    view->statusLine = xmprintf("Recorded %u step%s", recording->count, (1 == recording->count) ? "" : "s");
+  else
+    view->statusLine = xstrdup("Not recording");
+  recording = NULL;
+}
+
+// Put what the keys typed in, like the key handler does.
+void typeText(view *view, char *text, uint32_t len)
+{
+  if (overWriteMode)
+    editDelete(view, (strlen(&(view->line->line[view->iX])) < len) ? strlen(&(view->line->line[view->iX])) : len, UNDO_TYPED, NULL);
+  editInsert(view, text, len, UNDO_TYPED);
+  view->oW = formatLine(view, view->line->line, &(view->output));
+  moveCursorRelative(view, len, 0, 0, 0);
+  updateLine(view);
+  isearchTyped();
+}
+
+// Play macro count times, all in one undo group, drawn once at the end.  It stops early if going around again
+// didn't move or change anything, it would be the same next time as well.
+void macroPlay(view *view, struct macro *macro, long count)
+{
+  struct macroStep *step;
+  uint32_t i;
+  long n;
+
+  if (!macro->count)
   {
+    free(view->statusLine);
+    view->statusLine = xstrdup("Nothing recorded");
+    return;
   }
-  else      // User meant to delete this, zero split.
+  if (macro == recording)
   {
-      deleteBox(box->view);
-      return;
+    free(view->statusLine);
+    view->statusLine = xstrdup("Can't play a macro while recording it");
+    return;
   }
-  if (box->flags & BOX_HSPLIT)
-    size = box->H;
-  else
-    size = box->W;
-  if (6 > size)    // Is there room for 2 borders for each sub box and one character of content each?
-        // TODO - also should check the contents minimum size.
-        // No need to check the no border case, that's only for full screen.
-        // People using terminals smaller than 6 characters get what they deserve.
+  if (MACRO_DEPTH <= macroDepth)
   {
-    // TODO - put this in the status line, or just silently fail.
-    fprintf(stderr, "Box is too small to split.\n");
+    free(view->statusLine);
+    view->statusLine = xstrdup("Macros playing macros to deep");
     return;
   }
 
-  // Note that a split box is actually three boxes.  The parent, which is not drawn, and the two subs, which are.
-  // Based on the assumption that there wont be lots of boxes, this keeps things simple.
-  // It's possible that the box has already been split, and this is called just to update the split.
-  box->split = split;
-  if (NULL == box->sub1)  // If not split already, do so.
+  lastPlayed = macro;
+  macroDepth++;
+  undoHeld++;
+  drawHold();
+  view->content->undo.group = 1;
+  for (n = 0; n < count; n++)
   {
-    box->sub1 = xzalloc(sizeof(struct _box));
-    box->sub2 = xzalloc(sizeof(struct _box));
-    cloneBox(box, box->sub1);
-    cloneBox(box, box->sub2);
-    if (box->flags & BOX_HSPLIT)
+    struct content *content = currentBox->view->content;
+    uint32_t cY = currentBox->view->cY, cX = currentBox->view->cX, length = content->lines.length;
+    size_t done = content->undo.length;
+
+    for (i = 0; i < macro->count; i++)
     {
-      // Split the boxes in the middle of the content.
-      box->sub2->view->offsetY += (box->H * box->split) - 2;
-      // Figure out which sub box the cursor will be in, then update the cursor in the other box.
-      if (box->sub1->view->cY < box->sub2->view->offsetY)
-        box->sub2->view->cY = box->sub2->view->offsetY;
-      else
+      step = &(macro->steps[i]);
+      view = commandMode ? commandLine : currentBox->view;
+      if (step->handler)
       {
-        box->sub1->view->cY = box->sub2->view->offsetY - 1;
-        otherBox = 1;
+        commandArgument = step->text;
+        countHandler(view, step->handler, step->count);
+        commandArgument = NULL;
       }
-    }
-    else
-    {
-      // Split the boxes in the middle of the content.
-      box->sub2->view->offsetX += (box->W * box->split) - 2;
-      // Figure out which sub box the cursor will be in, then update the cursor in the other box.
-      if (box->sub1->view->cX < box->sub2->view->offsetX)
-        box->sub2->view->cX = box->sub2->view->offsetX;
       else
-      {
-        box->sub1->view->cX = box->sub2->view->offsetX - 1;
-        otherBox = 1;
-      }
+        typeText(view, step->text, step->length);
+      if (searching)
+        scriptSettle();
     }
+    trimBlocks(currentBox->view->content);
+    view = currentBox->view;
+    if ((view->content == content) && (view->cY == cY) && (view->cX == cX) && (content->lines.length == length)
+      && (content->undo.length == done))
+      break;
   }
+  drawRelease();
+  undoHeld--;
+  macroDepth--;
+}
 
-  if ((currentBox == box) && (box->sub1))
+// Which of a to z a key, or what's typed after a command, starts with, or -1.
+int macroName(char *text)
+{
+  return (isalpha(*text) && ((!text[1]) || (' ' == text[1]))) ? tolower(*text) - 'a' : -1;
+}
+
+// A count after the macro name, or the count typed before the command, or 1.
+long macroCount(char *text)
+{
+  long count = countTake();
+
+  while (text && *text && !isdigit(*text))
+    text++;
+  if (text && *text)
+    count = atol(text);
+
+  return (0 < count) ? count : 1;
+}
+
+// vi's q starts recording into the named buffer given by the next key, capitals add to it.  q again stops.
+void viRecord(view *view)
+{
+  if (recording)
+    macroStop(view);
+  else if (!commandArgument)
+    keyFor(view, "Record into which buffer?", viRecord);
+  else if (-1 != macroName(commandArgument))
+    macroStart(view, &(macros[macroName(commandArgument)]), isupper(*commandArgument));
+  else
   {
-    if (otherBox)
-      currentBox = box->sub2;
-    else
-      currentBox = box->sub1;
+    free(view->statusLine);
+    view->statusLine = xstrdup("Record into which buffer?  A letter from a to z");
   }
+}
 
-  // Start the recursive recalculation of all the sub boxes.
-  calcBoxes(box);
-  drawBoxes(box);
+// vi's @ plays the named buffer given by the next key, @@ the last one played again.
+void viPlay(view *view)
+{
+  if (!commandArgument)
+    keyFor(view, "Play which buffer?", viPlay);
+  else if (-1 != macroName(commandArgument))
+    macroPlay(view, &(macros[macroName(commandArgument)]), macroCount(commandArgument + 1));
+  else if (('@' == *commandArgument) && lastPlayed)
+    macroPlay(view, lastPlayed, macroCount(commandArgument + 1));
+  else
+  {
+    free(view->statusLine);
+    view->statusLine = xstrdup("Play which buffer?  A letter from a to z");
+  }
 }
 
-// TODO - Might be better to just have a double linked list of boxes, and traverse that instead.
-//          Except that leaves a problem when deleting boxes, could end up with a blank space.
-void switchBoxes(view *view)
+void startMacro(view *view)
 {
-  box *box = view->box;
+  if (recording)
+  {
+    free(view->statusLine);
+    view->statusLine = xstrdup("Already defining a keyboard macro");
+  }
+  else
+    macroStart(view, &(macros[26]), 0);
+}
 
-  // The assumption here is that box == currentBox.
-  struct _box *oldBox = currentBox;
-  struct _box *thisBox = box;
-  int backingUp = 0;
+void playMacro(view *view)
+{
+  macroPlay(view, &(macros[26]), macroCount(commandArgument));
+}
 
-  // Depth first traversal.
-  while ((oldBox == currentBox) && (thisBox->parent))
+// Emacs' ^U gives the next command a count of four, or four times the count so far, or the digits typed after it.
+void universalArgument(view *view)
+{
+  typedCount = (commandCount ? commandCount : 1) * 4;
+  if (COUNT_MAX < typedCount)
+    typedCount = COUNT_MAX;
+  commandCount = 0;
+  typedCounting = 1;
+  free(view->statusLine);
+  view->statusLine = xmprintf("C-u %ld", typedCount);
+}
+
+// Point any views at old to new instead.
+void replaceViewLine(box *box, struct line *old, struct line *new)
+{
+  if (box->sub1)
   {
-    if (thisBox == thisBox->parent->sub1)
+    replaceViewLine(box->sub1, old, new);
+    replaceViewLine(box->sub2, old, new);
+  }
+  else if (box->view && (box->view->line == old))
+  {
+    box->view->line = new;
+    box->view->oW = formatLine(box->view, new->line, &(box->view->output));
+  }
+}
+
+// A pipe can be bigger than memory, so once there's more than -b kilobytes of it, the oldest blocks are written to a
+// temporary file, and mapped back in from there.  Then the kernel can page them out, and back in if they get shown.
+// If that can't be done, say so, and keep it all in memory from then on.
+void spillBlocks(struct content *content)
+{
+  long page = sysconf(_SC_PAGESIZE);
+  char *status;
+
+  // Leave the newest block alone, it's the one being looked at most likely.
+  while ((content->resident > content->budget) && ((content->spillBlock + 1) < content->blockCount))
+  {
+    struct block *block = &(content->blocks[content->spillBlock + 1]);
+    struct line *line, *end = blockEnd(content, content->spillBlock + 1);
+    off_t len = block->size + 1;
+    char *map;
+
+    errno = EIO;
+    if (-1 == content->spill)
     {
-      if (backingUp && (thisBox->parent))
-        currentBox = thisBox->parent->sub2;
-      else if (thisBox->sub1)
-        currentBox = thisBox->sub1;
-      else
-        currentBox = thisBox->parent->sub2;
+      char *name = xmprintf("%s/boxesXXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+
+      if (-1 != (content->spill = mkstemp(name)))
+        unlink(name);
+      free(name);
     }
-    else if (thisBox == thisBox->parent->sub2)
+    // Lines cut or copied out of it still point at the data, so it stays where it is.
+    if (block->flags & BLOCK_PINNED)
     {
-      thisBox = thisBox->parent;
-      backingUp = 1;
+      content->spillBlock++;
+      continue;
     }
+    if ((-1 == content->spill) || (pwrite(content->spill, block->data, len, content->spilled) != len)
+      || (MAP_FAILED == (map = mmap(NULL, len, PROT_READ, MAP_SHARED, content->spill, content->spilled))))
+    {
+      status = xmprintf("Can't spill input to a temporary file - %s, keeping it all in memory", strerror(errno));
+      statusContent(rootBox, content, status);
+      free(status);
+      content->budget = 0;
+      break;
+    }
+
+    // Point the lines at the copy, unless they have been changed, then they have their own.
+    for (line = block->first; line && (end != line); line = line->next)
+      if ((!line->length) && (line->line >= block->data) && (line->line < (block->data + len)))
+        line->line = map + (line->line - block->data);
+    content->generation++;
+    free(block->data);
+    block->data = map;
+    block->flags |= BLOCK_MAPPED;
+    content->spilled += ((len + page - 1) / page) * page;  // mmap() wants page aligned offsets.
+    content->resident -= block->size;
+    content->spillBlock++;
   }
+}
 
-  // If we have not found the next box to move to, move back to the beginning.
-  if (oldBox == currentBox)
-    currentBox = rootBox;
+// Check if any view of content has it's cursor in block b.
+int viewingBlock(box *box, struct content *content, uint32_t b)
+{
+  if (!box)
+    return 0;
+  if (box->sub1)
+    return viewingBlock(box->sub1, content, b) || viewingBlock(box->sub2, content, b);
+  return box->view && (box->view->content == content) && box->view->line && (box->view->line->block == b);
+}
 
-  // If we ended up on a parent box, go to it's first sub.
-  while (currentBox->sub1)
-    currentBox = currentBox->sub1;
+// Evict the least recently used clean blocks, until content fits in it's budget.  Not while following the file
+// though, it's changing under us.  Nor while a search is part way through walking the lines.
+void trimBlocks(struct content *content)
+{
+  uint32_t b, next;
 
-  // Just redraw them all.
-  drawBoxes(rootBox);
+  // Until spliced in lines are saved, which lines are in a block isn't known well enough to throw it away.
+  if ((!content->budget) || (content->resident <= content->budget) || (content->flags & (CONTENT_FOLLOW | CONTENT_SPLICED))
+    || (searching && searching->walking && (searching->view->content == content)) || !pageFile(content))
+    return;
+  for (b = content->oldest; b && (content->resident > content->budget); b = next)
+  {
+    next = content->blocks[b].newer;
+    if ((!(content->blocks[b].flags & (BLOCK_DIRTY | BLOCK_MAPPED | BLOCK_PINNED))) && !viewingBlock(rootBox, content, b))
+      pageOut(content, b);
+  }
 }
 
-// TODO - It might be better to do away with this bunch of single line functions
-//        and map script commands directly to lower functions.
-//        How to deal with the various argument needs?
-//        Might be where we can re use the toybox argument stuff.
-
-void halveBoxHorizontally(view *view)
+// Show the lines added to the end of content, from line number before on.  If pin is set, views that were on the
+// last line move to the new last line.  The terminal can scroll full width boxes for us, then only the new lines
+// get sent, instead of the whole box.  Returns non zero if anything was drawn.
+int showAppended(box *box, struct content *content, uint32_t before, int pin)
 {
-  view->box->flags |= BOX_HSPLIT;
-  splitBox(view->box, 0.5);
-}
+  view *view = box->view;
+  int drawn = 0;
+
+  if (box->sub1)
+  {
+    drawn = showAppended(box->sub1, content, before, pin);
+    drawn |= showAppended(box->sub2, content, before, pin);
+  }
+  else if (view && (view->content == content) && view->filter)
+    filterMore(view);
+  else if (view && (view->content == content))
+  {
+    if (pin && ((view->cY + 1) >= before))
+    {
+      long oY = view->offsetY, nY = (long) content->lines.length - view->H;
+      int scrolled = 0;
+
+      if ((nY > oY) && ((nY - oY) < view->H) && !view->offsetX && !box->X && (box->W == rootBox->W))
+      {
+        printf("\x1B[%d;%dr\x1B[%d;1H", view->Y + 1, view->Y + view->H, view->Y + view->H);
+        for (scrolled = nY - oY; scrolled; scrolled--)
+          putchar('\n');
+        printf("\x1B[r");
+        view->offsetY = nY;
+        scrolled = 1;
+      }
+      moveCursorAbsolute(view, 0, content->lines.length - 1, 0, 0);
+      if (scrolled || (oY == view->offsetY))
+        drawBoxLines(box, before);
+      drawn = 1;
+    }
+    else if ((view->offsetY + view->H) > before)
+    {
+      drawBoxLines(box, before);
+      drawn = 1;
+    }
+  }
 
-void halveBoxVertically(view *view)
-{
-  view->box->flags &= ~BOX_HSPLIT;
-  splitBox(view->box, 0.5);
+  return drawn;
 }
 
-void switchMode(view *view)
+// Show what readBlock() added to content since it had before lines.
+void showMore(struct content *content, uint32_t before)
 {
-  currentBox->view->mode++;
-  // Assumes that modes will always have a key mapping, which I think is a safe bet.
-  if (NULL == currentBox->view->content->context->modes[currentBox->view->mode].keys)
-    currentBox->view->mode = 0;
-  commandMode = currentBox->view->content->context->modes[currentBox->view->mode].flags & 1;
-}
+  struct line *blank = content->lines.next;
 
-void leftChar(view *view)
-{
-  moveCursorRelative(view, -1, 0, 0, 0);
+  if (content->lines.length == before)
+    return;
+  // The first lines replace the blank line that addView() started off with.
+  if ((!blank->block) && (content->tail != blank))
+  {
+    replaceViewLine(rootBox, blank, blank->next);
+    freeLine(content, blank);
+    before = 0;
+  }
+  if (content->budget && !content->path)
+    spillBlocks(content);
+  if (showAppended(rootBox, content, before, content->flags & CONTENT_FOLLOW))
+    updateLine(currentBox->view);
 }
 
-void rightChar(view *view)
+// The main loop calls this when there's more to read from the pipe.
+void readPipe(struct watcher *watcher)
 {
-  moveCursorRelative(view, 1, 0, 0, 0);
+  struct content *content = watcher->data;
+  uint32_t before = content->lines.length;
+
+  if (0 >= readBlock(content))
+  {
+    delWatcher(content->fd, content);
+    close(content->fd);
+    content->fd = -1;
+  }
+  showMore(content, before);
 }
 
-void upLine(view *view)
+// Follow mode, like tail -f.  inotify tells us when the file changes, then we read from where we left off.  If the
+// file gets truncated, we start again from the beginning of it, and if it gets rotated, the new one gets opened.
+
+// Whatever partial line is left over is all there is of that line, so it gets a block of it's own.
+void followFlush(struct content *content)
 {
-  moveCursorRelative(view, 0, -1, 0, 0);
+  if (content->partialLen)
+  {
+    addBlock(content, content->loaded, xrealloc(content->partial, content->partialLen + 1), content->partialLen);
+    content->loaded += content->partialLen;
+    content->resident += content->partialLen;
+    content->partial = NULL;
+    content->partialLen = 0;
+  }
 }
 
-void downLine(view *view)
+int followOpen(struct content *content)
 {
-  moveCursorRelative(view, 0, 1, 0, 0);
+  int fd = open(content->path, O_RDONLY | O_CLOEXEC);
+
+  if (-1 == fd)
+    return 0;
+  if (-1 != content->fd)
+    close(content->fd);
+  content->fd = fd;
+  inotify_add_watch(content->notify, content->path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+  return 1;
 }
 
-void upPage(view *view)
+// Put the views of content back at the top, on it's only line.
+void followViews(box *box, struct content *content, struct line *line)
 {
-  moveCursorRelative(view, 0, 0 - (view->H - 1), 0, 0 - (view->H - 1));
+  view *view = box->view;
+
+  if (box->sub1)
+  {
+    followViews(box->sub1, content, line);
+    followViews(box->sub2, content, line);
+  }
+  else if (view && (view->content == content))
+  {
+    view->line = line;
+    view->cX = view->iX = view->offsetX = view->cY = view->offsetY = view->marked = 0;
+    view->oW = formatLine(view, line->line, &(view->output));
+    if (view->filter)
+      filterRestart(view);
+    drawBox(box);
+  }
 }
 
-void downPage(view *view)
+// The file got truncated, so what we had of it is gone, even the evicted blocks, which can't be read back in now.
+// Throw it all away, and start again from the beginning.  Lines cut or copied out of the old blocks might still
+// point into their data, so that stays, but the blocks have no lines left, so saving writes nothing for them.
+void followRestart(struct content *content)
 {
-  moveCursorRelative(view, 0, view->H - 1, 0, view->H - 1);
+  struct line *line, *next, *blank = addLine(NULL, NULL, "\0", 0);
+  uint32_t b;
+  char *status;
+
+  if (searching && (searching->view->content == content))
+    searchStop(searching->view);
+  for (line = content->lines.next; &(content->lines) != line; line = next)
+  {
+    next = line->next;
+    freeText(line);
+    free(line);
+  }
+  for (b = 1; b <= content->blockCount; b++)
+  {
+    struct block *block = &(content->blocks[b]);
+
+    lruRemove(content, b);
+    if (block->data && !(block->flags & (BLOCK_PINNED | BLOCK_MAPPED)))
+    {
+      content->resident -= block->size;
+      free(block->data);
+      block->data = NULL;
+    }
+    block->first = NULL;
+    block->lines = 0;
+    block->flags |= BLOCK_DIRTY;
+  }
+  content->generation++;
+  blank->next = blank->prev = &(content->lines);
+  content->lines.next = content->lines.prev = blank;
+  content->lines.length = 1;
+  memset(content->marks, 0, sizeof(content->marks));
+  content->undo.length = content->undo.at = content->undo.last = 0;
+  content->undo.group = 1;
+  journalReset(content);
+
+  free(content->partial);
+  content->partial = NULL;
+  content->partialLen = 0;
+  content->tail = NULL;
+  content->loaded = 0;
+  lseek(content->fd, 0, SEEK_SET);
+  if (-1 != content->page)
+    close(content->page);
+  content->page = -1;
+
+  followViews(rootBox, content, blank);
+  status = xmprintf("%s was truncated, following it from the start", content->path);
+  statusContent(rootBox, content, status);
+  free(status);
 }
 
-void endOfLine(view *view)
+// The file got rotated, so the blocks we have are in the old one, at offsets that mean nothing in the new one.  Read
+// back in what was evicted while the old one is still open, and mark them all changed, so they stay in memory, and
+// saving writes them out from their lines.
+void followRotate(struct content *content)
 {
-  moveCursorAbsolute(view, strlen(view->prompt) + view->oW, view->cY, 0, 0);
+  uint32_t b;
+
+  if (searching && (searching->view->content == content))
+    searchStop(searching->view);
+  for (b = 1; b <= content->blockCount; b++)
+  {
+    struct block *block = &(content->blocks[b]);
+
+    if (block->first && isStub(content, block->first))
+      pageIn(content, block->first);
+    block->flags |= BLOCK_DIRTY;
+  }
+  if (-1 != content->page)
+    close(content->page);
+  content->page = -1;
 }
 
-void startOfLine(view *view)
+// The main loop calls this when something happened to the file, or the directory it's in.
+void followFile(struct watcher *watcher)
 {
-  // TODO - add the advanced editing "smart home".
-  moveCursorAbsolute(view, strlen(view->prompt), view->cY, 0, 0);
+  struct content *content = watcher->data;
+  struct line *tail = content->tail;
+  uint32_t before = content->lines.length;
+  off_t loaded = content->loaded, partialLen = content->partialLen;
+  struct stat st, now;
+
+  // We don't care what happened, only that something did, so just empty the queue.
+  while (0 < read(content->notify, toybuf, sizeof(toybuf)))
+    ;
+
+  drawHold();
+  memset(&st, 0, sizeof(st));
+  if (-1 != content->fd)
+  {
+    while (0 < readBlock(content))
+      ;
+    if (!fstat(content->fd, &st) && (st.st_size < (content->loaded + content->partialLen)))
+    {
+      followRestart(content);
+      tail = NULL;
+      before = content->lines.length;
+      loaded = -1;
+      while (0 < readBlock(content))
+        ;
+    }
+  }
+
+  // The file was moved or deleted, and a new one is in it's place.  We already read the rest of the old one.
+  if (!stat(content->path, &now) && ((-1 == content->fd) || (now.st_ino != st.st_ino) || (now.st_dev != st.st_dev)))
+  {
+    followFlush(content);
+    followRotate(content);
+    if (followOpen(content))
+    {
+      // What gets read from now on is in the new one, so that's where evicted blocks come back from.
+      content->page = dup(content->fd);
+      content->loaded = 0;
+      while (0 < readBlock(content))
+        ;
+    }
+  }
+
+  if ((loaded == content->loaded) && (partialLen == content->partialLen))
+  {
+    drawRelease();
+    return;
+  }
+
+  // Show the partial line at the end, replacing the last one.
+  if (content->partialLen)
+  {
+    struct line *line = addLine(NULL, NULL, content->partial, content->partialLen);
+
+    line->next = &(content->lines);
+    line->prev = content->lines.prev;
+    content->lines.prev->next = line;
+    content->lines.prev = line;
+    content->lines.length++;
+    content->tail = line;
+  }
+  else
+    content->tail = NULL;
+  if (tail)
+  {
+    replaceViewLine(rootBox, tail, tail->next);
+    searchReplaceLine(content, tail, tail->next);
+    freeLine(content, tail);
+    before--;
+  }
+  showMore(content, before);
+  // Starting again shows the status, even if nothing new turned up yet.
+  if (-1 == loaded)
+    updateLine(currentBox->view);
+  drawRelease();
 }
 
-void splitLine(view *view)
+// Start watching the end of the file.  Returns 0 if that can't be done.
+int followStart(struct content *content)
 {
-  // TODO - should move this into mooshLines().
-  addLine(view->content, view->line, &(view->line->line[view->iX]), 0);
-  view->line->line[view->iX] = '\0';
-  moveCursorAbsolute(view, 0, view->cY + 1, 0, 0);
-  if (view->box)
-    drawBox(view->box);
+  struct block *block = &(content->blocks[content->blockCount]);
+  struct line *line = prevLine(content, &(content->lines));
+  char *dir, *slash;
+
+  if (-1 == (content->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)))
+    return 0;
+
+  // Watch the directory as well, to notice the file coming back after it gets rotated.
+  dir = xstrdup(content->path);
+  if ((slash = strrchr(dir, '/')))
+    slash[dir == slash] = '\0';
+  else
+    strcpy(dir, ".");
+  inotify_add_watch(content->notify, dir, IN_CREATE | IN_MOVED_TO);
+  free(dir);
+
+  // A last line without a newline might still be getting written, so it becomes the partial line.
+  if (content->blockCount && block->size && block->data[block->size - 1] && (line->block == content->blockCount)
+    && !line->length)
+  {
+    content->partialLen = strlen(line->line);
+    content->partial = xmalloc(content->partialLen);
+    memcpy(content->partial, line->line, content->partialLen);
+    ownLine(line);
+    if (block->first == line)
+      block->first = NULL;
+    line->block = 0;
+    block->lines--;
+    block->size -= content->partialLen;
+    content->loaded -= content->partialLen;
+    content->tail = line;
+  }
+
+  if (followOpen(content))
+    lseek(content->fd, content->loaded + content->partialLen, SEEK_SET);
+  addWatcher(content->notify, followFile, content);
+  return 1;
 }
 
-void deleteChar(view *view)
+// Follow the end of the file as it grows, or stop following it.
+void followMode(view *view)
 {
-  // TODO - should move this into mooshLines().
-  // If we are at the end of the line, then join this and the next line.
-  if (view->oW == view->cX)
+  struct content *content = view->content;
+  struct line *line;
+
+  if (content->flags & CONTENT_FOLLOW)
   {
-    // Only if there IS a next line.
-    if (&(view->content->lines) != view->line->next)
+    content->flags &= ~CONTENT_FOLLOW;
+    if (-1 != content->notify)
     {
-      mooshStrings(view->line, view->line->next->line, view->iX, 1, !overWriteMode);
-      view->line->next->line = NULL;
-      freeLine(view->content, view->line->next);
-      // TODO - should check if we are on the last page, then deal with scrolling.
-      if (view->box)
-        drawBox(view->box);
+      delWatcher(content->notify, content);
+      close(content->notify);
+      content->notify = -1;
+      close(content->fd);
+      content->fd = -1;
+      // Leave the partial line showing, but it's an ordinary line now.
+      free(content->partial);
+      content->partial = NULL;
+      content->partialLen = 0;
+      if ((line = content->tail))
+        line->block = content->blockCount;
+      if (line && content->blockCount)
+      {
+        if (!content->blocks[line->block].first)
+          content->blocks[line->block].first = line;
+        dirtyLine(content, line);
+      }
+      content->tail = NULL;
     }
+    free(view->statusLine);
+    view->statusLine = NULL;
+    updateLine(view);
+    return;
   }
-  else
-    mooshStrings(view->line, NULL, view->iX, 1, !overWriteMode);
+
+  content->flags |= CONTENT_FOLLOW;
+  // Pipes get read as they arrive anyway, and files still loading get followed once they are loaded.
+  if (content->path && (-1 == content->fd) && !followStart(content))
+  {
+    content->flags &= ~CONTENT_FOLLOW;
+    free(view->statusLine);
+    view->statusLine = xmprintf("Can't follow %s - %s", content->path, strerror(errno));
+    updateLine(view);
+    return;
+  }
+  free(view->statusLine);
+  view->statusLine = xmprintf("Following %s", content->path ? content->path : "input");
+  moveCursorAbsolute(view, 0, content->lines.length - 1, 0, 0);
+  updateLine(view);
 }
 
-void backSpaceChar(view *view)
+// Quitting properly means the journals of unsaved changes are not needed.
+void closeJournals(box *box)
 {
-  if (moveCursorRelative(view, -1, 0, 0, 0))
-    deleteChar(view);
+  if (box->sub1)
+  {
+    closeJournals(box->sub1);
+    closeJournals(box->sub2);
+  }
+  else if (box->view)
+    journalStop(box->view->content, 1);
 }
 
-void saveContent(view *view)
+// Set the status line of all the views of content.
+void statusContent(box *box, struct content *content, char *status)
 {
-  saveFile(view->content);
+  if (box->sub1)
+  {
+    statusContent(box->sub1, content, status);
+    statusContent(box->sub2, content, status);
+  }
+  else if (box->view && (box->view->content == content))
+  {
+    free(box->view->statusLine);
+    box->view->statusLine = status ? xstrdup(status) : NULL;
+  }
 }
 
-void executeLine(view *view)
+// The main loop calls this when it's idle, to load another block of the file.
+void loadMore(struct watcher *watcher)
 {
-  struct line *result = view->line;
-
-  // Don't bother doing much if there's nothing on this line.
-  if (result->line[0])
+  struct content *content = watcher->data;
+  uint32_t before = content->lines.length;
+  int percent = content->st.st_size ? (content->loaded * 100) / content->st.st_size : 100;
+  char *status;
+
+  loadLines(content, before);
+  showMore(content, before);
+  if (content->flags & CONTENT_LOADING)
   {
-    doCommand(currentBox->view, result->line);
-    // If we are not at the end of the history contents.
-    if (&(view->content->lines) != result->next)
+    // Only bother updating the status line when the percentage changes.
+    if (percent != (content->loaded * 100) / content->st.st_size)
     {
-      struct line *line = view->content->lines.prev;
-
-      // Remove the line first.
-      result->next->prev = result->prev;
-      result->prev->next = result->next;
-      // Check if the last line is already blank, then remove it.
-      if ('\0' == line->line[0])
-      {
-        freeLine(view->content, line);
-        line = view->content->lines.prev;
-      }
-      // Then add it to the end.
-      result->next = line->next;
-      result->prev = line;
-      line->next->prev = result;
-      line->next = result;
-      view->cY = view->content->lines.length - 1;
+      status = xmprintf("Loading %s %d%%", content->path, (int) ((content->loaded * 100) / content->st.st_size));
+      statusContent(rootBox, content, status);
+      free(status);
+      updateLine(currentBox->view);
     }
-    moveCursorAbsolute(view, 0, view->content->lines.length, 0, 0);
-    // Make sure there is one blank line at the end.
-    if ('\0' != view->line->line[0])
+    return;
+  }
+
+  delWatcher(-1, content);
+  statusContent(rootBox, content, NULL);
+  // Follow mode waits until it's all loaded.
+  if (content->flags & CONTENT_FOLLOW)
+  {
+    if (followStart(content))
+      status = xmprintf("Following %s", content->path);
+    else
     {
-      endOfLine(view);
-      splitLine(view);
+      content->flags &= ~CONTENT_FOLLOW;
+      status = xmprintf("Can't follow %s - %s", content->path, strerror(errno));
     }
+    statusContent(rootBox, content, status);
+    free(status);
   }
-
-  saveFile(view->content);
+  updateLine(currentBox->view);
 }
 
-void quit(view *view)
+// The indexing threads poke the main loop now and then, to show how far they got, and when they are done.
+void indexProgress(struct watcher *watcher)
 {
-  handle_keys_quit();
-}
+  struct content *content = watcher->data;
+  struct indexing *indexing = content->indexing;
+  uint32_t before = content->lines.length;
+  off_t done = indexing->start;
+  int i, finished = 0;
+  char *status;
+
+  while (0 < read(indexing->wake[0], toybuf, sizeof(toybuf)))
+    ;
+  for (i = 0; i < indexing->count; i++)
+  {
+    done += __atomic_load_n(&(indexing->threads[i].done), __ATOMIC_RELAXED);
+    finished += __atomic_load_n(&(indexing->threads[i].finished), __ATOMIC_ACQUIRE);
+  }
+  if (finished == indexing->count)
+  {
+    indexFinish(content);
+    showMore(content, before);
+    return;
+  }
 
-void nop(view *view)
-{
-  // 'tis a nop, don't actually do anything.
+  status = xmprintf("Loading %s %d%%", content->path, (int) ((done * 100) / content->st.st_size));
+  statusContent(rootBox, content, status);
+  free(status);
+  updateLine(currentBox->view);
 }
 
 
@@ -1672,16 +9046,90 @@ static int handleEvent(long extra, struct keyevent *event)
       break;
     }
 
+    case HK_FD :
+    {
+      struct watcher *watcher;
+
+      for (watcher = watchers; watcher; watcher = watcher->next)
+      {
+        if (watcher->fd == event->params[0])
+        {
+          watcher->handler(watcher);
+          break;
+        }
+      }
+      break;
+    }
+
+    case HK_TIMER :
+    {
+      struct watcher *watcher, *next;
+      int busy = 0;
+
+      // Give each background job a turn, they might delete themselves.
+      for (watcher = watchers; watcher; watcher = next)
+      {
+        next = watcher->next;
+        if (-1 == watcher->fd)
+          watcher->handler(watcher);
+      }
+      for (watcher = watchers; watcher; watcher = watcher->next)
+        if (-1 == watcher->fd)
+          busy = 1;
+      return busy;
+    }
+
     case HK_KEYS :
     {
       struct _view *view = (struct _view *) extra;		// Though we pretty much stomp on this straight away.
-      struct keyCommand *commands = currentBox->view->content->context->modes[currentBox->view->mode].keys;
+      struct mode *mode = &(currentBox->view->content->context->modes[currentBox->view->mode]);
+      struct keyCommand *commands = mode->keys;
+      long count = typedCount;
       int j, l = strlen(event->sequence);
 
       // Coz things might change out from under us, find the current view.
       if (commandMode)	view = commandLine;
       else		view = currentBox->view;
 
+      // A command asked for this key as it's argument, the recorded command gets it to.
+      if (keyHandler)
+      {
+        eventHandler handler = keyHandler;
+        struct macroStep *step = (recording && recording->count) ? &(recording->steps[recording->count - 1]) : NULL;
+
+        keyHandler = NULL;
+        if (step && (step->handler == handler) && !step->text)
+        {
+          step->text = xstrdup(event->sequence);
+          step->length = l;
+        }
+        view->content->undo.group = 1;
+        drawHold();
+        commandArgument = event->sequence;
+        commandCount = keyCount;
+        handler(view);
+        commandCount = 0;
+        commandArgument = NULL;
+        updateLine(view);
+        drawRelease();
+        return 1;
+      }
+
+      // Digits before a command are a count for it, in modes that have counts, or after emacs' ^U.
+      if ((!event->isTranslated) && (1 == l) && isdigit(event->sequence[0])
+        && (typedCounting || ((mode->flags & 2) && ('0' != event->sequence[0]))))
+      {
+        if (2 != typedCounting)
+          typedCount = 0;
+        if (COUNT_MAX < (typedCount = typedCount * 10 + (event->sequence[0] - '0')))
+          typedCount = COUNT_MAX;
+        typedCounting = 2;
+        free(currentBox->view->statusLine);
+        currentBox->view->statusLine = xmprintf("Count %ld", typedCount);
+        updateLine(view);
+        return 1;
+      }
+
       // Search for a key sequence bound to a command.
       for (j = 0; commands[j].key; j++)
       {
@@ -1692,7 +9140,24 @@ static int handleEvent(long extra, struct keyevent *event)
             return 0;
           else
           {
-            doCommand(view, commands[j].command);
+            struct macro *was = recording;
+
+            typedCount = 0;
+            typedCounting = 0;
+            doCommand(view, commands[j].command, count);
+            // Only what's done while recording is recorded, not what started or stopped it.  ^U is part of the count.
+            if (was && (recording == was))
+            {
+              struct function *function;
+              char *arg;
+
+              if ((function = findCommand(view, commands[j].command, &arg)) && function->handler
+                && (universalArgument != function->handler))
+                macroAdd(function->handler, arg, arg ? strlen(arg) : 0, count);
+            }
+            isearchTyped();
+            // Evict blocks here, not in the middle of a command that might be using them.
+            trimBlocks(currentBox->view->content);
             return 1;
           }
         }
@@ -1701,14 +9166,27 @@ static int handleEvent(long extra, struct keyevent *event)
       // See if it's ordinary keys.
       // NOTE - with vi style ordinary keys can be commands,
       // but they would be found by the command check above first.
+      typedCount = 0;
+      typedCounting = 0;
       if (!event->isTranslated)
       {
+        char *text = event->sequence;
+
         // TODO - Should check for tabs to, and insert them.
         //        Though better off having a function for that?
-        mooshStrings(view->line, event->sequence, view->iX, 0, !overWriteMode);
-        view->oW = formatLine(view, view->line->line, &(view->output));
-        moveCursorRelative(view, strlen(event->sequence), 0, 0, 0);
-        updateLine(view);
+        // A count of them all go in at once.
+        if (1 < count)
+        {
+          text = xmalloc(l * count + 1);
+          for (j = 0; j < count; j++)
+            memcpy(&(text[j * l]), event->sequence, l);
+          l *= count;
+        }
+        typeText(view, text, l);
+        if (recording)
+          macroAdd(NULL, text, l, 0);
+        if (text != event->sequence)
+          free(text);
       }
       break;
     }
@@ -1735,6 +9213,9 @@ struct function simpleEditCommands[] =
   {"downPage",		"Move cursor down one page.",		0, {downPage}},
   {"endOfLine",		"Go to end of line.",			0, {endOfLine}},
   {"executeLine",	"Execute a line as a script.",		0, {executeLine}},
+  {"firstLine",		"Go to the first line, or the count'th.",	0, {firstLine}},
+  {"follow",		"Follow the end of the file as it grows.",	0, {followMode}},
+  {"lastLine",		"Go to the last line, or the count'th.",	0, {lastLine}},
   {"leftChar",		"Move cursor left one character.",	0, {leftChar}},
   {"quit",		"Quit the application.",		0, {quit}},
   {"rightChar",		"Move cursor right one character.",	0, {rightChar}},
@@ -1747,6 +9228,25 @@ struct function simpleEditCommands[] =
   {"switchMode",	"Switch between command and box.",	0, {switchMode}},
   {"upLine",		"Move cursor up one line.",		0, {upLine}},
   {"upPage",		"Move cursor up one page.",		0, {upPage}},
+  {"undo",		"Undo the last change.",		0, {undo}},
+  {"redo",		"Redo what was undone.",		0, {redo}},
+  {"recover",		"Recover unsaved changes from last time.",	0, {recover}},
+  {"mark",		"Set the mark, to cut or copy from.",	0, {setMark}},
+  {"cut",		"Cut from the mark, or the line.",	0, {cutRegion}},
+  {"copy",		"Copy from the mark, or the line.",	0, {copyRegion}},
+  {"paste",		"Paste what was cut or copied.",	0, {paste}},
+  {"clipboard",		"Copy what was cut or copied to the terminal clipboard.",	0, {clipboard}},
+  {"search",		"Search forward.",			0, {searchForward}},
+  {"searchBack",	"Search backward.",			0, {searchBackward}},
+  {"searchNext",	"Search again.",			0, {searchNext}},
+  {"searchPrev",	"Search again the other way.",		0, {searchPrevious}},
+  {"searchStop",	"Stop searching.",			0, {searchCancel}},
+  {"incSearch",		"Search forward as it's typed.",	0, {incSearchForward}},
+  {"incSearchBack",	"Search backward as it's typed.",	0, {incSearchBackward}},
+  {"highlight",		"Turn highlighting of matches off or on.",	0, {highlightToggle}},
+  {"filter",		"Only show lines that match, or don't match with a !.",	0, {filterLines}},
+  {"replace",		"Replace all of something with something else.",	0, {replaceAll}},
+  {"source",		"Do the commands in a file.",		0, {source}},
   {NULL, NULL, 0, {NULL}}
 };
 
@@ -1803,6 +9303,30 @@ struct function simpleEmacsCommands[] =
   {"execute-extended-command",	"Switch between command and box.",	0, {switchMode}},		// Actually a one time invocation of the command line.
   {"previous-line",		"Move cursor up one line.",		0, {upLine}},
   {"scroll-down",		"Move cursor up one page.",		0, {upPage}},
+  {"undo",			"Undo the last change.",		0, {undo}},
+  {"undo-redo",			"Redo what was undone.",		0, {redo}},	// From emacs 28, mg does not have it.
+  {"recover-file",		"Recover unsaved changes from last time.",	0, {recover}},
+  {"set-mark-command",		"Set the mark, to cut or copy from.",	0, {setMark}},
+  {"kill-region",		"Cut from the mark, or the line.",	0, {cutRegion}},
+  {"kill-ring-save",		"Copy from the mark, or the line.",	0, {copyRegion}},
+  {"kill-line",			"Cut to the end of the line.",		0, {cutToEnd}},
+  {"yank",			"Paste what was cut or copied.",	0, {paste}},
+  {"yank-pop",			"Swap what was pasted for an older cut.",	0, {yankPop}},
+  {"clipboard-kill-ring-save",	"Copy from the mark to the terminal clipboard.",	0, {copyClipboard}},
+  {"search-forward",		"Search forward.",			0, {searchForward}},
+  {"search-backward",		"Search backward.",			0, {searchBackward}},
+  {"re-search-forward",		"Search forward for a regular expression.",	0, {searchRegexForward}},
+  {"re-search-backward",	"Search backward for a regular expression.",	0, {searchRegexBackward}},
+  {"isearch-forward",		"Search forward as it's typed.",	0, {isearchForward}},
+  {"isearch-backward",		"Search backward as it's typed.",	0, {isearchBackward}},
+  {"isearch-repeat-forward",	"Search for the next one.",		0, {isearchRepeatForward}},
+  {"isearch-repeat-backward",	"Search for the previous one.",		0, {isearchRepeatBackward}},
+  {"replace-string",		"Replace all of something with something else.",	0, {replaceAll}},
+  {"start-kbd-macro",		"Start recording a keyboard macro.",	0, {startMacro}},
+  {"end-kbd-macro",		"Stop recording the keyboard macro.",	0, {macroStop}},
+  {"call-last-kbd-macro",	"Play the keyboard macro, a count after it plays it that many times.",	0, {playMacro}},
+  {"keyboard-quit",		"Give up on the command line.",		0, {cancelPrompt}},
+  {"universal-argument",	"Give the next command a count.",	0, {universalArgument}},
   {NULL, NULL, 0, {NULL}}
 };
 
@@ -1836,12 +9360,30 @@ struct keyCommand simpleEmacsKeys[] =
   {"^X0",	"delete-window"},
   {"Up",	"previous-line"},
   {"^P",	"previous-line"},
+  {"^_",	"undo"},
+  {"^Xu",	"undo"},
+  {"Esc^_",	"undo-redo"},	// C-M-_
+  {"Esc ",	"set-mark-command"},	// C-SPC is a NUL, which can't be in the key table, so M-SPC instead.
+  {"^W",	"kill-region"},
+  {"Escw",	"kill-ring-save"},	// M-w
+  {"^K",	"kill-line"},
+  {"^Y",	"yank"},
+  {"Escy",	"yank-pop"},		// M-y
+  {"^S",	"isearch-forward"},
+  {"^R",	"isearch-backward"},
+  {"Esc^S",	"re-search-forward"},	// C-M-s
+  {"Esc^R",	"re-search-backward"},	// C-M-r
+  {"^U",	"universal-argument"},
+  {"^X(",	"start-kbd-macro"},
+  {"^X)",	"end-kbd-macro"},
+  {"^Xe",	"call-last-kbd-macro"},
   {NULL, NULL}
 };
 
 struct keyCommand simpleEmacsCommandKeys[] =
 {
-  {"Del",	"delete-backwards-char"},
+  {"BS",	"delete-backward-char"},
+  {"Del",	"delete-backward-char"},
   {"^D",	"delete-char"},
   {"Down",	"next-line"},
   {"^N",	"next-line"},
@@ -1858,6 +9400,9 @@ struct keyCommand simpleEmacsCommandKeys[] =
   {"Enter",	"accept-line"},
   {"Return",	"accept-line"},
   {"Escx",	"execute-extended-command"},
+  {"^G",	"keyboard-quit"},
+  {"^S",	"isearch-repeat-forward"},
+  {"^R",	"isearch-repeat-backward"},
   {NULL, NULL}
 };
 
@@ -1909,8 +9454,19 @@ struct function simpleJoeCommands[] =
   {"execmd",	"Switch between command and box.",	0, {switchMode}},	// Actually I think this just switches to the command mode, not back and forth.  Or it might execute the actual command.
   {"uparw",	"Move cursor up one line.",		0, {upLine}},
   {"pgup",	"Move cursor up one page.",		0, {upPage}},
-
-  // Not an actual joe command.
+  {"undo",	"Undo the last change.",		0, {undo}},
+  {"redo",	"Redo what was undone.",		0, {redo}},
+  {"markb",	"Set the mark, to cut or copy from.",	0, {setMark}},
+  {"blkdel",	"Cut from the mark, or the line.",	0, {cutRegion}},
+  {"dellin",	"Cut the line.",			0, {cutLine}},
+  {"ffirst",	"Search forward.",			0, {searchForward}},
+  {"fnext",	"Search again.",			0, {searchNext}},
+
+  // Not actual joe commands.
+  {"recover",	"Recover unsaved changes from last time.",	0, {recover}},
+  {"copy",	"Copy from the mark, or the line.",	0, {copyRegion}},
+  {"paste",	"Paste what was cut or copied.",	0, {paste}},
+  {"clipboard",	"Copy what was cut or copied to the terminal clipboard.",	0, {clipboard}},
   {"executeLine",	"Execute a line as a script.",	0, {executeLine}},	// Perhaps this should be execmd?
   {NULL, NULL, 0, {NULL}}
 };
@@ -1944,6 +9500,16 @@ struct keyCommand simpleJoeKeys[] =
   {"^K^X",	"abort"},	// TODO - These two both close a window, and quit if that was the last window.
   {"Up",	"uparw"},
   {"^P",	"uparw"},
+  {"^_",	"undo"},
+  {"^^",	"redo"},
+  {"^Kb",	"markb"},
+  {"^K^B",	"markb"},
+  {"^Ky",	"blkdel"},
+  {"^K^Y",	"blkdel"},
+  {"^Y",	"dellin"},
+  {"^Kf",	"ffirst"},
+  {"^K^F",	"ffirst"},
+  {"^L",	"fnext"},
   {NULL, NULL}
 };
 
@@ -1965,6 +9531,7 @@ struct keyCommand simpleJoeCommandKeys[] =
   {"^P",	"uparw"},
   {"Enter",	"executeLine"},
   {"Return",	"executeLine"},
+  {"^C",	"execmd"},
   {NULL, NULL}
 };
 
@@ -2005,6 +9572,7 @@ struct keyCommand simpleLessKeys[] =
   {"f",		"downPage"},
   {" ",		"downPage"},
   {"^F",	"downPage"},
+  {"F",		"follow"},
   {"Left",	"leftChar"},
   {"Right",	"rightChar"},
   {"PgUp",	"upPage"},
@@ -2012,12 +9580,23 @@ struct keyCommand simpleLessKeys[] =
   {"^B",	"upPage"},
   {"Up",	"upLine"},
   {"k",		"upLine"},
+  {"/",		"incSearch"},
+  {"?",		"incSearchBack"},
+  {"n",		"searchNext"},
+  {"N",		"searchPrev"},
+  {"^C",	"searchStop"},
+  {"Escu",	"highlight"},
+  {"&",		"filter"},
+  {"g",		"firstLine"},
+  {"<",		"firstLine"},
+  {"G",		"lastLine"},
+  {">",		"lastLine"},
   {NULL, NULL}
 };
 
 struct mode simpleLessMode[] =
 {
-  {simpleLessKeys, NULL, NULL, 0},
+  {simpleLessKeys, NULL, NULL, 2},
   {simpleCommandKeys, NULL, NULL, 1},
   {NULL, NULL, NULL}
 };
@@ -2028,7 +9607,8 @@ struct context simpleLess =
   simpleLessMode,
   NULL,
   NULL,
-  NULL
+  NULL,
+  SEARCH_ERE
 };
 
 struct keyCommand simpleMoreKeys[] =
@@ -2045,12 +9625,17 @@ struct keyCommand simpleMoreKeys[] =
   {"b",		"upPage"},
   {"^B",	"upPage"},
   {"k",		"upLine"},
+  {"/",		"search"},
+  {"n",		"searchNext"},
+  {"^C",	"searchStop"},
+  {"g",		"firstLine"},
+  {"G",		"lastLine"},
   {NULL, NULL}
 };
 
 struct mode simpleMoreMode[] =
 {
-  {simpleMoreKeys, NULL, NULL, 0},
+  {simpleMoreKeys, NULL, NULL, 2},
   {simpleCommandKeys, NULL, NULL, 1},
   {NULL, NULL, NULL}
 };
@@ -2061,7 +9646,8 @@ struct context simpleMore =
   simpleMoreMode,
   NULL,
   NULL,
-  NULL
+  NULL,
+  SEARCH_ERE
 };
 
 
@@ -2084,6 +9670,21 @@ struct keyCommand simpleMceditKeys[] =
   {"Enter",	"splitLine"},
   {"Return",	"splitLine"},
   {"Right",	"rightChar"},
+  {"^U",	"undo"},
+  {"Escr",	"redo"},
+  {"F3",	"mark"},
+  {"Esc3",	"mark"},
+  {"F5",	"copy"},
+  {"Esc5",	"copy"},
+  {"F8",	"cut"},
+  {"Esc8",	"cut"},
+  {"Shift Del",	"cut"},
+  {"Shift Ins",	"paste"},
+  {"F7",	"search"},
+  {"Esc7",	"search"},
+  {"Shift F7",	"searchNext"},
+  {"F4",	"replace"},
+  {"Esc4",	"replace"},
   {"Shift F2",	"switchMode"},	// MC doesn't have a command mode.
   {"Esc:",	"switchMode"},	// Sorta vi like, and coz tmux is screwing with the shift function keys somehow.
   {"Esc|",	"splitV"},	// MC doesn't have a split window concept, so make these up to match tmux more or less.
@@ -2131,6 +9732,19 @@ struct function simpleNanoCommands[] =
   {"home",		"Go to start of line.",			0, {startOfLine}},
   {"up",		"Move cursor up one line.",		0, {upLine}},
   {"upPage",		"Move cursor up one page.",		0, {upPage}},
+  {"undo",		"Undo the last change.",		0, {undo}},
+  {"redo",		"Redo what was undone.",		0, {redo}},
+  {"mark",		"Set the mark, to cut or copy from.",	0, {setMark}},
+  {"cut",		"Cut from the mark, or the line.",	0, {cutRegion}},
+  {"copy",		"Copy from the mark, or the line.",	0, {copyRegion}},
+  {"paste",		"Paste what was cut or copied.",	0, {paste}},
+  {"whereis",		"Search forward.",			0, {searchForward}},
+  {"wherewas",		"Search backward.",			0, {searchBackward}},
+  {"findnext",		"Search again.",			0, {searchNext}},
+  {"findprevious",	"Search again the other way.",		0, {searchPrevious}},
+  {"replace",		"Replace all of something with something else.",	0, {replaceAll}},
+  {"cancel",		"Give up on the prompt.",		0, {cancelPrompt}},
+  {"executeLine",	"Execute a line as a script.",		0, {executeLine}},	// Not an actual nano command.
   {NULL, NULL, 0, {NULL}}
 };
 
@@ -2165,12 +9779,46 @@ struct keyCommand simpleNanoKeys[] =
   {"Right",	"right"},
   {"^P",	"up"},
   {"Up",	"up"},
+  {"Escu",	"undo"},	// M-U
+  {"Esce",	"redo"},	// M-E
+  {"^^",	"mark"},
+  {"Esca",	"mark"},	// M-A
+  {"^K",	"cut"},
+  {"Esc6",	"copy"},	// M-6
+  {"^U",	"paste"},
+  {"^W",	"whereis"},
+  {"^Q",	"wherewas"},
+  {"Escw",	"findnext"},	// M-W
+  {"Escq",	"findprevious"},	// M-Q
+  {"^\\",	"replace"},
+  {"Escr",	"replace"},	// M-R
+  {NULL, NULL}
+};
+
+// For the "enter parameter on this line" prompts.
+struct keyCommand simpleNanoPromptKeys[] =
+{
+  {"BS",	"backSpaceChar"},
+  {"^D",	"delete"},
+  {"Del",	"delete"},
+  {"^E",	"end"},
+  {"End",	"end"},
+  {"^A",	"home"},
+  {"Home",	"home"},
+  {"^B",	"left"},
+  {"Left",	"left"},
+  {"^F",	"right"},
+  {"Right",	"right"},
+  {"Enter",	"executeLine"},
+  {"Return",	"executeLine"},
+  {"^C",	"cancel"},
   {NULL, NULL}
 };
 
 struct mode simpleNanoMode[] =
 {
   {simpleNanoKeys, NULL, NULL, 0},
+  {simpleNanoPromptKeys, NULL, NULL, 1},
   {NULL, NULL, NULL}
 };
 
@@ -2215,6 +9863,7 @@ static int viTempExMode;
 
 void viMode(view *view)
 {
+  promptDone();
   currentBox->view->mode = 0;
   commandMode = 0;
   viTempExMode = 0;
@@ -2244,36 +9893,81 @@ void viBackSpaceChar(view *view)
     backSpaceChar(view);
 }
 
+// In normal mode x never joins lines, a count of them stops at the end of the line.
+void viDeleteChar(view *view)
+{
+  long count, len = strlen(&(view->line->line[view->iX]));
+
+  if (currentBox->view->mode)
+    deleteChar(view);
+  else if ((count = countTake()) && len)
+  {
+    commandCount = (count < len) ? count : len;
+    deleteChar(view);
+  }
+}
+
 void viStartOfNextLine(view *view)
 {
+  long count = countTake();
+
   startOfLine(view);
-  downLine(view);
+  moveCursorRelative(view, 0, count, 0, 0);
 }
 
 struct function simpleViCommands[] =
 {
   // These are actual ex commands.
+  {"d",			"Cut the line, or lines.",		0, {cutLine}},
+  {"delete",		"Cut the line, or lines.",		0, {cutLine}},
+  {"g",			"Do a command on the lines that match, g/this/d.",	0, {viGlobal}},
+  {"global",		"Do a command on the lines that match, g/this/d.",	0, {viGlobal}},
   {"insert",		"Switch to insert mode.",		0, {viInsertMode}},
+  {"k",			"Mark the line, as a to z.",		0, {viMark}},
+  {"mark",		"Mark the line, as a to z.",		0, {viMark}},
+  {"nohlsearch",	"Stop highlighting matches until the next search.",	0, {highlightOff}},
+  {"play",		"Play a buffer's keyboard macro, play a 100 plays a one hundred times.",	0, {viPlay}},
+  {"put",		"Paste after the line, or cursor.",	0, {viPut}},
   {"quit",		"Quit the application.",		0, {quit}},
+  {"record",		"Record a keyboard macro into a buffer, or stop recording.",	0, {viRecord}},
+  {"recover",		"Recover unsaved changes from last time.",	0, {recover}},
+  {"redo",		"Redo what was undone.",		0, {redo}},
+  {"s",			"Substitute, s/this/that/g.",		0, {viSubstitute}},
+  {"so",		"Do the ex commands in a file.",	0, {source}},
+  {"source",		"Do the ex commands in a file.",	0, {source}},
+  {"substitute",	"Substitute, s/this/that/g.",		0, {viSubstitute}},
+  {"undo",		"Undo the last change.",		0, {undo}},
+  {"v",			"Do a command on the lines that don't match, v/this/d.",	0, {viGlobalInverted}},
+  {"vglobal",		"Do a command on the lines that don't match, v/this/d.",	0, {viGlobalInverted}},
   {"visual",		"Switch to visual mode.",		0, {viMode}},
   {"write",		"Save.",				0, {saveContent}},
+  {"y",			"Copy the line, or lines.",		0, {copyLine}},
+  {"yank",		"Copy the line, or lines.",		0, {copyLine}},
 
   // These are not ex commands.
   {"backSpaceChar",	"Back space last character.",		0, {viBackSpaceChar}},
+  {"clipboard",		"Copy what was cut or copied to the terminal clipboard.",	0, {clipboard}},
   {"deleteBox",		"Delete a box.",			0, {deleteBox}},
-  {"deleteChar",	"Delete current character.",		0, {deleteChar}},
+  {"deleteChar",	"Delete current character.",		0, {viDeleteChar}},
   {"downLine",		"Move cursor down one line.",		0, {downLine}},
   {"downPage",		"Move cursor down one page.",		0, {downPage}},
   {"endOfLine",		"Go to end of line.",			0, {endOfLine}},
   {"executeLine",	"Execute a line as a script.",		0, {executeLine}},
   {"exMode",		"Switch to ex mode.",			0, {viExMode}},
+  {"lastLine",		"Go to the last line, or the count'th.",	0, {lastLine}},
   {"leftChar",		"Move cursor left one character.",	0, {leftChar}},
+  {"putBefore",		"Paste before the line, or cursor.",	0, {viPutBefore}},
   {"rightChar",		"Move cursor right one character.",	0, {rightChar}},
+  {"search",		"Search forward.",			0, {searchForward}},
+  {"searchBack",	"Search backward.",			0, {searchBackward}},
+  {"searchNext",	"Search again.",			0, {searchNext}},
+  {"searchPrev",	"Search again the other way.",		0, {searchPrevious}},
+  {"searchStop",	"Stop searching.",			0, {searchCancel}},
   {"splitH",		"Split box in half horizontally.",	0, {halveBoxHorizontally}},
   {"splitLine",		"Split line at cursor.",		0, {splitLine}},
   {"splitV",		"Split box in half vertically.",	0, {halveBoxVertically}},
   {"startOfLine",	"Go to start of line.",			0, {startOfLine}},
-  {"startOfNLine",	"Go to start of next line.",		0, {viStartOfNextLine}},
+  {"startOfNextLine",	"Go to start of next line.",		0, {viStartOfNextLine}},
   {"switchBoxes",	"Switch to another box.",		0, {switchBoxes}},
   {"upLine",		"Move cursor up one line.",		0, {upLine}},
   {"upPage",		"Move cursor up one page.",		0, {upPage}},
@@ -2301,6 +9995,17 @@ struct keyCommand simpleViNormalKeys[] =
   {"Right",	"rightChar"},
   {"l",		"rightChar"},
   {"i",		"insert"},
+  {"u",		"undo"},
+  {"^R",	"redo"},
+  {"dd",	"delete"},
+  {"yy",	"yank"},
+  {"p",		"put"},
+  {"P",		"putBefore"},
+  {"/",		"search"},
+  {"?",		"searchBack"},
+  {"n",		"searchNext"},
+  {"N",		"searchPrev"},
+  {"^C",	"searchStop"},
   {":",		"exMode"},	// This is the temporary ex mode that you can backspace out of.  Or any command backs you out.
   {"Q",		"exMode"},	// This is the ex mode you need to do the "visual" command to get out of.
   {"^Wv",	"splitV"},
@@ -2314,6 +10019,9 @@ struct keyCommand simpleViNormalKeys[] =
   {"^W^Q",	"deleteBox"},
   {"Up",	"upLine"},
   {"k",		"upLine"},
+  {"G",		"lastLine"},
+  {"q",		"record"},
+  {"@",		"play"},
   {NULL, NULL}
 };
 
@@ -2345,7 +10053,7 @@ struct keyCommand simpleExKeys[] =
 
 struct mode simpleViMode[] =
 {
-  {simpleViNormalKeys, NULL, NULL, 0},
+  {simpleViNormalKeys, NULL, NULL, 2},
   {simpleViInsertKeys, NULL, NULL, 0},
   {simpleExKeys, NULL, NULL, 1},
   {NULL, NULL, NULL}
@@ -2357,7 +10065,8 @@ struct context simpleVi =
   simpleViMode,
   NULL,
   NULL,
-  NULL
+  NULL,
+  SEARCH_BRE
 };
 
 
@@ -2365,6 +10074,61 @@ struct context simpleVi =
 // Probably entirely useless for "simple".
 
 
+// Batch mode, for -e and -f, sed don't need no stinkin' UI.  Load the file, or all of stdin, do the commands to it,
+// then save it, or send it to stdout.
+void boxesBatch(struct context *context, unsigned W, unsigned H, int pipeFd)
+{
+  struct content *content;
+  struct arg_list *arg;
+  uint32_t before;
+
+  headless = 1;
+  rootBox = addBox("root", context, (-1 == pipeFd) ? toys.optargs[0] : NULL, 0, 0, W, H - 1);
+  currentBox = rootBox;
+  content = rootBox->view->content;
+  commandLine = addView("command", context, NULL, 0, H, W, 1);
+  if (-1 == pipeFd)
+  {
+    content->budget = TT.b * 1024;
+    loadLines(content, UINT32_MAX);
+  }
+  else
+  {
+    // All of it, so there's no spilling to a temporary file, stdout gets the lines from memory.
+    before = content->lines.length;
+    content->fd = pipeFd;
+    while (0 < readBlock(content))
+      ;
+    content->fd = -1;
+    showMore(content, before);
+  }
+
+  for (arg = TT.e; arg; arg = arg->next)
+    scriptLine(arg->arg, 0, arg->arg);
+  if ((toys.optflags & FLAG_f) && (0 > sourceFile(TT.f)))
+    perror_exit("can't read %s", TT.f);
+  promptDone();
+
+  if (content->path)
+  {
+    if (saveFile(content))
+    {
+      perror_msg("can't save %s", content->path);
+      toys.exitval = 1;
+    }
+  }
+  // Nothing in, and nothing added, is nothing out, not a blank line.
+  else if ((content->loaded || (1 < content->lines.length) || content->lines.next->line[0])
+    && writeLines(1, content->lines.next, &(content->lines)))
+  {
+    perror_msg("can't write");
+    toys.exitval = 1;
+  }
+  // It's saved, or it's gone anyway.
+  journalStop(content, 1);
+}
+
+
 // TODO - have any unrecognised escape key sequence start up a new box (split one) to show the "show keys" content.
 // That just adds each "Key is X" to the end of the content, and allows scrolling, as well as switching between other boxes.
 
@@ -2374,6 +10138,7 @@ void boxes_main(void)
   struct termios termio, oldtermio;
   char *prompt = "Enter a command : ";
   unsigned W = 80, H = 24;
+  int pipeFd = -1;
 
   // For testing purposes, figure out which context we use.  When this gets real, the toybox multiplexer will sort this out for us instead.
   if (toys.optflags & FLAG_m)
@@ -2394,9 +10159,32 @@ void boxes_main(void)
       context = &simpleVi;
   }
 
+  // With a script to run, the terminal is left alone, and ex commands are the default.
+  if (toys.optflags & (FLAG_e | FLAG_f))
+  {
+    if (!(toys.optflags & FLAG_m))
+      context = &simpleVi;
+    if (toys.optflags & FLAG_w)
+      W = TT.w;
+    if (toys.optflags & FLAG_h)
+      H = TT.h;
+    boxesBatch(context, W, H, ((!toys.optargs[0]) || (strcmp(toys.optargs[0], "-") == 0)) ? 0 : -1);
+    return;
+  }
+
   // TODO - Should do an isatty() here, though not sure about the usefullness of driving this from a script or redirected input, since it's supposed to be a UI for terminals.
   //          It would STILL need the terminal size for output though.  Perhaps just bitch and abort if it's not a tty?
-  //          On the other hand, sed don't need no stinkin' UI.  And things like more or less should be usable on the end of a pipe.
+
+  // Things like more or less should be usable on the end of a pipe, so read that, and get the keys from the terminal.
+  if ((!isatty(0)) && ((!toys.optargs[0]) || (strcmp(toys.optargs[0], "-") == 0)))
+  {
+    int tty = open("/dev/tty", O_RDWR);
+
+    if ((-1 == tty) || (-1 == (pipeFd = dup(0))))
+      perror_exit("can't open /dev/tty");
+    dup2(tty, 0);
+    close(tty);
+  }
 
   // Grab the old terminal settings and save it.
   tcgetattr(0, &oldtermio);
@@ -2461,13 +10249,20 @@ void boxes_main(void)
     H = TT.h;
 
   // Create the main box.  Right now the system needs one for wrapping around while switching.  The H - 1 bit is to leave room for our example command line.
-  rootBox = addBox("root", context, toys.optargs[0], 0, 0, W, H - 1);
+  rootBox = addBox("root", context, (-1 == pipeFd) ? toys.optargs[0] : NULL, 0, 0, W, H - 1);
   currentBox = rootBox;
+  rootBox->view->content->budget = TT.b * 1024;
+  if (-1 != pipeFd)
+  {
+    rootBox->view->content->fd = pipeFd;
+    addWatcher(pipeFd, readPipe, rootBox->view->content);
+  }
 
   // Create the command line view, sharing the same context as the root.  It will differentiate based on the view mode of the current box.
   // Also load the command line history as it's file.
   // TODO - different contexts will have different history files, though what to do about ones with no history, and ones with different histories for different modes?
-  commandLine = addView("command", rootBox->view->content->context, ".boxes.history", 0, H, W, 1);
+  commandLine = addView("command", rootBox->view->content->context, NULL, 0, H, W, 1);
+  loadHistory(commandLine, ".boxes.history");
   // Add a prompt to it.
   commandLine->prompt = xrealloc(commandLine->prompt, strlen(prompt) + 1);
   strcpy(commandLine->prompt, prompt);
@@ -2490,6 +10285,8 @@ void boxes_main(void)
 
   calcBoxes(currentBox);
   drawBoxes(currentBox);
+  if (toys.optflags & FLAG_F)
+    followMode(currentBox->view);
   // Do the first cursor update.
   updateLine(currentBox->view);
 
@@ -2497,6 +10294,7 @@ void boxes_main(void)
   handle_keys((long) currentBox->view, handleEvent);
 
   // TODO - Should remember to turn off mouse reporting when we leave.
+  closeJournals(rootBox);
 
   // Restore the old terminal settings.
   tcsetattr(0, TCSANOW, &oldtermio);
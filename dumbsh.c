@@ -201,6 +201,9 @@ static int handleEvent(long extra, struct keyevent *event)
       break;
     }
 
+    // No background work to do, so no need to hurry the next one.
+    case HK_TIMER :  return 0;
+
     case HK_CSI :
     {
       // Is it a cursor location report?
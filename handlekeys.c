@@ -170,6 +170,20 @@ static struct key keys[] =
 
 static volatile sig_atomic_t sigWinch;
 static int stillRunning;
+static int watched[HK_WATCHES], watching;
+
+void handle_keys_watch(int fd, int watch)
+{
+  int i;
+
+  for (i = 0; i < watching; i++)
+    if (watched[i] == fd)
+      break;
+  if (watch && (i == watching) && (watching < HK_WATCHES))
+    watched[watching++] = fd;
+  else if (!watch && (i < watching))
+    watched[i] = watched[--watching];
+}
 
 static void handleSIGWINCH(int signalNumber)
 {
@@ -184,7 +198,7 @@ void handle_keys(long extra, int (*handle_event)(long extra, struct keyevent *ev
   struct sigaction sigAction, oldSigAction;
   sigset_t signalMask;
   char buffer[20], sequence[20];
-  int buffIndex = 0, pendingEsc = 0;
+  int buffIndex = 0, pendingEsc = 0, busy = 1;  // Until the first HK_TIMER says if there's any background work.
 
   buffer[0] = 0;
   sequence[0] = 0;
@@ -204,12 +218,21 @@ void handle_keys(long extra, int (*handle_event)(long extra, struct keyevent *ev
   stillRunning = 1;
   while (stillRunning)
   {
-    int j, p, csi = 0;
+    int j, p, csi = 0, maxFd = 0;
 
     // Apparently it's more portable to reset these each time.
     FD_ZERO(&selectFds);
     FD_SET(0, &selectFds);
+    for (j = 0; j < watching; j++)
+    {
+      FD_SET(watched[j], &selectFds);
+      if (watched[j] > maxFd)
+        maxFd = watched[j];
+    }
     timeOut.tv_sec = 0;  timeOut.tv_nsec = 100000000; // One tenth of a second.
+    // Don't wait if there's background work, unless we need the delay to check for a lone Esc.
+    if (busy && !pendingEsc)
+      timeOut.tv_nsec = 0;
 
     // We got a "terminal size changed" signal, ask the terminal
     // how big it is now.
@@ -226,7 +249,7 @@ void handle_keys(long extra, int (*handle_event)(long extra, struct keyevent *ev
     //        the user requested time ticks.
     // I wanted to use poll, but that would mean using ppoll, which is
     // Linux only, and involves defining swear words to get it.
-    p = pselect(0 + 1, &selectFds, NULL, NULL, &timeOut, &signalMask);
+    p = pselect(maxFd + 1, &selectFds, NULL, NULL, &timeOut, &signalMask);
     if (0 > p)
     {
       if (EINTR == errno)
@@ -242,10 +265,42 @@ void handle_keys(long extra, int (*handle_event)(long extra, struct keyevent *ev
         strcat(sequence, "Esc");
         buffer[0] = buffIndex = 0;
       }
-      // TODO - Call some sort of timer tick callback.  This wont be
-      //        a precise timed event, but don't think we need one.
+      // This wont be a precise timed event, but don't think we need one.
+      event.type = HK_TIMER;
+      event.sequence = "";
+      event.isTranslated = 0;
+      event.count = 0;
+      busy = handle_event(extra, &event);
+    }
+    else
+    {
+      // Copy the list, the callback might change it.
+      int fds[HK_WATCHES], count = watching;
+
+      memcpy(fds, watched, sizeof(fds));
+      for (j = 0; j < count; j++)
+      {
+        if (FD_ISSET(fds[j], &selectFds))
+        {
+          event.type = HK_FD;
+          event.sequence = "";
+          event.isTranslated = 0;
+          event.count = 1;
+          event.params = &fds[j];
+          handle_event(extra, &event);
+        }
+      }
+      // A busy fd never lets pselect() time out, so background work gets a turn after it as well.
+      if (busy)
+      {
+        event.type = HK_TIMER;
+        event.sequence = "";
+        event.isTranslated = 0;
+        event.count = 0;
+        busy = handle_event(extra, &event);
+      }
     }
-    else if ((0 < p) && FD_ISSET(0, &selectFds))
+    if ((0 < p) && FD_ISSET(0, &selectFds))
     {
       j = xread(0, &buffer[buffIndex], sizeof(buffer) - (buffIndex + 1));
       if (j == 0)    // End of file.
@@ -7,7 +7,9 @@ enum keyeventtype{
   HK_CSI,
   HK_KEYS,
   HK_MOUSE,
-  HK_RAW
+  HK_RAW,
+  HK_FD,
+  HK_TIMER
 };
 
 struct keyevent {
@@ -68,9 +70,28 @@ struct keyevent {
  * HK_MOUSE
  *   sequence is the raw bytes of the mouse report.  The rest are not used.
  *
+ * HK_FD
+ *   One of the file descriptors passed to handle_keys_watch() is ready to read.
+ *   count is 1, and params[0] is the file descriptor.  sequence is not used.
+ *   The return value is ignored.
+ *
+ * HK_TIMER
+ *   Nothing else happened for a tenth of a second.  sequence is not used.
+ *   Return non zero if there's more background work to do, then the next
+ *   HK_TIMER is sent as soon as there's nothing else to do, and after each
+ *   lot of HK_FD events, so busy file descriptors don't hold it up.  Return
+ *   0 if there's none, or handle_keys never waits, and eats all the CPU.
+ *
  */
 void handle_keys(long extra, int (*handle_event)(long extra, struct keyevent *event));
 
 
+/* Have handle_keys also watch fd for reading, and send HK_FD events for it.
+ * Pass 0 for watch to stop watching it.  Up to HK_WATCHES at once.
+ */
+#define HK_WATCHES  16
+void handle_keys_watch(int fd, int watch);
+
+
 /* Call this when you want handle_keys to return. */
 void handle_keys_quit();